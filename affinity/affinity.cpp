@@ -0,0 +1,140 @@
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+//不依赖libnuma，直接使用mbind系统调用
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+bool parse_cpu_list( const char* text, cpu_set_t* set ){
+    CPU_ZERO( set );
+    const char* p = text;
+    while( *p ){
+        char* end = 0;
+        long first = strtol( p, &end, 10 );
+        if( end == p || first < 0 || first >= CPU_SETSIZE ){
+            return false;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' ){
+            ++p;
+            last = strtol( p, &end, 10 );
+            if( end == p || last < first || last >= CPU_SETSIZE ){
+                return false;
+            }
+            p = end;
+        }
+        for( long cpu = first; cpu <= last; ++cpu ){
+            CPU_SET( cpu, set );
+        }
+        if( *p == ',' ){
+            ++p;
+        }else if( *p != '\0' ){
+            return false;
+        }
+    }
+    return CPU_COUNT( set ) > 0;
+}
+
+void online_cpus( cpu_set_t* set ){
+    CPU_ZERO( set );
+    if( sched_getaffinity( 0, sizeof( *set ), set ) != 0 ){
+        long n = sysconf( _SC_NPROCESSORS_ONLN );
+        for( long i = 0; i < n && i < CPU_SETSIZE; ++i ){
+            CPU_SET( i, set );
+        }
+    }
+}
+
+int node_of_cpu( int cpu ){
+    //sysfs中 cpuN 目录下有一个 nodeM 链接
+    char path[ 64 ];
+    for( int node = 0; node < 64; ++node ){
+        snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node );
+        if( access( path, F_OK ) == 0 ){
+            return node;
+        }
+    }
+    return 0;
+}
+
+std::vector< cpu_placement > plan_placement( const cpu_set_t& allowed, int reactors ){
+    std::vector< int > cpus;
+    for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ){
+        if( CPU_ISSET( cpu, &allowed ) ){
+            cpus.push_back( cpu );
+        }
+    }
+
+    std::vector< cpu_placement > plan;
+    if( reactors == 0 ){
+        //每个节点一个reactor，节点内的cpu归它所有
+        for( size_t i = 0; i < cpus.size(); ++i ){
+            int node = node_of_cpu( cpus[i] );
+            size_t j = 0;
+            for( ; j < plan.size(); ++j ){
+                if( plan[j].node == node ){
+                    break;
+                }
+            }
+            if( j == plan.size() ){
+                cpu_placement p;
+                CPU_ZERO( &p.cpus );
+                p.node = node;
+                plan.push_back( p );
+            }
+            CPU_SET( cpus[i], &plan[j].cpus );
+        }
+        return plan;
+    }
+
+    //按顺序平均切分，cpu比reactor少的时候多个reactor共用cpu
+    int n = cpus.size();
+    for( int r = 0; r < reactors; ++r ){
+        cpu_placement p;
+        CPU_ZERO( &p.cpus );
+        int first = n * r / reactors;
+        int last = n * ( r + 1 ) / reactors;
+        if( last <= first ){
+            last = first + 1;
+        }
+        p.node = -2;
+        for( int i = first; i < last && n > 0; ++i ){
+            int cpu = cpus[ i % n ];
+            CPU_SET( cpu, &p.cpus );
+            int node = node_of_cpu( cpu );
+            p.node = ( p.node == -2 || p.node == node ) ? node : -1;
+        }
+        if( p.node == -2 ){
+            p.node = -1;
+        }
+        plan.push_back( p );
+    }
+    return plan;
+}
+
+bool pin_thread( pthread_t thread, const cpu_set_t& cpus ){
+    return pthread_setaffinity_np( thread, sizeof( cpus ), &cpus ) == 0;
+}
+
+bool prefer_node_memory( void* addr, size_t len, int node ){
+    if( node < 0 || node >= 64 ){
+        return false;
+    }
+    //mbind要求起始地址按页对齐，只处理内部完整的页
+    uintptr_t page = sysconf( _SC_PAGESIZE );
+    uintptr_t start = ( (uintptr_t)addr + page - 1 ) & ~( page - 1 );
+    uintptr_t end = ( (uintptr_t)addr + len ) & ~( page - 1 );
+    if( end <= start ){
+        return false;
+    }
+    unsigned long mask = 1UL << node;
+    return syscall( SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, sizeof( mask ) * 8, 0 ) == 0;
+}
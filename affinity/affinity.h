@@ -0,0 +1,32 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+//一组cpu以及它们所在的NUMA节点，reactor和它的线程池共用一个placement
+struct cpu_placement{
+    cpu_set_t cpus;
+    //cpus全部位于同一节点时为节点号，否则为-1
+    int node;
+};
+
+//解析 0-3,8-11 形式的cpu列表
+bool parse_cpu_list( const char* text, cpu_set_t* set );
+//进程当前允许运行的cpu
+void online_cpus( cpu_set_t* set );
+//cpu所在的NUMA节点，没有NUMA信息时返回0
+int node_of_cpu( int cpu );
+
+//把allowed中的cpu划分给reactors个reactor
+//reactors为0时每个NUMA节点一个reactor，否则按顺序平均切分
+std::vector< cpu_placement > plan_placement( const cpu_set_t& allowed, int reactors );
+
+//把线程绑定到一组cpu上
+bool pin_thread( pthread_t thread, const cpu_set_t& cpus );
+//把[addr, addr+len)中尚未分配物理页的部分优先分配到node节点（首次访问时生效）
+bool prefer_node_memory( void* addr, size_t len, int node );
+
+#endif
@@ -0,0 +1,399 @@
+#include "user_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+//每个分片初始的桶数量，平均链长超过2时翻倍
+static const size_t INITIAL_BUCKETS = 64;
+
+user_store::user_store(): m_sync( true ), m_tail( 0 ){
+    for( int i = 0; i < SHARDS; ++i ){
+        shard& s = m_shards[i];
+        table* t = new table;
+        t->mask = INITIAL_BUCKETS - 1;
+        t->buckets = new std::atomic< node* >[ INITIAL_BUCKETS ];
+        for( size_t b = 0; b < INITIAL_BUCKETS; ++b ){
+            t->buckets[b].store( 0, std::memory_order_relaxed );
+        }
+        s.tbl.store( t );
+        s.count = 0;
+        s.fd = -1;
+        s.replayed = 0;
+    }
+}
+
+user_store::~user_store(){
+    if( m_tail ){
+        munmap( m_tail, sizeof( std::atomic< uint64_t > ) * SHARDS );
+    }
+    for( int i = 0; i < SHARDS; ++i ){
+        shard& s = m_shards[i];
+        if( s.fd >= 0 ){
+            close( s.fd );
+        }
+        s.retired.push_back( s.tbl.load() );
+        for( size_t j = 0; j < s.retired.size(); ++j ){
+            delete [] s.retired[j]->buckets;
+            delete s.retired[j];
+        }
+        for( size_t j = 0; j < s.nodes.size(); ++j ){
+            delete s.nodes[j];
+        }
+        for( size_t j = 0; j < s.entries.size(); ++j ){
+            delete s.entries[j];
+        }
+    }
+}
+
+//FNV-1a，高位选分片，低位选桶
+uint64_t user_store::hash_name( const char* name, size_t len ){
+    uint64_t h = 1469598103934665603ULL;
+    for( size_t i = 0; i < len; ++i ){
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool user_store::valid_name( const char* name ){
+    size_t len = strlen( name );
+    if( len == 0 || len > (size_t)MAX_NAME_LEN ){
+        return false;
+    }
+    for( size_t i = 0; i < len; ++i ){
+        unsigned char c = name[i];
+        if( !isalnum( c ) && !strchr( "_.-@", c ) ){
+            return false;
+        }
+    }
+    return true;
+}
+
+//cost为0的是旧格式的记录：sha256(盐+密码)；否则是cost次迭代的PBKDF2-HMAC-SHA256
+static bool hash_password( const unsigned char* salt, unsigned int cost, const char* password, unsigned char* out ){
+    size_t len = strlen( password );
+    if( cost > 0 ){
+        return PKCS5_PBKDF2_HMAC( password, len, salt, 16, cost, EVP_sha256(), 32, out ) == 1;
+    }
+    unsigned char buf[ 16 + user_store::MAX_PASSWORD_LEN ];
+    memcpy( buf, salt, 16 );
+    memcpy( buf + 16, password, len );
+    unsigned int out_len = 32;
+    int ok = EVP_Digest( buf, 16 + len, out, &out_len, EVP_sha256(), NULL );
+    OPENSSL_cleanse( buf, sizeof( buf ) );
+    return ok == 1;
+}
+
+static void to_hex( const unsigned char* in, size_t len, char* out ){
+    static const char digits[] = "0123456789abcdef";
+    for( size_t i = 0; i < len; ++i ){
+        out[ 2 * i ] = digits[ in[i] >> 4 ];
+        out[ 2 * i + 1 ] = digits[ in[i] & 15 ];
+    }
+    out[ 2 * len ] = '\0';
+}
+
+static bool from_hex( const char* in, size_t in_len, unsigned char* out, size_t len ){
+    if( in_len != 2 * len ){
+        return false;
+    }
+    for( size_t i = 0; i < len; ++i ){
+        int v = 0;
+        for( int k = 0; k < 2; ++k ){
+            char c = in[ 2 * i + k ];
+            v <<= 4;
+            if( c >= '0' && c <= '9' ){
+                v |= c - '0';
+            }else if( c >= 'a' && c <= 'f' ){
+                v |= c - 'a' + 10;
+            }else{
+                return false;
+            }
+        }
+        out[i] = v;
+    }
+    return true;
+}
+
+const user_store::entry* user_store::find( shard& s, const char* name, uint64_t h ){
+    table* t = s.tbl.load( std::memory_order_acquire );
+    for( node* n = t->buckets[ h & t->mask ].load( std::memory_order_acquire ); n; n = n->next ){
+        if( n->e->name == name ){
+            return n->e;
+        }
+    }
+    return 0;
+}
+
+void user_store::publish( shard& s, entry* e, uint64_t h ){
+    table* t = s.tbl.load( std::memory_order_relaxed );
+    if( s.count + 1 > ( t->mask + 1 ) * 2 ){
+        //扩容：新的桶数组使用新的节点，旧数组上的读者不受影响
+        table* bigger = new table;
+        size_t size = ( t->mask + 1 ) * 2;
+        bigger->mask = size - 1;
+        bigger->buckets = new std::atomic< node* >[ size ];
+        for( size_t b = 0; b < size; ++b ){
+            bigger->buckets[b].store( 0, std::memory_order_relaxed );
+        }
+        for( size_t b = 0; b <= t->mask; ++b ){
+            for( node* n = t->buckets[b].load( std::memory_order_relaxed ); n; n = n->next ){
+                uint64_t nh = hash_name( n->e->name.data(), n->e->name.size() );
+                std::atomic< node* >& head = bigger->buckets[ nh & bigger->mask ];
+                node* copy = new node;
+                copy->e = n->e;
+                copy->next = head.load( std::memory_order_relaxed );
+                head.store( copy, std::memory_order_relaxed );
+                s.nodes.push_back( copy );
+            }
+        }
+        s.tbl.store( bigger, std::memory_order_release );
+        s.retired.push_back( t );
+        t = bigger;
+    }
+    std::atomic< node* >& head = t->buckets[ h & t->mask ];
+    node* n = new node;
+    n->e = e;
+    n->next = head.load( std::memory_order_relaxed );
+    //节点内容先写好，再通过release发布给无锁的读者
+    head.store( n, std::memory_order_release );
+    s.nodes.push_back( n );
+    s.entries.push_back( e );
+    ++s.count;
+}
+
+//只解析完整的行，最后不完整的一行不计入replayed，下次再读
+//replayed在这些行都发布之后才更新，check看到replayed时对应的用户一定已经能找到
+void user_store::parse_log( shard& s, const char* data, size_t len ){
+    size_t pos = 0;
+    while( pos < len ){
+        const char* line = data + pos;
+        const char* end = (const char*)memchr( line, '\n', len - pos );
+        if( !end ){
+            break;
+        }
+        pos = end - data + 1;
+
+        //用户名 [迭代次数] 盐 哈希，没有迭代次数的是旧格式
+        const char* sp1 = (const char*)memchr( line, ' ', end - line );
+        const char* sp2 = sp1 ? (const char*)memchr( sp1 + 1, ' ', end - sp1 - 1 ) : 0;
+        if( !sp2 || sp1 - line > MAX_NAME_LEN ){
+            continue;
+        }
+        entry* e = new entry;
+        e->name.assign( line, sp1 - line );
+        e->cost = 0;
+        const char* sp3 = (const char*)memchr( sp2 + 1, ' ', end - sp2 - 1 );
+        if( sp3 ){
+            char* num_end = 0;
+            unsigned long cost = strtoul( sp1 + 1, &num_end, 10 );
+            if( num_end != sp2 || cost == 0 || cost > MAX_PASSWORD_COST ){
+                delete e;
+                continue;
+            }
+            e->cost = cost;
+            sp1 = sp2;
+            sp2 = sp3;
+        }
+        if( !from_hex( sp1 + 1, sp2 - sp1 - 1, e->salt, sizeof( e->salt ) )
+                || !from_hex( sp2 + 1, end - sp2 - 1, e->hash, sizeof( e->hash ) )
+                || !valid_name( e->name.c_str() ) ){
+            delete e;
+            continue;
+        }
+        uint64_t h = hash_name( e->name.data(), e->name.size() );
+        if( find( s, e->name.c_str(), h ) ){
+            delete e;
+            continue;
+        }
+        publish( s, e, h );
+    }
+    s.replayed.store( s.replayed.load( std::memory_order_relaxed ) + pos, std::memory_order_release );
+}
+
+//读取日志中本进程还没有看到的部分，调用前持有分片的锁
+bool user_store::catch_up( shard& s ){
+    struct stat st;
+    if( fstat( s.fd, &st ) < 0 ){
+        return false;
+    }
+    off_t replayed = s.replayed.load( std::memory_order_relaxed );
+    if( st.st_size <= replayed ){
+        return true;
+    }
+    size_t len = st.st_size - replayed;
+    std::vector< char > buf( len );
+    size_t got = 0;
+    while( got < len ){
+        ssize_t n = pread( s.fd, &buf[ got ], len - got, replayed + got );
+        if( n <= 0 ){
+            break;
+        }
+        got += n;
+    }
+    parse_log( s, &buf[0], got );
+    return true;
+}
+
+bool user_store::open( const char* path, bool sync ){
+    m_sync = sync;
+    int total = 0;
+    //日志长度表映射失败时只是失去不加锁的快速判断
+    char tail_name[ 4096 ];
+    snprintf( tail_name, sizeof( tail_name ), "%s.tail", path );
+    size_t tail_len = sizeof( std::atomic< uint64_t > ) * SHARDS;
+    int tail_fd = ::open( tail_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+    if( tail_fd >= 0 && ftruncate( tail_fd, tail_len ) == 0 ){
+        void* p = mmap( NULL, tail_len, PROT_READ | PROT_WRITE, MAP_SHARED, tail_fd, 0 );
+        if( p != MAP_FAILED ){
+            m_tail = (std::atomic< uint64_t >*)p;
+        }
+    }
+    if( tail_fd >= 0 ){
+        close( tail_fd );
+    }
+    if( !m_tail ){
+        printf( "user db %s: cannot map, every miss reads the log\n", tail_name );
+    }
+    for( int i = 0; i < SHARDS; ++i ){
+        shard& s = m_shards[i];
+        char name[ 4096 ];
+        snprintf( name, sizeof( name ), "%s.%d", path, i );
+        s.fd = ::open( name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600 );
+        if( s.fd < 0 ){
+            printf( "cannot open user db %s\n", name );
+            return false;
+        }
+        flock( s.fd, LOCK_EX );
+        //上次写到一半的行直接丢掉，保证新追加的行从行首开始
+        struct stat st;
+        if( fstat( s.fd, &st ) == 0 && st.st_size > 0 ){
+            off_t end = st.st_size;
+            char c;
+            while( end > 0 && pread( s.fd, &c, 1, end - 1 ) == 1 && c != '\n' ){
+                --end;
+            }
+            if( end != st.st_size ){
+                printf( "user db %s: drop %d bytes of a torn record\n", name, (int)( st.st_size - end ) );
+                if( ftruncate( s.fd, end ) != 0 ){
+                    printf( "user db %s: truncate failed\n", name );
+                }
+            }
+        }
+        s.lock.lock();
+        catch_up( s );
+        total += s.count;
+        //持有排他锁并且读到了文件末尾，以这次的长度为准，修正截断或者复制过来的日志
+        if( m_tail ){
+            m_tail[i].store( s.replayed.load(), std::memory_order_release );
+        }
+        s.lock.unlock();
+        flock( s.fd, LOCK_UN );
+    }
+    printf( "user db %s: %d users\n", path, total );
+    return true;
+}
+
+user_store::RESULT user_store::check( const char* name, const char* password ){
+    if( !valid_name( name ) || strlen( password ) > (size_t)MAX_PASSWORD_LEN ){
+        return INVALID;
+    }
+    size_t len = strlen( name );
+    uint64_t h = hash_name( name, len );
+    int index = ( h >> 56 ) % SHARDS;
+    shard& s = m_shards[ index ];
+    //先取两个长度再查找：日志没有超过本进程读到的位置时，读到的部分都已经发布，找不到就是没有这个用户
+    bool grown = !m_tail || m_tail[ index ].load( std::memory_order_acquire )
+            > (uint64_t)s.replayed.load( std::memory_order_acquire );
+    const entry* e = find( s, name, h );
+    if( !e && s.fd >= 0 && grown ){
+        //可能是其他worker进程刚注册的，读一下新追加的日志
+        s.lock.lock();
+        flock( s.fd, LOCK_SH );
+        catch_up( s );
+        flock( s.fd, LOCK_UN );
+        s.lock.unlock();
+        e = find( s, name, h );
+    }
+    unsigned char digest[32];
+    if( !e ){
+        //没有这个用户时也算一次同样代价的哈希，不能从响应时间判断用户名是否存在
+        static const unsigned char dummy_salt[16] = { 0 };
+        hash_password( dummy_salt, PASSWORD_COST, password, digest );
+        return NO_USER;
+    }
+    if( !hash_password( e->salt, e->cost, password, digest ) ){
+        return IO_ERROR;
+    }
+    return CRYPTO_memcmp( digest, e->hash, sizeof( digest ) ) == 0 ? OK : WRONG_PASSWORD;
+}
+
+user_store::RESULT user_store::add( const char* name, const char* password ){
+    size_t pw_len = strlen( password );
+    if( !valid_name( name ) || pw_len == 0 || pw_len > (size_t)MAX_PASSWORD_LEN ){
+        return INVALID;
+    }
+    size_t len = strlen( name );
+    uint64_t h = hash_name( name, len );
+    int index = ( h >> 56 ) % SHARDS;
+    shard& s = m_shards[ index ];
+    if( find( s, name, h ) ){
+        return EXISTS;
+    }
+
+    entry* e = new entry;
+    e->name = name;
+    if( getrandom( e->salt, sizeof( e->salt ), 0 ) != (ssize_t)sizeof( e->salt ) ){
+        delete e;
+        return IO_ERROR;
+    }
+    e->cost = PASSWORD_COST;
+    if( !hash_password( e->salt, e->cost, password, e->hash ) ){
+        delete e;
+        return IO_ERROR;
+    }
+    char line[ MAX_NAME_LEN + 1 + 10 + 1 + 32 + 1 + 64 + 2 ];
+    char salt_hex[ 33 ], hash_hex[ 65 ];
+    to_hex( e->salt, sizeof( e->salt ), salt_hex );
+    to_hex( e->hash, sizeof( e->hash ), hash_hex );
+    int line_len = snprintf( line, sizeof( line ), "%s %u %s %s\n", name, e->cost, salt_hex, hash_hex );
+
+    //只持有这一个分片的锁；flock保证多个进程不会同时追加同一个分片
+    s.lock.lock();
+    flock( s.fd, LOCK_EX );
+    catch_up( s );
+    RESULT ret = OK;
+    if( find( s, name, h ) ){
+        ret = EXISTS;
+    }else if( write( s.fd, line, line_len ) != line_len || ( m_sync && fdatasync( s.fd ) != 0 ) ){
+        //还持有排他锁，把写了一半或者没有落盘的行截掉，不然下一次追加会接在它后面，
+        //或者告诉客户注册失败之后又被重放出来
+        ret = IO_ERROR;
+        if( ftruncate( s.fd, s.replayed.load( std::memory_order_relaxed ) ) != 0 ){
+            printf( "user db: cannot truncate a failed record\n" );
+        }
+    }
+    if( ret == OK ){
+        //持有排他锁并且已经读到文件末尾，新写的一行紧接在后面
+        publish( s, e, h );
+        s.replayed.store( s.replayed.load( std::memory_order_relaxed ) + line_len, std::memory_order_release );
+        if( m_tail ){
+            m_tail[ index ].store( s.replayed.load( std::memory_order_relaxed ), std::memory_order_release );
+        }
+    }else{
+        delete e;
+    }
+    flock( s.fd, LOCK_UN );
+    s.lock.unlock();
+    return ret;
+}
@@ -0,0 +1,86 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "../locker/locker.h"
+
+//内置的用户名/密码存储，代替登录注册时的数据库
+//按用户名哈希分成SHARDS个分片，每个分片一个只追加的日志文件 <path>.<分片号>，
+//每行 用户名 迭代次数 盐 PBKDF2-HMAC-SHA256(密码, 盐, 迭代次数)，启动时重放日志得到内存中的哈希表；
+//迭代次数随记录保存，调整PASSWORD_COST不影响已有的用户，没有迭代次数的旧记录是 用户名 盐 sha256(盐+密码)
+//
+//读：哈希表只增不删，登录校验时不加锁，只做acquire读
+//写：注册只持有一个分片的锁，先追加日志再发布到哈希表；扩容时复制一份新的桶数组再替换，
+//    旧的桶数组可能还有线程在读，留到析构时再释放
+//多进程：每个worker进程各自打开日志文件，写日志时用flock互斥，
+//        本进程找不到的用户先读取其他进程追加的日志再判断；
+//        共享映射的 <path>.tail 记录每个分片日志写到的长度，本进程已经读到这个长度时直接返回，不加锁
+class user_store{
+public:
+    static const int SHARDS = 16;
+    static const int MAX_NAME_LEN = 64;
+    static const int MAX_PASSWORD_LEN = 128;
+    //新注册用户的PBKDF2迭代次数，读日志时超过MAX_PASSWORD_COST的记录视为损坏
+    static const unsigned int PASSWORD_COST = 100000;
+    static const unsigned int MAX_PASSWORD_COST = 10000000;
+    enum RESULT { OK = 0, NO_USER, WRONG_PASSWORD, EXISTS, INVALID, IO_ERROR };
+
+    user_store();
+    ~user_store();
+
+    //打开并重放所有分片的日志，sync为true时每次注册都fdatasync
+    bool open( const char* path, bool sync );
+    //登录校验，正常情况下不加锁
+    RESULT check( const char* name, const char* password );
+    //注册，用户已存在时返回EXISTS
+    RESULT add( const char* name, const char* password );
+
+private:
+    struct entry{
+        std::string name;
+        //PBKDF2迭代次数，0为旧格式
+        unsigned int cost;
+        unsigned char salt[16];
+        unsigned char hash[32];
+    };
+    //桶中的链表节点，发布之后不再修改
+    struct node{
+        const entry* e;
+        node* next;
+    };
+    struct table{
+        size_t mask;
+        std::atomic< node* >* buckets;
+    };
+    struct shard{
+        std::atomic< table* > tbl;
+        size_t count;
+        locker lock;
+        int fd;
+        //本进程已经重放到的日志位置，check中不加锁读取
+        std::atomic< off_t > replayed;
+        //被替换的桶数组和所有节点，析构时释放
+        std::vector< table* > retired;
+        std::vector< node* > nodes;
+        std::vector< entry* > entries;
+    };
+
+    static uint64_t hash_name( const char* name, size_t len );
+    static bool valid_name( const char* name );
+    const entry* find( shard& s, const char* name, uint64_t h );
+    //加锁后调用
+    void publish( shard& s, entry* e, uint64_t h );
+    bool catch_up( shard& s );
+    void parse_log( shard& s, const char* data, size_t len );
+
+    shard m_shards[ SHARDS ];
+    bool m_sync;
+    //所有进程共享的每个分片日志长度，只在持有flock时写，打不开时为0，每次都去读日志
+    std::atomic< uint64_t >* m_tail;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "bundle.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+asset_bundle::asset_bundle():
+    m_base( 0 ), m_size( 0 ), m_index( 0 ), m_strings( 0 ), m_count( 0 ){
+}
+
+asset_bundle::~asset_bundle(){
+    if( m_base ){
+        munmap( m_base, m_size );
+    }
+}
+
+//[off, off+len)在[0, size)之内，写成减法避免off+len在uint64中回绕
+static bool in_range( uint64_t off, uint64_t len, uint64_t size ){
+    return off <= size && len <= size - off;
+}
+
+bool asset_bundle::open( const char* path ){
+    int fd = ::open( path, O_RDONLY );
+    if( fd < 0 ){
+        printf( "cannot open bundle %s\n", path );
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) < 0 || st.st_size < (off_t)sizeof( bundle_header ) ){
+        close( fd );
+        printf( "bad bundle %s\n", path );
+        return false;
+    }
+    //只读共享映射，多个worker进程共用page cache
+    char* base = (char*)mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( base == MAP_FAILED ){
+        printf( "cannot map bundle %s\n", path );
+        return false;
+    }
+
+    const bundle_header* h = (const bundle_header*)base;
+    uint64_t size = st.st_size;
+    bool ok = memcmp( h->magic, BUNDLE_MAGIC, sizeof( BUNDLE_MAGIC ) ) == 0
+        && h->version == BUNDLE_VERSION && h->file_size == size
+        && in_range( h->index_offset, (uint64_t)h->count * sizeof( bundle_entry ), size )
+        && in_range( h->strings_offset, h->strings_size, size );
+    const bundle_entry* index = (const bundle_entry*)( base + h->index_offset );
+    //每一项都要在文件范围内，之后的请求路径上不再检查
+    //path和mime后面还要有结尾的'\0'
+    const char* strings = base + h->strings_offset;
+    for( uint32_t i = 0; ok && i < h->count; ++i ){
+        const bundle_entry& e = index[i];
+        ok = in_range( e.path_offset, (uint64_t)e.path_len + 1, h->strings_size )
+            && in_range( e.mime_offset, (uint64_t)e.mime_len + 1, h->strings_size )
+            && strings[ e.mime_offset + e.mime_len ] == '\0'
+            && in_range( e.data_offset, e.length, size )
+            && in_range( e.gzip_offset, e.gzip_length, size )
+            && memchr( e.etag, '\0', BUNDLE_ETAG_LEN ) != NULL;
+    }
+    if( !ok ){
+        munmap( base, st.st_size );
+        printf( "bad bundle %s\n", path );
+        return false;
+    }
+
+    m_base = base;
+    m_size = st.st_size;
+    m_index = index;
+    m_strings = base + h->strings_offset;
+    m_count = h->count;
+    //索引和字符串表每个请求都要访问，提前读入
+    madvise( base, h->strings_offset + h->strings_size, MADV_WILLNEED );
+    printf( "bundle %s: %d files\n", path, m_count );
+    return true;
+}
+
+const bundle_entry* asset_bundle::find( const char* path, size_t len ) const{
+    int lo = 0;
+    int hi = m_count - 1;
+    while( lo <= hi ){
+        int mid = ( lo + hi ) / 2;
+        const bundle_entry* e = m_index + mid;
+        size_t n = len < e->path_len ? len : e->path_len;
+        int cmp = memcmp( path, m_strings + e->path_offset, n );
+        if( cmp == 0 ){
+            cmp = ( len < e->path_len ) ? -1 : ( len > e->path_len ? 1 : 0 );
+        }
+        if( cmp == 0 ){
+            return e;
+        }
+        if( cmp < 0 ){
+            hi = mid - 1;
+        }else{
+            lo = mid + 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include "bundle_format.h"
+
+//只读的打包文件，启动时整体mmap一次，之后所有线程/进程共享
+//命中时响应体直接指向映射中的切片，不需要stat/open/mmap
+class asset_bundle{
+public:
+    asset_bundle();
+    ~asset_bundle();
+
+    //映射并校验打包文件
+    bool open( const char* path );
+    //path不需要以'\0'结尾，len是长度
+    const bundle_entry* find( const char* path, size_t len ) const;
+
+    const char* data( const bundle_entry* e ) const { return m_base + e->data_offset; }
+    const char* gzip_data( const bundle_entry* e ) const { return m_base + e->gzip_offset; }
+    const char* mime( const bundle_entry* e ) const { return m_strings + e->mime_offset; }
+    int count() const { return m_count; }
+
+private:
+    char* m_base;
+    size_t m_size;
+    const bundle_entry* m_index;
+    const char* m_strings;
+    int m_count;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef BUNDLE_FORMAT_H
+#define BUNDLE_FORMAT_H
+
+#include <stdint.h>
+
+//打包文件的磁盘格式，打包工具和服务器共用
+//  [header][entry * count][string table][padding][data ...]
+//entry按path的字节序排序，用二分查找
+//每个文件的内容（以及可选的gzip版本）都按页对齐，可以直接作为响应体发送
+//所有整数都是小端
+
+#define BUNDLE_MAGIC "HWSBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_ETAG_LEN 24
+
+struct bundle_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t file_size;
+};
+
+struct bundle_entry{
+    //path和mime都在字符串表中，以'\0'结尾，长度不含'\0'
+    uint32_t path_offset;
+    uint32_t path_len;
+    uint32_t mime_offset;
+    uint32_t mime_len;
+    uint64_t data_offset;
+    uint64_t length;
+    //没有gzip版本时为0
+    uint64_t gzip_offset;
+    uint64_t gzip_length;
+    int64_t mtime;
+    //带引号的强校验ETag，以'\0'结尾
+    char etag[ BUNDLE_ETAG_LEN ];
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "mime.h"
+
+#include <string.h>
+#include <strings.h>
+
+struct mime_entry{
+    const char* ext;
+    const char* type;
+};
+
+static const mime_entry mime_table[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "application/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "ico", "image/x-icon" },
+    { "webp", "image/webp" },
+    { "mp4", "video/mp4" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "pdf", "application/pdf" },
+    { "wasm", "application/wasm" },
+};
+
+const char* mime_type( const char* path ){
+    const char* slash = strrchr( path, '/' );
+    const char* dot = strrchr( slash ? slash : path, '.' );
+    if( dot ){
+        for( size_t i = 0; i < sizeof( mime_table ) / sizeof( mime_table[0] ); ++i ){
+            if( strcasecmp( dot + 1, mime_table[i].ext ) == 0 ){
+                return mime_table[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+bool mime_compressible( const char* mime ){
+    return strncmp( mime, "text/", 5 ) == 0
+        || strncmp( mime, "application/javascript", 22 ) == 0
+        || strncmp( mime, "application/json", 16 ) == 0
+        || strncmp( mime, "application/xml", 15 ) == 0
+        || strncmp( mime, "image/svg+xml", 13 ) == 0;
+}
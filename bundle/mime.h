@@ -0,0 +1,9 @@
+#ifndef MIME_H
+#define MIME_H
+
+//根据文件扩展名得到Content-Type，未知类型返回application/octet-stream
+const char* mime_type( const char* path );
+//文本类的内容值得预先压缩
+bool mime_compressible( const char* mime );
+
+#endif
@@ -0,0 +1,237 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+
+server_config::server_config():
+    ip( "0.0.0.0" ), port( 12345 ),
+    threads( 8 ), max_threads( 0 ), grow_wait_us( 2000 ), idle_ms( 30000 ),
+    max_requests( 10000 ), reactors( 1 ),
+    pin( false ), numa( false ), incoming_cpu( false ),
+    workers( 0 ), drain_ms( 30000 ), user_db_sync( true ),
+    tls_port( 0 ), tls_ktls( true ), tls_cache( 4096 ),
+    rate_limit( 0 ), rate_burst( 0 ), conn_limit( 0 ), limit_prefix4( 32 ), limit_prefix6( 64 ),
+    limit_slots( 262144 ), upload_max_mb( 1024 ), upload_total_mb( 4096 ), upload_sync( true ),
+    write_quantum_kb( 256 ), reactor_budget_kb( 4096 ), coro( false ), coro_idle_ms( 60000 ){
+}
+
+//所有可配置项，命令行的长选项也由这张表生成
+//OPT_LIST每出现一次追加一项
+enum OPTION_KIND { OPT_INT = 0, OPT_BOOL, OPT_STRING, OPT_LIST };
+struct option_entry{
+    const char* key;
+    OPTION_KIND kind;
+    int server_config::* int_field;
+    bool server_config::* bool_field;
+    std::string server_config::* string_field;
+    const char* help;
+    std::vector< std::string > server_config::* list_field;
+};
+
+static const option_entry options_table[] = {
+    { "ip", OPT_STRING, 0, 0, &server_config::ip, "listen address" },
+    { "port", OPT_INT, &server_config::port, 0, 0, "listen port, 0 = only the listen entries" },
+    { "listen", OPT_LIST, 0, 0, 0, "extra listener: HOST:PORT | [IPV6]:PORT | unix:PATH [tls]",
+        &server_config::listens },
+    { "threads", OPT_INT, &server_config::threads, 0, 0, "worker threads per reactor (minimum)" },
+    { "max_threads", OPT_INT, &server_config::max_threads, 0, 0, "autoscale upper bound, 0 = fixed size" },
+    { "grow_wait_us", OPT_INT, &server_config::grow_wait_us, 0, 0, "queue wait that triggers growth" },
+    { "idle_ms", OPT_INT, &server_config::idle_ms, 0, 0, "idle time before an extra worker exits" },
+    { "max_requests", OPT_INT, &server_config::max_requests, 0, 0, "max queued requests per pool" },
+    { "reactors", OPT_INT, &server_config::reactors, 0, 0, "event loops, 0 = one per NUMA node" },
+    { "cpus", OPT_STRING, 0, 0, &server_config::cpus, "cpu list, e.g. 0-3,8-11" },
+    { "pin", OPT_BOOL, 0, &server_config::pin, 0, "pin reactors and workers to their cpu set" },
+    { "numa", OPT_BOOL, 0, &server_config::numa, 0, "node-local connection memory" },
+    { "incoming_cpu", OPT_BOOL, 0, &server_config::incoming_cpu, 0, "steer RX queues with SO_INCOMING_CPU" },
+    { "workers", OPT_INT, &server_config::workers, 0, 0, "prefork worker processes, 0 = single process" },
+    { "drain_ms", OPT_INT, &server_config::drain_ms, 0, 0, "graceful worker shutdown timeout" },
+    { "bundle", OPT_STRING, 0, 0, &server_config::bundle, "packed doc_root made by bundle_pack" },
+    { "user_db", OPT_STRING, 0, 0, &server_config::user_db, "user store log prefix, enables built-in login/register" },
+    { "user_db_sync", OPT_BOOL, 0, &server_config::user_db_sync, 0, "fdatasync each registration" },
+    { "route", OPT_LIST, 0, 0, 0, "extra route: METHODS PATH[*] static|alias|redirect|internal|cgi|proxy|websocket|upload [TARGET] [CODE]",
+        &server_config::routes },
+    { "upstream", OPT_LIST, 0, 0, 0, "upstream service: NAME http|fcgi ADDR[,ADDR...] [MAX_INFLIGHT] [TIMEOUT_MS]",
+        &server_config::upstreams },
+    { "tls_port", OPT_INT, &server_config::tls_port, 0, 0, "TLS listen port, 0 = off" },
+    { "tls_cert", OPT_STRING, 0, 0, &server_config::tls_cert, "PEM certificate chain" },
+    { "tls_key", OPT_STRING, 0, 0, &server_config::tls_key, "PEM private key" },
+    { "tls_ktls", OPT_BOOL, 0, &server_config::tls_ktls, 0, "hand record encryption to the kernel after the handshake" },
+    { "tls_cache", OPT_INT, &server_config::tls_cache, 0, 0, "shared TLS 1.2 session cache slots, 0 = tickets only" },
+    { "rate_limit", OPT_INT, &server_config::rate_limit, 0, 0, "requests per second per client, 0 = off" },
+    { "rate_burst", OPT_INT, &server_config::rate_burst, 0, 0, "request burst per client, 0 = rate_limit" },
+    { "conn_limit", OPT_INT, &server_config::conn_limit, 0, 0, "concurrent connections per client, 0 = off" },
+    { "limit_prefix4", OPT_INT, &server_config::limit_prefix4, 0, 0, "IPv4 prefix length that counts as one client" },
+    { "limit_prefix6", OPT_INT, &server_config::limit_prefix6, 0, 0, "IPv6 prefix length that counts as one client" },
+    { "limit_slots", OPT_INT, &server_config::limit_slots, 0, 0, "shared rate limit table slots" },
+    { "upload_max_mb", OPT_INT, &server_config::upload_max_mb, 0, 0, "max body of one upload, 0 = unlimited" },
+    { "upload_total_mb", OPT_INT, &server_config::upload_total_mb, 0, 0, "max bytes being uploaded at once, 0 = unlimited" },
+    { "upload_sync", OPT_BOOL, 0, &server_config::upload_sync, 0, "fdatasync uploads before renaming them into place" },
+    { "write_quantum_kb", OPT_INT, &server_config::write_quantum_kb, 0, 0, "bytes one connection may send before yielding, 0 = until EAGAIN" },
+    { "reactor_budget_kb", OPT_INT, &server_config::reactor_budget_kb, 0, 0, "bytes a reactor writes per event loop pass, 0 = unlimited" },
+    { "coro", OPT_BOOL, 0, &server_config::coro, 0, "serve plaintext HTTP/1.1 connections as coroutines on the reactor thread" },
+    { "coro_idle_ms", OPT_INT, &server_config::coro_idle_ms, 0, 0, "idle keep-alive timeout in coroutine mode, 0 = none" },
+};
+static const int options_count = sizeof( options_table ) / sizeof( options_table[0] );
+
+static bool parse_bool( const char* value, bool* out ){
+    if( strcasecmp( value, "1" ) == 0 || strcasecmp( value, "on" ) == 0
+            || strcasecmp( value, "yes" ) == 0 || strcasecmp( value, "true" ) == 0 ){
+        *out = true;
+        return true;
+    }
+    if( strcasecmp( value, "0" ) == 0 || strcasecmp( value, "off" ) == 0
+            || strcasecmp( value, "no" ) == 0 || strcasecmp( value, "false" ) == 0 ){
+        *out = false;
+        return true;
+    }
+    return false;
+}
+
+bool config_set( server_config& cfg, const char* key, const char* value ){
+    for( int i = 0; i < options_count; ++i ){
+        const option_entry& opt = options_table[i];
+        if( strcmp( opt.key, key ) != 0 ){
+            continue;
+        }
+        switch( opt.kind ){
+            case OPT_INT:{
+                char* end = 0;
+                errno = 0;
+                long v = strtol( value, &end, 10 );
+                if( errno != 0 || end == value || *end != '\0' || v < 0 ){
+                    return false;
+                }
+                cfg.*opt.int_field = (int)v;
+                return true;
+            }
+            case OPT_BOOL:{
+                return parse_bool( value, &( cfg.*opt.bool_field ) );
+            }
+            case OPT_STRING:{
+                cfg.*opt.string_field = value;
+                return true;
+            }
+            case OPT_LIST:{
+                ( cfg.*opt.list_field ).push_back( value );
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//去掉首尾空白
+static char* trim( char* s ){
+    s += strspn( s, " \t\r\n" );
+    char* end = s + strlen( s );
+    while( end > s && strchr( " \t\r\n", *( end - 1 ) ) ){
+        *--end = '\0';
+    }
+    return s;
+}
+
+bool config_load_file( server_config& cfg, const char* path ){
+    FILE* fp = fopen( path, "r" );
+    if( !fp ){
+        printf( "cannot open config file %s\n", path );
+        return false;
+    }
+    char line[ 1024 ];
+    int lineno = 0;
+    bool ok = true;
+    while( fgets( line, sizeof( line ), fp ) ){
+        ++lineno;
+        char* text = trim( line );
+        if( text[0] == '\0' || text[0] == '#' ){
+            continue;
+        }
+        char* eq = strchr( text, '=' );
+        if( !eq ){
+            printf( "%s:%d: expected key = value\n", path, lineno );
+            ok = false;
+            continue;
+        }
+        *eq = '\0';
+        char* key = trim( text );
+        char* value = trim( eq + 1 );
+        if( !config_set( cfg, key, value ) ){
+            printf( "%s:%d: bad option %s = %s\n", path, lineno, key, value );
+            ok = false;
+        }
+    }
+    fclose( fp );
+    return ok;
+}
+
+void config_usage( const char* prog ){
+    printf( "usage: %s [options] [ip_address port_number]\n", prog );
+    printf( "  -f, --config=FILE\n" );
+    for( int i = 0; i < options_count; ++i ){
+        printf( "  --%s=VALUE\t%s\n", options_table[i].key, options_table[i].help );
+    }
+}
+
+bool config_parse_args( server_config& cfg, int argc, char* argv[] ){
+    //长选项和配置项一一对应，val取配置表下标加上偏移，避免和短选项冲突
+    const int base = 256;
+    struct option longopts[ options_count + 3 ];
+    for( int i = 0; i < options_count; ++i ){
+        longopts[i].name = options_table[i].key;
+        longopts[i].has_arg = required_argument;
+        longopts[i].flag = 0;
+        longopts[i].val = base + i;
+    }
+    longopts[ options_count ].name = "config";
+    longopts[ options_count ].has_arg = required_argument;
+    longopts[ options_count ].flag = 0;
+    longopts[ options_count ].val = 'f';
+    longopts[ options_count + 1 ].name = "help";
+    longopts[ options_count + 1 ].has_arg = no_argument;
+    longopts[ options_count + 1 ].flag = 0;
+    longopts[ options_count + 1 ].val = 'h';
+    memset( &longopts[ options_count + 2 ], 0, sizeof( struct option ) );
+
+    int c;
+    while( ( c = getopt_long( argc, argv, "f:t:r:w:h", longopts, NULL ) ) != -1 ){
+        bool ok = true;
+        if( c == 'f' ){
+            ok = config_load_file( cfg, optarg );
+        }else if( c == 't' ){
+            ok = config_set( cfg, "threads", optarg );
+        }else if( c == 'r' ){
+            ok = config_set( cfg, "reactors", optarg );
+        }else if( c == 'w' ){
+            ok = config_set( cfg, "workers", optarg );
+        }else if( c >= base && c < base + options_count ){
+            ok = config_set( cfg, options_table[ c - base ].key, optarg );
+            if( !ok ){
+                printf( "bad value for --%s: %s\n", options_table[ c - base ].key, optarg );
+            }
+        }else{
+            config_usage( basename( argv[0] ) );
+            return false;
+        }
+        if( !ok ){
+            return false;
+        }
+    }
+
+    //兼容原来的 ./main ip port 用法
+    if( optind < argc ){
+        cfg.ip = argv[ optind++ ];
+    }
+    if( optind < argc && !config_set( cfg, "port", argv[ optind++ ] ) ){
+        printf( "bad port number\n" );
+        return false;
+    }
+    if( cfg.threads <= 0 || cfg.max_requests <= 0 ){
+        printf( "threads and max_requests must be positive\n" );
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+//服务器运行参数，命令行和配置文件共用同一组key
+//配置文件格式为每行 key = value，#开头为注释
+//命令行使用 --key=value，后出现的覆盖先出现的
+struct server_config{
+    //监听地址和端口
+    //ip中有冒号时为IPv6，::同时接受IPv4连接；port为0时只使用listen中的地址
+    std::string ip;
+    int port;
+    //附加的监听地址，每条为 HOST:PORT、[IPV6]:PORT 或 unix:PATH，后面可以跟 tls，可以出现多次
+    std::vector< std::string > listens;
+
+    //每个reactor对应的线程池常驻线程数
+    int threads;
+    //线程池自动伸缩的上限，不大于threads时线程数固定
+    int max_threads;
+    //任务排队时间超过该值（微秒）时扩容
+    int grow_wait_us;
+    //多出来的线程空闲超过该值（毫秒）时退出
+    int idle_ms;
+    //每个线程池请求队列中的最大允许数量
+    int max_requests;
+    //reactor（epoll循环）数量，0表示每个NUMA节点一个
+    int reactors;
+
+    //可用的cpu列表，例如 0-3,8-11，为空表示进程当前可用的全部cpu
+    std::string cpus;
+    //是否把reactor和它的工作线程绑定到同一组cpu上
+    bool pin;
+    //是否把连接和缓冲区内存分配到reactor所在的NUMA节点
+    bool numa;
+    //是否在监听socket上设置SO_INCOMING_CPU，让网卡队列和reactor对应
+    bool incoming_cpu;
+
+    //worker进程数，0表示不使用master，单进程运行
+    int workers;
+    //worker平滑退出时等待已有连接结束的最长时间（毫秒）
+    int drain_ms;
+
+    //打包好的静态文件，为空时不使用
+    std::string bundle;
+
+    //内置用户存储的日志文件前缀，为空时登录注册仍按原来的方式直接返回页面
+    std::string user_db;
+    //注册时是否fdatasync，关闭后掉电可能丢失最近的注册
+    bool user_db_sync;
+
+    //附加的路由规则，每条为 METHOD[,METHOD] PATH TYPE [TARGET] [CODE]，可以出现多次
+    std::vector< std::string > routes;
+    //上游服务，每条为 NAME http|fcgi ADDR[,ADDR...] [MAX_INFLIGHT] [TIMEOUT_MS]，由proxy路由使用
+    std::vector< std::string > upstreams;
+
+    //TLS监听端口，0表示不启用；和port使用同样数量的reactor
+    int tls_port;
+    //PEM格式的证书链和私钥
+    std::string tls_cert;
+    std::string tls_key;
+    //握手后尝试把加解密交给内核（kTLS），内核不支持时仍由OpenSSL处理
+    bool tls_ktls;
+    //所有worker共享的TLS 1.2会话缓存槽位数，0表示只使用session ticket
+    int tls_cache;
+
+    //每个客户端每秒的请求数和突发的请求数，0表示不限制；突发为0时等于每秒的请求数
+    int rate_limit;
+    int rate_burst;
+    //每个客户端的并发连接数，0表示不限制
+    int conn_limit;
+    //按地址前缀统计客户端，IPv4默认单个地址，IPv6默认/64
+    int limit_prefix4;
+    int limit_prefix6;
+    //所有worker共享的限流表槽位数，客户端再多也只占用这么多
+    int limit_slots;
+
+    //upload路由上单个请求的消息体上限和所有worker同时上传的总量（MB），0表示不限制
+    int upload_max_mb;
+    int upload_total_mb;
+    //上传完成后fdatasync再rename，关闭后掉电可能得到不完整的文件
+    bool upload_sync;
+
+    //一个连接一次最多连续发送的字节数（KB），用完后排到其他连接后面，0表示一直发到EAGAIN
+    int write_quantum_kb;
+    //reactor每轮epoll_wait最多写出的字节数（KB），超过后剩下的写事件推迟到下一轮，0表示不限制
+    int reactor_budget_kb;
+
+    //明文HTTP/1.1连接作为协程在reactor线程中处理，不经过线程池
+    bool coro;
+    //协程模式下空闲的长连接保持的毫秒数，0表示一直保持
+    int coro_idle_ms;
+
+    server_config();
+};
+
+//设置单个key，未知key或非法value返回false
+bool config_set( server_config& cfg, const char* key, const char* value );
+//读取配置文件
+bool config_load_file( server_config& cfg, const char* path );
+//解析命令行，兼容原来的 ip port 位置参数
+bool config_parse_args( server_config& cfg, int argc, char* argv[] );
+//打印用法
+void config_usage( const char* prog );
+
+#endif
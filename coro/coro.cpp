@@ -0,0 +1,143 @@
+#include "coro.h"
+
+#include <new>
+#include <time.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include <functional>
+
+namespace {
+//空闲帧的链表，next放在帧自己的内存中
+struct free_frame{
+    free_frame* next;
+};
+struct frame_cache{
+    free_frame* heads[ 64 ];
+    size_t counts[ 64 ];
+};
+thread_local frame_cache t_frames;
+}
+
+void* frame_pool::allocate( size_t size ){
+    size_t cls = ( size + GRANULE - 1 ) / GRANULE;
+    if( cls >= CLASSES ){
+        return ::operator new( size );
+    }
+    free_frame* f = t_frames.heads[ cls ];
+    if( f ){
+        t_frames.heads[ cls ] = f->next;
+        --t_frames.counts[ cls ];
+        return f;
+    }
+    //按这一级的大小分配，释放后可以给同一级的任何帧使用
+    return ::operator new( cls * GRANULE );
+}
+
+void frame_pool::deallocate( void* p, size_t size ){
+    size_t cls = ( size + GRANULE - 1 ) / GRANULE;
+    if( cls >= CLASSES || t_frames.counts[ cls ] >= KEEP ){
+        ::operator delete( p );
+        return;
+    }
+    free_frame* f = ( free_frame* )p;
+    f->next = t_frames.heads[ cls ];
+    t_frames.heads[ cls ] = f;
+    ++t_frames.counts[ cls ];
+}
+
+coro_loop::coro_loop( int epollfd ): m_epollfd( epollfd ){
+}
+
+coro_loop::~coro_loop(){
+    for( size_t i = 0; i < m_slots.size(); ++i ){
+        if( m_slots[i].op ){
+            std::coroutine_handle<> h = m_slots[i].op->handle;
+            m_slots[i].op = 0;
+            h.destroy();
+        }
+    }
+}
+
+long long coro_loop::now_ms(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void coro_loop::wait_op::await_suspend( std::coroutine_handle<> h ){
+    handle = h;
+    if( fd >= (int)loop->m_slots.size() ){
+        slot empty = { 0, 0 };
+        loop->m_slots.resize( fd + 1, empty );
+    }
+    slot& s = loop->m_slots[ fd ];
+    s.op = this;
+    deadline = 0;
+    if( timeout_ms > 0 ){
+        deadline = now_ms() + timeout_ms;
+        //堆中已经有更早的定时器时等它到期再续上
+        if( s.timer == 0 || deadline < s.timer ){
+            s.timer = deadline;
+            loop->add_timer( deadline, fd );
+        }
+    }
+    //和modfd一样：边沿触发、一次性，对端关闭也要通知
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = events | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl( loop->m_epollfd, EPOLL_CTL_MOD, fd, &event );
+}
+
+void coro_loop::add_timer( long long deadline, int fd ){
+    timer t = { deadline, fd };
+    m_timers.push_back( t );
+    std::push_heap( m_timers.begin(), m_timers.end(), std::greater< timer >() );
+}
+
+void coro_loop::resume( int fd, uint32_t events ){
+    wait_op* op = m_slots[ fd ].op;
+    //先摘下等待者，协程恢复后可能马上又在这个fd上等待
+    m_slots[ fd ].op = 0;
+    op->result = events;
+    op->handle.resume();
+}
+
+void coro_loop::run_timers(){
+    long long now = now_ms();
+    while( !m_timers.empty() && m_timers.front().deadline <= now ){
+        std::pop_heap( m_timers.begin(), m_timers.end(), std::greater< timer >() );
+        timer t = m_timers.back();
+        m_timers.pop_back();
+        slot& s = m_slots[ t.fd ];
+        if( s.timer != t.deadline ){
+            //之后又加过更早的定时器，这一个已经没有用了
+            continue;
+        }
+        s.timer = 0;
+        wait_op* op = s.op;
+        if( !op || op->deadline == 0 ){
+            continue;
+        }
+        if( op->deadline > now ){
+            s.timer = op->deadline;
+            add_timer( op->deadline, t.fd );
+            continue;
+        }
+        //超时：取消epoll上的注册，之后的事件不会再交给这个fd
+        epoll_event event;
+        event.data.fd = t.fd;
+        event.events = 0;
+        epoll_ctl( m_epollfd, EPOLL_CTL_MOD, t.fd, &event );
+        s.op = 0;
+        op->result = 0;
+        op->handle.resume();
+    }
+}
+
+int coro_loop::next_timeout() const {
+    if( m_timers.empty() ){
+        return -1;
+    }
+    long long left = m_timers.front().deadline - now_ms();
+    return left > 0 ? (int)left : 0;
+}
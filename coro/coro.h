@@ -0,0 +1,100 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+//协程帧的内存池：按GRANULE字节分级的空闲链表，每个线程一份
+//连接的协程帧大小都一样，一个连接结束后它的帧马上被下一个连接复用，不经过malloc
+//超过最大一级的帧直接用operator new
+class frame_pool{
+public:
+    static void* allocate( size_t size );
+    static void deallocate( void* p, size_t size );
+
+private:
+    static const size_t GRANULE = 64;
+    static const size_t CLASSES = 64;
+    //每一级最多缓存的空闲帧，连接数回落后多出来的还给系统
+    static const size_t KEEP = 1024;
+};
+
+//连接的协程：创建后立即运行到第一个co_await，运行结束时自动释放帧
+//没有返回值，也没有别的协程等待它
+struct coro_task{
+    struct promise_type{
+        coro_task get_return_object(){ return coro_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void(){}
+        void unhandled_exception(){ std::terminate(); }
+        static void* operator new( size_t size ){ return frame_pool::allocate( size ); }
+        static void operator delete( void* p, size_t size ){ frame_pool::deallocate( p, size ); }
+    };
+};
+
+//一个reactor上的协程调度：协程挂起等待socket事件（可以带超时），reactor收到事件或者超时后恢复它
+//socket沿用连接原来的EPOLLONESHOT注册方式，一个fd同一时刻只有一个协程在等
+//所有协程都在reactor线程中运行，调度不需要加锁
+class coro_loop{
+public:
+    //co_await loop.wait(...)：结果是收到的epoll事件，超时为0
+    struct wait_op{
+        coro_loop* loop;
+        int fd;
+        uint32_t events;
+        int timeout_ms;
+        long long deadline;
+        uint32_t result;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const { return false; }
+        void await_suspend( std::coroutine_handle<> h );
+        uint32_t await_resume() const { return result; }
+    };
+
+    explicit coro_loop( int epollfd );
+    //reactor退出时销毁还挂起的协程帧
+    ~coro_loop();
+
+    //等待fd上的events，timeout_ms<=0表示不超时
+    wait_op wait( int fd, uint32_t events, int timeout_ms = 0 ){
+        wait_op op = { this, fd, events, timeout_ms, 0, 0, std::coroutine_handle<>() };
+        return op;
+    }
+
+    //fd上有协程在等待，它的事件交给resume
+    bool waiting( int fd ) const { return fd >= 0 && fd < (int)m_slots.size() && m_slots[ fd ].op; }
+    void resume( int fd, uint32_t events );
+    //恢复到期的协程
+    void run_timers();
+    //到下一个定时器的毫秒数，没有定时器时返回-1，用作epoll_wait的超时
+    int next_timeout() const;
+
+private:
+    //定时器：这个fd上等待的超时
+    struct timer{
+        long long deadline;
+        int fd;
+        bool operator>( const timer& other ) const { return deadline > other.deadline; }
+    };
+    //每个fd的等待者（指向挂起的协程帧中的wait_op）和它在堆中最早的定时器
+    //每个fd在堆中最多一个定时器：到期时等待者换过了就按新的期限重新放回去，
+    //请求很多的长连接不会在堆中留下大量过期的定时器
+    struct slot{
+        wait_op* op;
+        long long timer;
+    };
+    void add_timer( long long deadline, int fd );
+    static long long now_ms();
+
+    int m_epollfd;
+    std::vector< slot > m_slots;
+    //按到期时间的小顶堆
+    std::vector< timer > m_timers;
+};
+
+#endif
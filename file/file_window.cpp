@@ -0,0 +1,74 @@
+#include "file_window.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+file_window::file_window(): m_fd( -1 ), m_size( 0 ), m_addr( 0 ), m_start( 0 ), m_len( 0 ){
+}
+
+file_window::~file_window(){
+    close();
+}
+
+void file_window::open( int fd, off_t size ){
+    close();
+    m_fd = fd;
+    m_size = size;
+    //整个文件都是顺序读，内核加大预读
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+}
+
+const char* file_window::map( off_t offset, size_t* len ){
+    if( m_fd < 0 || offset < 0 || offset >= m_size ){
+        return NULL;
+    }
+    if( !m_addr || offset < m_start || offset >= m_start + (off_t)m_len ){
+        if( m_addr ){
+            munmap( m_addr, m_len );
+            m_addr = 0;
+        }
+        off_t start = offset - offset % WINDOW;
+        size_t n = m_size - start < (off_t)WINDOW ? m_size - start : WINDOW;
+        void* p = mmap( 0, n, PROT_READ, MAP_PRIVATE, m_fd, start );
+        if( p == MAP_FAILED ){
+            return NULL;
+        }
+        m_addr = ( char* )p;
+        m_start = start;
+        m_len = n;
+        madvise( m_addr, m_len, MADV_SEQUENTIAL );
+        //发送这个窗口的同时把下一个窗口读进页缓存
+        if( start + (off_t)n < m_size ){
+            posix_fadvise( m_fd, start + n, WINDOW, POSIX_FADV_WILLNEED );
+        }
+    }
+    *len = m_len - ( offset - m_start );
+    return m_addr + ( offset - m_start );
+}
+
+void file_window::take( file_window& other ){
+    close();
+    m_fd = other.m_fd;
+    m_size = other.m_size;
+    m_addr = other.m_addr;
+    m_start = other.m_start;
+    m_len = other.m_len;
+    other.m_fd = -1;
+    other.m_size = 0;
+    other.m_addr = 0;
+    other.m_len = 0;
+}
+
+void file_window::close(){
+    if( m_addr ){
+        munmap( m_addr, m_len );
+        m_addr = 0;
+    }
+    if( m_fd >= 0 ){
+        ::close( m_fd );
+        m_fd = -1;
+    }
+    m_size = 0;
+    m_len = 0;
+}
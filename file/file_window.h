@@ -0,0 +1,37 @@
+#ifndef FILE_WINDOW_H
+#define FILE_WINDOW_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//大文件的滑动映射窗口：同一时刻只映射WINDOW大小的一段，发送到窗口末尾时再映射下一段
+//每个下载占用的地址空间固定，多GB的文件和大量并发下载不会耗尽地址空间
+//映射时提示内核顺序读取，并预读下一个窗口，发送线程尽量不在缺页时等磁盘
+class file_window{
+public:
+    //窗口大小，页大小的整数倍；不超过一个窗口的文件仍然整体映射
+    static const size_t WINDOW = 1 << 20;
+
+    file_window();
+    ~file_window();
+
+    //接管fd，size是文件长度
+    void open( int fd, off_t size );
+    bool active() const { return m_fd >= 0; }
+    off_t size() const { return m_size; }
+    //返回offset处的地址，*len是窗口中从offset开始到窗口末尾的字节数
+    //offset不在当前窗口中时换一个窗口，失败返回NULL
+    const char* map( off_t offset, size_t* len );
+    //把另一个窗口的文件转移过来，例如交给HTTP/2的流
+    void take( file_window& other );
+    void close();
+
+private:
+    int m_fd;
+    off_t m_size;
+    char* m_addr;
+    off_t m_start;
+    size_t m_len;
+};
+
+#endif
@@ -1,18 +1,54 @@
 #include "http_conn.h"
+#include <ctype.h>
+#include "../stats/stats.h"
+#include "../bundle/mime.h"
 
 const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy. \n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server. \n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server. \n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The request method is not supported for the requested resource. \n";
+const char* created_201_title = "Created";
+const char* error_411_title = "Length Required";
+const char* error_411_form = "A Content-Length header is required for this request. \n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than the server is willing to accept. \n";
+const char* error_426_title = "Upgrade Required";
+const char* error_426_form = "This resource is only available over WebSocket. \n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, please slow down. \n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file. \n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response. \n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The upstream server is too busy to handle the request. \n";
+const char* error_504_title = "Gateway Timeout";
+const char* error_504_form = "The upstream server did not respond in time. \n";
+
+static const char* redirect_title( int code ){
+    switch( code ){
+        case 301: return "Moved Permanently";
+        case 303: return "See Other";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        default: return "Found";
+    }
+}
 
 //网站根目录
 const char* doc_root = "/var/www";
 
+//Accept-Encoding中接受gzip，打包文件中有gzip版本时使用
+static bool accepts_gzip( const char* value ){
+    return strcasestr( value, "gzip" ) != NULL && strcasestr( value, "gzip;q=0" ) == NULL;
+}
+
 //设置非阻塞fd
 static int setnonblocking( int fd ){
     int old_option = fcntl( fd , F_GETFL );
@@ -47,29 +83,95 @@ void modfd( int epollfd, int fd, int ev ){
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-//在一开始设置两个静态变量为默认值
-int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+//在一开始设置静态变量为默认值
+std::atomic< int > http_conn::m_user_count( 0 );
+std::atomic< bool > http_conn::m_draining( false );
+asset_bundle* http_conn::m_bundle = 0;
+const router* http_conn::m_router = 0;
+user_store* http_conn::m_users = 0;
+tls_context* http_conn::m_tls = 0;
+rate_limiter* http_conn::m_limiter = 0;
+size_t http_conn::m_write_quantum = 0;
+int http_conn::m_idle_ms = 0;
+ws_hub* http_conn::m_hub = 0;
 
 //
 void http_conn::close_conn( bool real_close ){
+    if( real_close && m_proxy ){
+        delete m_proxy;
+        m_proxy = 0;
+    }
+    if( real_close && m_h2 ){
+        delete m_h2;
+        m_h2 = 0;
+    }
+    //先退订，退订返回后发布者不会再写这个socket
+    if( real_close && m_ws ){
+        if( m_ws->started() ){
+            m_hub->unsubscribe( m_ws );
+        }
+        delete m_ws;
+        m_ws = 0;
+    }
+    //没有收齐的上传删除临时文件
+    if( real_close && m_upload ){
+        delete m_upload;
+        m_upload = 0;
+    }
     if( real_close && ( m_sockfd != -1 ) ){
+        //响应没有发完时释放文件映射和窗口的fd
+        unmap();
+        m_io.reset();
         removefd( m_epollfd, m_sockfd );
         m_sockfd = -1;
         m_user_count--;
+        if( m_limited ){
+            m_limiter->disconnect( m_client );
+        }
+        g_stats->active.fetch_sub( 1, std::memory_order_relaxed );
     }
 }
 
 //初始化：将socket加入监听，计数加一
-void http_conn::init( int sockfd, const sockaddr_in& addr){
+void http_conn::init( int sockfd, const sockaddr_storage& addr, int epollfd, upstream_pool* upstreams, bool tls ){
+    //accept时已经按这个地址计入了连接数
+    m_limited = m_limiter && addr.ss_family != AF_UNIX;
+    if( m_limited ){
+        m_client = m_limiter->key_of( ( const struct sockaddr* )&addr );
+    }
+    m_io.fd = sockfd;
+    m_io.ssl = tls ? m_tls->accept( sockfd ) : 0;
+    if( tls && !m_io.ssl ){
+        if( m_limited ){
+            m_limiter->disconnect( m_client );
+        }
+        m_io.fd = -1;
+        m_sockfd = -1;
+        close( sockfd );
+        return;
+    }
+    m_handshaking = tls;
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_upstreams = upstreams;
+    m_proxy = 0;
+    m_h2 = 0;
+    m_ws = 0;
+    m_upload = 0;
+    m_loop = 0;
+    m_pipelined = false;
+    m_corked = false;
+    m_login_pending = false;
+    //只在新连接时清零：write发完一个请求后会调用next_request，reactor在那之后才读取这一轮写出的字节
+    m_last_sent = 0;
     //下面两行是为了避免TIME_WAIT，仅用于调试，实际使用的时候要关掉
     int reuse = 1;
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
 
     addfd( m_epollfd, sockfd, true);
     ++m_user_count;
+    g_stats->active.fetch_add( 1, std::memory_order_relaxed );
 
     init();
 }
@@ -83,20 +185,61 @@ void http_conn::init(){
 
     m_method = GET;
     m_url = 0;
+    m_query = 0;
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
+    m_request_end = 0;
     m_write_idx = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+    m_file_address = 0;
+    m_accept_gzip = false;
+    m_if_none_match = 0;
+    m_upgrade_h2c = false;
+    m_connection_upgrade = false;
+    m_connection_close = false;
+    m_connection_keep = false;
+    m_http10 = false;
+    m_body_idx = 0;
+    m_http2_settings = 0;
+    m_upgrade_websocket = false;
+    m_ws_key = 0;
+    m_ws_version = 0;
+    m_expect_continue = false;
+    m_chunked = false;
+    m_upload_replaced = false;
+    m_bundle_entry = 0;
+    m_use_gzip = false;
+    m_content_type = 0;
+    m_route = 0;
+    m_headers_start = 0;
+    m_headers_end = 0;
+    m_body_start = 0;
+    m_string = 0;
     cgi = 0;
     doc_root = "/var/www";
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE);
     memset( m_write_buf, '\0', WRITE_BUFFER_SIZE);
     memset( m_real_file, '\0', FILENAME_LEN);
 }
 
+//流水线：客户端不等响应就发出的下一个请求可能已经和这个请求一起读进来了
+//init()会清空读缓冲区的位置，先把剩下的数据移到开头
+void http_conn::next_request(){
+    int left = m_request_end > 0 ? m_read_idx - m_request_end : 0;
+    if( left > 0 ){
+        memmove( m_read_buf, m_read_buf + m_request_end, left );
+    }else{
+        left = 0;
+    }
+    init();
+    m_read_idx = left;
+    m_pipelined = left > 0;
+}
+
 //从状态机，判断line的完整与否
 //每次处理一行（也就是请求行/请求头/消息体中的一种）
 http_conn::LINE_STATUS http_conn::parse_line(){
@@ -128,13 +271,25 @@ http_conn::LINE_STATUS http_conn::parse_line(){
 
 //循环读数据直到无数据可读
 bool http_conn::read(){
+    //握手在工作线程中进行
+    if( m_handshaking ){
+        return true;
+    }
+    if( m_h2 ){
+        return m_h2->read( m_io );
+    }
+    //上传的消息体由工作线程直接从socket搬到文件，登录请求已经读全
+    if( m_upload || m_login_pending ){
+        return true;
+    }
     if( m_read_idx >= READ_BUFFER_SIZE){
         return false;
     }
 
     int bytes_read = 0;
-    while(true){
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    //缓冲区满时先处理已经读到的部分，剩下的消息体可能由代理直接读取
+    while( m_read_idx < READ_BUFFER_SIZE ){
+        bytes_read = m_io.recv( m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
         if( bytes_read == -1){
             //直到读完
             if( errno == EAGAIN || errno == EWOULDBLOCK ){
@@ -166,6 +321,10 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ){
     }else if(strcasecmp( method, "POST" ) == 0){
         m_method=POST;
         cgi=1;
+    }else if( strcasecmp( method, "PUT" ) == 0 ){
+        m_method = PUT;
+    }else if( strcasecmp( method, "HEAD" ) == 0 ){
+        m_method = HEAD;
     }else{
         return BAD_REQUEST;
     }
@@ -180,7 +339,9 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ){
 
     //解析版本号
     m_version += strspn( m_version, " \t");
-    if( strcasecmp( m_version, "HTTP/1.1") !=0){
+    if( strcasecmp( m_version, "HTTP/1.0" ) == 0 ){
+        m_http10 = true;
+    }else if( strcasecmp( m_version, "HTTP/1.1") !=0){
         return BAD_REQUEST;
     }
 
@@ -198,15 +359,38 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text ){
     if( !m_url || m_url[0] != '/'){
         return BAD_REQUEST;
     }
-    //如果url是/转到欢迎界面
-    if(strlen(m_url)==1)
-        strcat(m_url,"judge.html");
+    //查询串单独保存，转发给上游时使用
+    m_query = strchr( m_url, '?' );
+    if( m_query ){
+        *m_query++ = '\0';
+    }
+    //规范化路径，拒绝..，/对应的欢迎界面由路由表处理
+    if( !normalize_path( m_url ) ){
+        return BAD_REQUEST;
+    }
 
     m_check_state = CHECK_STATE_HEADER;
+    m_headers_start = m_start_line;
     //只收到请求行还不够
     return NO_REQUEST;
 }
 
+//Connection的值是逗号分隔、不区分大小写的选项列表，也可以分成多行
+void http_conn::parse_connection( const char* text ){
+    while( *text ){
+        text += strspn( text, " \t," );
+        size_t n = strcspn( text, " \t," );
+        if( n == 5 && strncasecmp( text, "close", 5 ) == 0 ){
+            m_connection_close = true;
+        }else if( n == 10 && strncasecmp( text, "keep-alive", 10 ) == 0 ){
+            m_connection_keep = true;
+        }else if( n == 7 && strncasecmp( text, "upgrade", 7 ) == 0 ){
+            m_connection_upgrade = true;
+        }
+        text += n;
+    }
+}
+
 //解析http请求的头部信息
 /*请求头
     Host接受请求的服务器地址，ip加端口或者域名
@@ -218,14 +402,29 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text ){
     //第一个是空行说明处理完毕，这里面是对最后结果的处理，用于转移状态
     if( text[ 0 ] == '\0' )
     {
-        //如果只是HEAD请求就只需要请求行
-        if ( m_method == HEAD )
-        {
-            return GET_REQUEST;
+        m_headers_end = text - m_read_buf;
+        m_body_start = m_checked_idx;
+        //HTTP/1.1默认保持连接，HTTP/1.0要由keep-alive明确要求，两个版本上close都优先
+        m_linger = !m_connection_close && ( !m_http10 || m_connection_keep );
+        //不支持分块的消息体，不能让它被当成下一个请求
+        if( m_chunked ){
+            m_linger = false;
+            return LENGTH_REQUIRED;
         }
         //如果消息体有数据，则应将状态转到CHECK_STATE_CONTENT继续进行消息体的处理
         if ( m_content_length != 0 )
         {
+            //转发给上游和上传的请求不等消息体读完，剩下的部分边读边发或者边读边写文件
+            bool method_not_allowed = false;
+            m_route = m_router->match( m_method, m_url, strlen( m_url ), &method_not_allowed );
+            if( m_route && ( m_route->type == ROUTE_PROXY || m_route->type == ROUTE_UPLOAD ) ){
+                return GET_REQUEST;
+            }
+            //其他请求的消息体要放进读缓冲区
+            if( m_content_length >= READ_BUFFER_SIZE - m_checked_idx ){
+                m_linger = false;
+                return PAYLOAD_TOO_LARGE;
+            }
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
@@ -235,19 +434,72 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text ){
     //处理头部字段Connection
     else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
     {
-        text += 11;
-        text += strspn( text, " \t" );//定位到keep-alive的位置
-        if ( strcasecmp( text, "keep-alive" ) == 0 )
-        {
-            m_linger = true;//保持连接
-        }
+        parse_connection( text + 11 );
+    }
+    //处理头部字段Upgrade和HTTP2-Settings，可以在这个请求之后切换到HTTP/2
+    else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 )
+    {
+        text += 8;
+        text += strspn( text, " \t" );
+        m_upgrade_h2c = strcasecmp( text, "h2c" ) == 0;
+        m_upgrade_websocket = strcasecmp( text, "websocket" ) == 0;
+    }
+    //WebSocket握手
+    else if ( strncasecmp( text, "Sec-WebSocket-Key:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        m_ws_key = text;
+    }
+    else if ( strncasecmp( text, "Sec-WebSocket-Version:", 22 ) == 0 )
+    {
+        text += 22;
+        text += strspn( text, " \t" );
+        m_ws_version = text;
+    }
+    else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 )
+    {
+        text += 15;
+        text += strspn( text, " \t" );
+        m_http2_settings = text;
     }
     //处理头部字段Connect-Length
     else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
     {
         text += 15;
         text += strspn( text, " \t" );
-        m_content_length = atol( text );//字符串转换为longint
+        char* end = 0;
+        m_content_length = strtoll( text, &end, 10 );
+        if( end == text || m_content_length < 0 ){
+            return BAD_REQUEST;
+        }
+    }
+    //消息体之前等待100 Continue
+    else if ( strncasecmp( text, "Expect:", 7 ) == 0 )
+    {
+        text += 7;
+        text += strspn( text, " \t" );
+        //HTTP/1.0的客户端不认识100 Continue
+        m_expect_continue = !m_http10 && strcasecmp( text, "100-continue" ) == 0;
+    }
+    else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        m_chunked = strcasecmp( text, "identity" ) != 0;
+    }
+    //处理头部字段Accept-Encoding，打包文件中有gzip版本时使用
+    else if ( strncasecmp( text, "Accept-Encoding:", 16 ) == 0 )
+    {
+        text += 16;
+        m_accept_gzip = accepts_gzip( text );
+    }
+    //处理头部字段If-None-Match，和ETag一致时返回304
+    else if ( strncasecmp( text, "If-None-Match:", 14 ) == 0 )
+    {
+        text += 14;
+        text += strspn( text, " \t" );
+        m_if_none_match = text;
     }
     //处理头部字段Host
     else if ( strncasecmp( text, "Host:", 5 ) == 0 )
@@ -270,9 +522,10 @@ http_conn::HTTP_CODE http_conn::parse_content( char* text ){
     //读进来的总长度大于已经分析的长度加内容的长度就是合法的
     //因为此时请求头的已经被分析完了，属于checkedidx之前的内容了
     if( m_read_idx >= (m_checked_idx + m_content_length) ){
-        text[m_content_length] = '\0';
         //post请求中最后输入的是userpass
+        //消息体之后可能是下一个请求，不能在末尾写'\0'，form_value按m_content_length截止
         m_string = text;
+        m_request_end = m_checked_idx + m_content_length;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -308,9 +561,11 @@ http_conn::HTTP_CODE http_conn::process_read(){
             }
             case CHECK_STATE_HEADER:{
                 ret = parse_headers( text );
-                if( ret == BAD_REQUEST){
-                    return BAD_REQUEST;
+                if( ret == BAD_REQUEST || ret == LENGTH_REQUIRED || ret == PAYLOAD_TOO_LARGE ){
+                    return ret;
                 }else if(ret == GET_REQUEST){
+                    //转发和上传的消息体不在这里，由start_proxy和start_upload处理
+                    m_request_end = m_checked_idx;
                     return do_request();//有可能只有请求头就结束了HEAD
                 }
                 break;
@@ -333,37 +588,399 @@ http_conn::HTTP_CODE http_conn::process_read(){
 
 //如果请求的文件是有效的，就使用mmap映射到m_file_address中（记得munmap）
 http_conn::HTTP_CODE http_conn::do_request(){
-    strcpy( m_real_file, doc_root);//复制字符串，源必须有‘\0’，目的必须够大且无重叠
-    int len = strlen( doc_root );
-    //strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    //找到m_url中/的位置
-    const char *p = strrchr(m_url, '/');
-
-    //cgi登录注册校验
-    if (cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3')){
-        //根据标志判断是登录检测还是注册检测
-        //同步线程登录校验
-        //CGI多进程登录校验
-    }
-    //如果请求资源是/0，跳到注册界面
-    if (*(p + 1) == '0'){
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/register.html");
-        //拼接
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
-    }else if(*(p + 1) == '1'){
-        //如果是/1跳转到登录界面
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/log.html");
-        //拼接
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+    //每个请求取一个令牌，HTTP/2的每个流也算一个请求
+    if( m_limited && !m_limiter->request( m_client ) ){
+        stats_add( g_stats->rate_limited, 1 );
+        return TOO_MANY_REQUESTS;
+    }
+    //按 方法+路径 查路由表，不再根据url最后一段的第一个字符判断
+    bool method_not_allowed = false;
+    if( !m_route ){
+        m_route = m_router->match( m_method, m_url, strlen( m_url ), &method_not_allowed );
+    }
+    if( !m_route ){
+        return method_not_allowed ? METHOD_NOT_ALLOWED : NO_RESOURCE;
+    }
+
+    switch( m_route->type ){
+        case ROUTE_REDIRECT:{
+            return REDIRECT_REQUEST;
+        }
+        case ROUTE_INTERNAL:{
+            return BUILTIN_REQUEST;
+        }
+        case ROUTE_CGI:{
+            //登录注册校验，没有配置用户存储时保持原来的行为
+            //PBKDF2要几十毫秒，协程模式下交给线程池，不阻塞reactor上的其他连接
+            if( m_users && m_string ){
+                return m_loop ? LOGIN_REQUEST : do_login();
+            }
+            return serve_file( m_url );
+        }
+        case ROUTE_ALIAS:{
+            return serve_file( m_route->target.c_str() );
+        }
+        case ROUTE_PROXY:{
+            return start_proxy();
+        }
+        case ROUTE_WEBSOCKET:{
+            return accept_websocket();
+        }
+        case ROUTE_UPLOAD:{
+            return start_upload();
+        }
+        default:{
+            return serve_file( m_url );
+        }
+    }
+}
+
+//在工作线程中创建临时文件，写入已经读进来的部分，然后接收剩下的消息体
+http_conn::HTTP_CODE http_conn::start_upload(){
+    //文件名是url的最后一段，不能为空，也不能是隐藏文件（临时文件以.开头）
+    //上传目录不分子目录：路由前缀之后还有/的url不接受，否则不同路径会写到同一个文件
+    const char* slash = strrchr( m_url, '/' );
+    if( (size_t)( slash - m_url ) >= m_route->prefix_len ){
+        //消息体没有读，连接不能再用
+        m_linger = false;
+        return NO_RESOURCE;
+    }
+    const char* name = slash + 1;
+    if( name[0] == '\0' || name[0] == '.' ){
+        m_linger = false;
+        return BAD_REQUEST;
+    }
+    m_upload = new upload_session;
+    HTTP_CODE code = NO_REQUEST;
+    switch( m_upload->start( m_route->target.c_str(), name, m_content_length ) ){
+        case upload_session::START_TOO_LARGE: code = PAYLOAD_TOO_LARGE; break;
+        case upload_session::START_NO_BUDGET: code = SERVICE_UNAVAILABLE; break;
+        case upload_session::START_FAILED: code = INTERNAL_ERROR; break;
+        default: break;
+    }
+    //解析请求头时多读进来的消息体
+    off_t buffered = m_read_idx - m_checked_idx;
+    if( buffered > m_content_length ){
+        buffered = m_content_length;
+    }
+    if( code == NO_REQUEST && buffered > 0 && !m_upload->write( m_read_buf + m_checked_idx, buffered ) ){
+        code = INTERNAL_ERROR;
+    }
+    if( code != NO_REQUEST ){
+        //消息体没有读，连接不能再用
+        delete m_upload;
+        m_upload = 0;
+        m_linger = false;
+        return code;
+    }
+    m_checked_idx += buffered;
+    m_request_end = m_checked_idx;
+    if( m_expect_continue && m_upload->left() > 0 ){
+        static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        //前面流水线上的响应和100一起发出，客户端收到后才会发送消息体
+        uncork();
+        m_io.send( CONTINUE, sizeof( CONTINUE ) - 1 );
+    }
+    return receive_upload();
+}
+
+//读到EAGAIN时返回UPLOAD_REQUEST，等下一次EPOLLIN
+http_conn::HTTP_CODE http_conn::receive_upload(){
+    upload_session::STATUS st = m_upload->left() > 0 ? m_upload->receive( m_io ) : upload_session::UPLOAD_DONE;
+    if( st == upload_session::UPLOAD_MORE ){
+        return UPLOAD_REQUEST;
+    }
+    bool ok = st == upload_session::UPLOAD_DONE && m_upload->commit( &m_upload_replaced );
+    delete m_upload;
+    m_upload = 0;
+    if( !ok ){
+        m_linger = false;
+        return INTERNAL_ERROR;
+    }
+    return UPLOAD_DONE;
+}
+
+//在工作线程中准备好发给上游的请求，之后由reactor线程转发
+http_conn::HTTP_CODE http_conn::start_proxy(){
+    upstream_group* g = upstream_find( m_route->target.c_str() );
+    if( !g || !m_upstreams ){
+        return BAD_GATEWAY;
+    }
+    proxy_request req;
+    req.method = router::method_name( m_method );
+    req.path = m_url;
+    req.query = m_query;
+    req.headers = m_read_buf + m_headers_start;
+    req.headers_len = m_headers_end - m_headers_start;
+    req.content_length = m_content_length;
+    req.body = m_read_buf + m_body_start;
+    req.body_len = m_read_idx - m_body_start;
+    //代理只转发Content-Length以内的部分；消息体已经读全时，后面流水线上的请求留给next_request
+    //没有读全时剩下的消息体由代理从socket读取，缓冲区中的数据全部属于这个请求
+    m_request_end = req.body_len >= m_content_length ? m_body_start + m_content_length : 0;
+    req.peer = (const sockaddr*)&m_address;
+    req.doc_root = doc_root;
+    req.head = m_method == HEAD;
+    req.http10 = m_http10;
+    req.keep_alive = m_linger && !m_draining;
+    req.tls = m_io.ssl != 0;
+    m_proxy = new proxy_session( g, &m_io );
+    if( !m_proxy->prepare( req ) ){
+        delete m_proxy;
+        m_proxy = 0;
+        m_linger = false;
+        return BAD_REQUEST;
+    }
+    return PROXY_REQUEST;
+}
+
+//WebSocket握手：101放进会话的输出队列，之后由reactor线程订阅频道并收发帧
+http_conn::HTTP_CODE http_conn::accept_websocket(){
+    if( m_method != GET || m_http10 || !m_upgrade_websocket || !m_connection_upgrade || !m_ws_key
+            || !m_ws_version || strcmp( m_ws_version, "13" ) != 0 ){
+        return UPGRADE_REQUIRED;
+    }
+    char accept[ 32 ];
+    if( !ws_accept_key( m_ws_key, accept ) ){
+        return BAD_REQUEST;
+    }
+    if( !m_hub ){
+        return INTERNAL_ERROR;
+    }
+    char response[ 160 ];
+    int len = snprintf( response, sizeof( response ),
+            "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: %s\r\n\r\n", accept );
+    m_ws = new ws_session( &m_io, m_url, m_route->target == "publish" );
+    m_ws->queue_raw( response, len );
+    //客户端收到101之前就可能发出了帧
+    m_ws->feed( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx );
+    return WEBSOCKET_REQUEST;
+}
+
+//reactor线程中处理WebSocket连接的事件，第一次调用时订阅频道
+bool http_conn::ws_io( uint32_t events ){
+    bool first = !m_ws->started();
+    if( first ){
+        //和代理一样不再使用EPOLLONESHOT：发布者可能在任何线程中直接写这个连接，
+        //reactor只负责读和发布者写不动之后的EPOLLOUT
+        epoll_event event;
+        event.data.fd = m_sockfd;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        epoll_ctl( m_epollfd, EPOLL_CTL_MOD, m_sockfd, &event );
+        m_ws->start();
+        m_hub->subscribe( m_ws );
+    }
+    if( first || ( events & EPOLLIN ) ){
+        //每次最多收齐一批消息，发布后再继续读
+        std::vector< ws_session::message > in;
+        do{
+            in.clear();
+            if( !m_ws->read( in ) ){
+                return false;
+            }
+            for( size_t i = 0; i < in.size() && m_ws->publisher(); ++i ){
+                m_hub->publish( m_ws->channel(), in[i].opcode, in[i].data.data(), in[i].data.size() );
+            }
+        }while( !in.empty() );
+    }
+    if( !m_ws->flush() ){
+        return false;
+    }
+    if( m_ws->finished() ){
+        linger_graceful();
+        return false;
+    }
+    return true;
+}
+
+//reactor线程中处理代理请求的事件，第一次调用时开始连接上游
+bool http_conn::proxy_io( int fd, uint32_t events ){
+    if( m_proxy->started() ){
+        return proxy_finish( m_proxy->on_event( fd, events ) );
+    }
+    //转发期间客户连接不再使用EPOLLONESHOT，两个方向的事件都直接在reactor中处理
+    epoll_event event;
+    event.data.fd = m_sockfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl( m_epollfd, EPOLL_CTL_MOD, m_sockfd, &event );
+    return proxy_finish( m_proxy->start( m_upstreams ) );
+}
+
+bool http_conn::proxy_timeout(){
+    return proxy_finish( m_proxy->on_timeout() );
+}
+
+bool http_conn::proxy_finish( proxy_session::STATUS st ){
+    if( st == proxy_session::PROXY_CONTINUE ){
+        return true;
+    }
+    stats_add( g_stats->bytes_sent, m_proxy->bytes_sent() );
+    bool keep = m_linger && !m_draining && m_proxy->keep_alive();
+    bool responded = m_proxy->responded();
+    bool request_read = m_proxy->request_read();
+    delete m_proxy;
+    m_proxy = 0;
+
+    HTTP_CODE code;
+    switch( st ){
+        case proxy_session::PROXY_DONE:{
+            if( keep ){
+                next_request();
+                wait_read();
+                return true;
+            }
+            linger_graceful();
+            return false;
+        }
+        case proxy_session::PROXY_UNAVAILABLE:{
+            code = SERVICE_UNAVAILABLE;
+            break;
+        }
+        case proxy_session::PROXY_TIMEOUT:{
+            code = GATEWAY_TIMEOUT;
+            break;
+        }
+        case proxy_session::PROXY_BAD_GATEWAY:{
+            code = BAD_GATEWAY;
+            break;
+        }
+        default:{
+            return false;
+        }
+    }
+    if( responded ){
+        return false;
+    }
+    //错误页面和普通响应一样由write()发送，消息体没有读完时发送后关闭连接
+    m_linger = m_linger && request_read;
+    if( !process_write( code ) ){
+        return false;
+    }
+    return write();
+}
+
+//监听socket设置了SO_LINGER{1,0}，close时发送RST，对方可能还没读到最后发出的数据
+void http_conn::linger_graceful(){
+    struct linger graceful = { 0, 0 };
+    setsockopt( m_sockfd, SOL_SOCKET, SO_LINGER, &graceful, sizeof( graceful ) );
+}
+
+//非阻塞握手，OpenSSL要读就等EPOLLIN，要写就等EPOLLOUT
+//收到ClientHello后的签名等计算在工作线程中完成，reactor中只会继续发送握手消息
+bool http_conn::tls_handshake(){
+    switch( m_io.handshake() ){
+        case conn_io::HANDSHAKE_DONE:{
+            m_handshaking = false;
+            wait_read();
+            return true;
+        }
+        case conn_io::HANDSHAKE_WANT_READ:{
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return true;
+        }
+        case conn_io::HANDSHAKE_WANT_WRITE:{
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            return true;
+        }
+        default:{
+            return false;
+        }
+    }
+}
+
+//OpenSSL中还有解密好的数据时socket上不会再有EPOLLIN，
+//同时等EPOLLOUT让reactor马上回来，由read_pending把连接交给线程池
+//缓冲区中已经有下一个请求时打开CORK，几个响应合在一起发送
+void http_conn::cork_pipeline(){
+    if( !m_corked && m_linger && !m_draining && m_request_end > 0 && m_read_idx > m_request_end ){
+        m_io.cork( true );
+        m_corked = true;
+    }
+}
+//关掉CORK，剩下不满一个报文段的部分一起发出
+void http_conn::uncork(){
+    if( m_corked ){
+        m_io.cork( false );
+        m_corked = false;
+    }
+}
+void http_conn::wait_read(){
+    //流水线上的响应都已经交给内核
+    if( !m_pipelined ){
+        uncork();
+    }
+    //还有没处理的请求数据时EPOLLOUT会立即通知，reactor再交给工作线程
+    modfd( m_epollfd, m_sockfd, m_pipelined || m_io.pending() ? EPOLLIN | EPOLLOUT : EPOLLIN );
+}
+
+//从urlencoded的消息体中取出key对应的值，解码%xx和+，值太长时返回false
+bool http_conn::form_value( const char* key, char* out, size_t size ){
+    size_t key_len = strlen( key );
+    const char* p = m_string;
+    //消息体没有'\0'结尾
+    const char* end = m_string ? m_string + m_content_length : 0;
+    while( p && p < end ){
+        if( (size_t)( end - p ) > key_len && strncmp( p, key, key_len ) == 0 && p[ key_len ] == '=' ){
+            p += key_len + 1;
+            size_t n = 0;
+            while( p < end && *p != '&' ){
+                char c = *p++;
+                if( c == '+' ){
+                    c = ' ';
+                }else if( c == '%' && end - p >= 2 && isxdigit( (unsigned char)p[0] ) && isxdigit( (unsigned char)p[1] ) ){
+                    char hex[3] = { p[0], p[1], '\0' };
+                    c = strtol( hex, NULL, 16 );
+                    p += 2;
+                }
+                if( n + 1 >= size || c == '\0' ){
+                    return false;
+                }
+                out[ n++ ] = c;
+            }
+            out[n] = '\0';
+            return true;
+        }
+        p = ( const char* )memchr( p, '&', end - p );
+        if( p ){
+            ++p;
+        }
+    }
+    return false;
+}
+
+//code 2为登录，3为注册，消息体为 user=xxx&password=xxx
+http_conn::HTTP_CODE http_conn::do_login(){
+    char name[ user_store::MAX_NAME_LEN + 1 ];
+    char password[ user_store::MAX_PASSWORD_LEN + 1 ];
+    bool ok = form_value( "user", name, sizeof( name ) ) && form_value( "password", password, sizeof( password ) );
+    HTTP_CODE ret;
+    if( m_route->code == 3 ){
+        //注册成功跳转到登录页面，用户已存在或者用户名不合法返回注册错误页面
+        ok = ok && m_users->add( name, password ) == user_store::OK;
+        ret = serve_file( ok ? "/log.html" : "/registerError.html" );
     }else{
-        //如果都不是就拼接原本的内容
-        strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+        ok = ok && m_users->check( name, password ) == user_store::OK;
+        ret = serve_file( ok ? "/welcome.html" : "/logError.html" );
+    }
+    memset( password, 0, sizeof( password ) );
+    return ret;
+}
+
+//path是规范化之后以/开头的路径，先查打包文件，再查doc_root
+http_conn::HTTP_CODE http_conn::serve_file( const char* path ){
+    //打包文件中有就直接使用映射中的切片，没有再回到文件系统
+    if( m_bundle ){
+        const bundle_entry* e = m_bundle->find( path, strlen( path ) );
+        if( e ){
+            return serve_bundle( e );
+        }
+    }
+
+    //m_real_file = doc_root + path，放不下就当作不存在
+    int len = snprintf( m_real_file, FILENAME_LEN, "%s%s", doc_root, path );
+    if( len < 0 || len >= FILENAME_LEN ){
+        return NO_RESOURCE;
     }
 
     //获取文件状态信息到m_file_stat
@@ -381,15 +998,68 @@ http_conn::HTTP_CODE http_conn::do_request(){
         return BAD_REQUEST;
     }
 
+    m_content_type = mime_type( m_real_file );
+    //空文件不需要映射，HEAD只用到stat得到的长度，不打开也不映射文件
+    if( m_file_stat.st_size == 0 || m_method == HEAD ){
+        return FILE_REQUEST;
+    }
     int fd = open( m_real_file, O_RDONLY );
+    if( fd < 0 ){
+        return FORBIDDEN_REQUEST;
+    }
+    //大文件不整体映射，发送时一个窗口一个窗口地映射，fd一直保持打开
+    if( m_file_stat.st_size > (off_t)file_window::WINDOW ){
+        m_window.open( fd, m_file_stat.st_size );
+        return FILE_REQUEST;
+    }
     //映射内容和文件内容一起更新，就使用shared，private则是不影响原文件
     //在只读情况下两个都一样
     m_file_address = (char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close( fd );
+    if( m_file_address == MAP_FAILED ){
+        m_file_address = 0;
+        return INTERNAL_ERROR;
+    }
     return FILE_REQUEST;
 }
 
+//打包文件命中：不需要任何文件系统调用，ETag和Content-Type都是打包时算好的
+http_conn::HTTP_CODE http_conn::serve_bundle( const bundle_entry* e ){
+    m_bundle_entry = e;
+    if( m_if_none_match && strstr( m_if_none_match, e->etag ) ){
+        return NOT_MODIFIED;
+    }
+    m_use_gzip = m_accept_gzip && e->gzip_length > 0;
+    m_file_address = (char*)( m_use_gzip ? m_bundle->gzip_data( e ) : m_bundle->data( e ) );
+    m_file_stat.st_size = m_use_gzip ? e->gzip_length : e->length;
+    m_content_type = m_bundle->mime( e );
+    return FILE_REQUEST;
+}
+
+//响应体从offset开始的一段放进m_iv[1]，大文件每次只映射一个窗口
+bool http_conn::map_body( off_t offset ){
+    if( !m_window.active() ){
+        m_iv[1].iov_base = m_file_address + offset;
+        m_iv[1].iov_len = m_file_stat.st_size - offset;
+        return true;
+    }
+    size_t len = 0;
+    const char* p = m_window.map( offset, &len );
+    if( !p ){
+        return false;
+    }
+    m_iv[1].iov_base = ( char* )p;
+    m_iv[1].iov_len = len;
+    return true;
+}
+
 void http_conn::unmap(){
+    m_window.close();
+    if( m_bundle_entry ){
+        //打包文件的映射在整个进程生命周期内有效
+        m_file_address = 0;
+        return;
+    }
     if( m_file_address){
         munmap( m_file_address, m_file_stat.st_size );
         m_file_address = 0;
@@ -397,60 +1067,104 @@ void http_conn::unmap(){
 }
 
 //写http相应(返回值false就会导致关闭连接)
+//工作线程已经尽量发送过，reactor只在EPOLLOUT时继续发送剩下的部分
 bool http_conn::write(){
-    //发送结果
-    int temp = 0;
-    
-    int newadd = 0;
+    if( m_handshaking ){
+        return tls_handshake();
+    }
+    m_last_sent = 0;
+    if( m_h2 ){
+        return write_h2();
+    }
+
     //如果没有要法发的就进入下次监听
     if( bytes_to_send == 0){
-        modfd( m_epollfd, m_sockfd, EPOLLIN);
-        init();
+        next_request();
+        wait_read();
         return true;
     }
 
+    SEND_STATUS st = send_response();
+    if( st == SEND_AGAIN ){
+        return true;
+    }
+    //发送成功，根据是否保持连接来确定是否关闭，平滑退出时不再保持
+    if( st == SEND_DONE && m_linger && !m_draining ){
+        next_request();
+        //在epoll树上重置EPOLLONESHOT事件，缓冲区中还有下一个请求时交给工作线程
+        wait_read();
+        return true;
+    }
+    //响应可能还在发送缓冲区中，TLS连接最后还有close_notify，不能用RST关闭
+    if( st == SEND_DONE ){
+        linger_graceful();
+    }
+    return false;
+}
+
+http_conn::SEND_STATUS http_conn::send_response(){
+    //发送结果
+    ssize_t temp = 0;
+    off_t sent = 0;
+
     while(1){
+        //用完这一轮的配额就让出，socket仍然可写，EPOLLOUT在reactor下一轮立即通知
+        //大文件按配额和其他连接轮流发送，小的响应一次就发完
+        if( m_write_quantum > 0 && sent >= (off_t)m_write_quantum ){
+            stats_add( g_stats->write_yields, 1 );
+            //协程模式下由协程自己等待EPOLLOUT
+            if( !m_loop ){
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            }
+            return SEND_AGAIN;
+        }
         //把响应报文的状态行、消息头、空行和响应正文发送给浏览器端
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if(temp > 0){
-            bytes_have_send += temp;
-            newadd = bytes_have_send - m_write_idx;
+        //一次不超过剩下的配额；大文件这次只发到窗口末尾
+        struct iovec iv[2];
+        off_t chunk = 0;
+        for( int i = 0; i < m_iv_count; ++i ){
+            iv[i] = m_iv[i];
+            if( m_write_quantum > 0 && chunk + (off_t)iv[i].iov_len > (off_t)m_write_quantum - sent ){
+                iv[i].iov_len = m_write_quantum - sent - chunk;
+            }
+            chunk += iv[i].iov_len;
         }
+        //后面还有数据时不把最后不满一个报文段的部分单独发出
+        temp = m_io.writev( iv, m_iv_count, chunk < bytes_to_send );
         if( temp <= -1){
             //eagain说明写缓冲满了
             if( errno == EAGAIN ){
-                //第一个iovec头部信息的数据已发送完，发送第二个iovec数据
-                if (bytes_have_send >= m_iv[0].iov_len){
-                    m_iv[0].iov_len = 0;
-                    m_iv[1].iov_base = m_file_address + newadd;
-                    m_iv[1].iov_len = bytes_to_send;
-                }else{
-                    m_iv[0].iov_base = m_write_buf + bytes_to_send;
-                    m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
-                }
                 //等下次epollout事件再写，在此期间无法接到其他请求，但可以保持连接的完整性
-                modfd( m_epollfd, m_sockfd, EPOLLOUT);
-                return true;
+                if( !m_loop ){
+                    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+                }
+                return SEND_AGAIN;
             }
             unmap();
-            return false;
+            return SEND_FAILED;
         }
 
+        bytes_have_send += temp;
         bytes_to_send -= temp;
-        //bytes_have_send += temp;
-        //因为是先进行写操作再进行两个变量的更新的
-        //因此to小于等于have就说明刚刚的操作已经都写完了
+        sent += temp;
+        m_last_sent += temp;
+        stats_add( g_stats->bytes_sent, temp );
+        //第一个iovec头部信息的数据已发送完，接着发送第二个iovec数据
+        if( bytes_have_send >= m_write_idx ){
+            m_iv[0].iov_len = 0;
+            if( bytes_to_send > 0 && !map_body( bytes_have_send - m_write_idx ) ){
+                unmap();
+                return SEND_FAILED;
+            }
+        }else{
+            m_iv[0].iov_base = m_write_buf + bytes_have_send;
+            m_iv[0].iov_len = m_write_idx - bytes_have_send;
+        }
+
+        //to小于等于0就说明刚刚的操作已经都写完了
         if( bytes_to_send <= 0){
             unmap();
-            //在epoll树上重置EPOLLONESHOT事件
-            modfd(m_epollfd,m_sockfd,EPOLLIN);
-            //发送成功，根据是否保持连接来确定是否关闭
-            if( m_linger ){
-                init();
-                return true;
-            }else{
-                return false;
-            }
+            return SEND_DONE;
         }
     }
 }
@@ -480,22 +1194,48 @@ bool http_conn::add_status_line( int status, const char* title )
 }
 
 //添加响应头，分三部分：响应体长度/保持连接/空行
-bool http_conn::add_headers( int content_len )
+bool http_conn::add_headers( off_t content_len )
 {
     add_content_length( content_len );
     add_linger();
     add_blank_line();
+    m_body_idx = m_write_idx;
     return true;
 }
 
-bool http_conn::add_content_length( int content_len )
+bool http_conn::add_content_length( off_t content_len )
 {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    return add_response( "Content-Length: %lld\r\n", (long long)content_len );
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    return add_response( "Connection: %s\r\n", ( m_linger && !m_draining ) ? "keep-alive" : "close" );
+}
+
+bool http_conn::add_content_type()
+{
+    return add_response( "Content-Type: %s\r\n", m_content_type );
+}
+
+//文件响应额外的头部：类型，打包文件还有ETag和编码
+bool http_conn::add_file_headers()
+{
+    if( m_content_type && !add_content_type() ){
+        return false;
+    }
+    if( m_bundle_entry ){
+        if( !add_response( "ETag: %s\r\n", m_bundle_entry->etag ) ){
+            return false;
+        }
+        if( m_bundle_entry->gzip_length > 0 && !add_response( "Vary: Accept-Encoding\r\n" ) ){
+            return false;
+        }
+        if( m_use_gzip && !add_response( "Content-Encoding: gzip\r\n" ) ){
+            return false;
+        }
+    }
+    return true;
 }
 
 bool http_conn::add_blank_line()
@@ -509,6 +1249,40 @@ bool http_conn::add_content( const char* content )
     return add_response( "%s", content );
 }
 
+//服务器内部生成的响应体，按路由的target区分
+int http_conn::builtin_body( char* body, int size ){
+    m_content_type = "text/plain; charset=utf-8";
+    if( m_route->target == "status" && g_stats_segment ){
+        return status_body( body, size );
+    }
+    return snprintf( body, size, "unknown endpoint %s\n", m_route->target.c_str() );
+}
+
+int http_conn::status_body( char* body, int size ){
+    stats_total t;
+    stats_aggregate( g_stats_segment, &t );
+    return snprintf( body, size,
+            "workers %d\naccepted %llu\nrequests %llu\nbytes_sent %llu\nactive %lld\nrespawns %llu\n"
+            "tls_handshakes %llu\ntls_resumed %llu\nktls_send %llu\nrate_limited %llu\n"
+            "write_yields %llu\nwrite_deferred %llu\nbulk_tasks %llu\n"
+            "pool_threads %lld\npool_idle %lld\npool_wait_us %lld\n",
+            t.workers, (unsigned long long)t.accepted, (unsigned long long)t.requests,
+            (unsigned long long)t.bytes_sent, (long long)t.active, (unsigned long long)t.respawns,
+            (unsigned long long)t.tls_handshakes, (unsigned long long)t.tls_resumed, (unsigned long long)t.ktls_send,
+            (unsigned long long)t.rate_limited, (unsigned long long)t.write_yields,
+            (unsigned long long)t.write_deferred, (unsigned long long)t.bulk_tasks,
+            (long long)t.pool_threads, (long long)t.pool_idle, (long long)t.pool_wait_us );
+}
+
+bool http_conn::write_builtin(){
+    char body[ 512 ];
+    int len = builtin_body( body, sizeof( body ) );
+    add_status_line( 200, ok_200_title );
+    add_content_type();
+    add_headers( len );
+    return add_content( body );
+}
+
 bool http_conn::process_write( HTTP_CODE ret ){
     switch( ret ){
         case INTERNAL_ERROR:{
@@ -543,17 +1317,134 @@ bool http_conn::process_write( HTTP_CODE ret ){
             }
             break;
         }
+        case UPLOAD_DONE:{
+            if( m_upload_replaced ){
+                add_status_line( 200, ok_200_title );
+            }else{
+                add_status_line( 201, created_201_title );
+                add_response( "Location: %s\r\n", m_url );
+            }
+            if( !add_headers( 0 ) ){
+                return false;
+            }
+            break;
+        }
+        case LENGTH_REQUIRED:{
+            add_status_line( 411, error_411_title );
+            add_headers( strlen( error_411_form ) );
+            if( !add_content( error_411_form ) ){
+                return false;
+            }
+            break;
+        }
+        case PAYLOAD_TOO_LARGE:{
+            add_status_line( 413, error_413_title );
+            add_headers( strlen( error_413_form ) );
+            if( !add_content( error_413_form ) ){
+                return false;
+            }
+            break;
+        }
+        case TOO_MANY_REQUESTS:{
+            add_status_line( 429, error_429_title );
+            add_response( "Retry-After: 1\r\n" );
+            add_headers( strlen( error_429_form ) );
+            if( !add_content( error_429_form ) ){
+                return false;
+            }
+            break;
+        }
+        case BAD_GATEWAY:{
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if( !add_content( error_502_form ) ){
+                return false;
+            }
+            break;
+        }
+        case SERVICE_UNAVAILABLE:{
+            add_status_line( 503, error_503_title );
+            add_response( "Retry-After: 1\r\n" );
+            add_headers( strlen( error_503_form ) );
+            if( !add_content( error_503_form ) ){
+                return false;
+            }
+            break;
+        }
+        case GATEWAY_TIMEOUT:{
+            add_status_line( 504, error_504_title );
+            add_headers( strlen( error_504_form ) );
+            if( !add_content( error_504_form ) ){
+                return false;
+            }
+            break;
+        }
+        case PROXY_REQUEST:
+        case WEBSOCKET_REQUEST:{
+            //响应由reactor线程中的代理或者WebSocket会话直接发送
+            bytes_to_send = 0;
+            return true;
+        }
+        case UPGRADE_REQUIRED:{
+            add_status_line( 426, error_426_title );
+            add_response( "Upgrade: websocket\r\nSec-WebSocket-Version: 13\r\n" );
+            add_headers( strlen( error_426_form ) );
+            if( !add_content( error_426_form ) ){
+                return false;
+            }
+            break;
+        }
+        case METHOD_NOT_ALLOWED:{
+            add_status_line( 405, error_405_title );
+            add_headers( strlen( error_405_form ) );
+            if( !add_content( error_405_form ) ){
+                return false;
+            }
+            break;
+        }
+        case REDIRECT_REQUEST:{
+            add_status_line( m_route->code, redirect_title( m_route->code ) );
+            add_response( "Location: %s\r\n", m_route->target.c_str() );
+            if( !add_headers( 0 ) ){
+                return false;
+            }
+            break;
+        }
+        case BUILTIN_REQUEST:{
+            if( !write_builtin() ){
+                return false;
+            }
+            break;
+        }
+        case NOT_MODIFIED:{
+            add_status_line( 304, not_modified_304_title );
+            add_response( "ETag: %s\r\n", m_bundle_entry->etag );
+            add_linger();
+            if( !add_blank_line() ){
+                return false;
+            }
+            break;
+        }
         case FILE_REQUEST:{
             add_status_line(200, ok_200_title);
+            add_file_headers();
             if( m_file_stat.st_size != 0 ){
                 add_headers( m_file_stat.st_size );
+                //HEAD没有映射文件，只发送响应头
+                if( m_method == HEAD ){
+                    break;
+                }
                 //响应头部分，因为所有的add_函数都是写道m_write_buff中的
                 m_iv[0].iov_base = m_write_buf;
                 m_iv[0].iov_len = m_write_idx;
-                //响应体：之前映射的文件，通过内存地址访问
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
+                //响应体：之前映射的文件，通过内存地址访问；大文件映射第一个窗口
+                if( !map_body( 0 ) ){
+                    unmap();
+                    return false;
+                }
                 m_iv_count = 2;
+                bytes_to_send = m_write_idx + m_file_stat.st_size;
+                bytes_have_send = 0;
                 //提前结束函数
                 return true;
             }
@@ -564,6 +1455,7 @@ bool http_conn::process_write( HTTP_CODE ret ){
                     return false;
                 }
             }
+            break;
         }
         default:{
             return false;
@@ -572,33 +1464,380 @@ bool http_conn::process_write( HTTP_CODE ret ){
 
     //如果不是文件请求，就只用返回m_write_buf
     //如果是文件请求，前面就已经返回了
+    //HEAD的响应头和GET一样，Content-Length仍是响应体的长度，只是不发送响应体
+    if( m_method == HEAD && m_body_idx > 0 ){
+        m_write_idx = m_body_idx;
+    }
     m_iv[ 0 ].iov_base = m_write_buf;
     m_iv[ 0 ].iov_len = m_write_idx;
     m_iv_count = 1;
     bytes_to_send = m_write_idx;
+    bytes_have_send = 0;
+    return true;
+}
+
+//Upgrade: h2c，只升级没有消息体的请求，转发给上游的请求留在HTTP/1.1
+//h2c只用于明文连接，TLS上的HTTP/2由ALPN协商
+bool http_conn::want_h2c( HTTP_CODE code ) const {
+    return m_upgrade_h2c && m_connection_upgrade && !m_http10 && m_content_length == 0 && !m_io.ssl && code != PROXY_REQUEST;
+}
+
+//Upgrade: h2c：这个请求已经按HTTP/1.1处理完，响应作为流1用HTTP/2发送
+bool http_conn::upgrade_h2( HTTP_CODE code ){
+    h2_session* h2 = new h2_session;
+    h2_stream* s = h2->upgrade( m_http2_settings );
+    if( !s ){
+        delete h2;
+        return false;
+    }
+    m_h2 = h2;
+    //客户端收到101之前就可能发出了连接序言
+    m_h2->feed( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx );
+    respond_h2( s, code );
+    process_h2();
+    return true;
+}
+
+//HTTP/2连接：处理输入中所有完整的帧和收齐的请求，然后尽量发送
+void http_conn::process_h2(){
+    if( m_draining ){
+        m_h2->shutdown();
+    }
+    m_h2->process( m_h2_ready );
+    for( size_t i = 0; i < m_h2_ready.size(); ++i ){
+        if( !m_h2_ready[i]->reset ){
+            serve_h2( m_h2_ready[i] );
+        }
+    }
+    m_h2_ready.clear();
+    //连接出错时write_h2把GOAWAY发出去后返回false
+    if( !write_h2() ){
+        close_conn();
+    }
+}
+
+bool http_conn::write_h2(){
+    bool ok = m_h2->flush( m_io, m_write_quantum );
+    size_t sent = m_h2->take_bytes_sent();
+    m_last_sent += sent;
+    stats_add( g_stats->bytes_sent, sent );
+    if( m_h2->yielded() ){
+        stats_add( g_stats->write_yields, 1 );
+    }
+    if( !ok ){
+        return false;
+    }
+    if( m_h2->finished() ){
+        linger_graceful();
+        return false;
+    }
+    //被流量控制挡住时不需要EPOLLOUT，等对方的WINDOW_UPDATE
+    //输出积压时只等EPOLLOUT，发出去之后再读，否则读事件会一直触发却什么也不读
+    if( m_h2->blocked() ){
+        modfd( m_epollfd, m_sockfd, m_h2->backlogged() ? EPOLLOUT : EPOLLIN | EPOLLOUT );
+    }else{
+        wait_read();
+    }
     return true;
 }
 
+//HTTP/2的一个请求：填好HTTP/1.1解析时设置的成员，复用do_request的路由和文件查找
+void http_conn::serve_h2( h2_stream* s ){
+    init();
+    stats_add( g_stats->requests, 1 );
+    int method = router::method_id( s->method.c_str() );
+    if( method < 0 || s->path[0] != '/' || s->body_overflow ){
+        respond_h2( s, BAD_REQUEST );
+        return;
+    }
+    m_method = (METHOD)method;
+    m_url = &s->path[0];
+    m_query = strchr( m_url, '?' );
+    if( m_query ){
+        *m_query++ = '\0';
+    }
+    if( !normalize_path( m_url ) ){
+        respond_h2( s, BAD_REQUEST );
+        return;
+    }
+    m_host = s->authority.empty() ? 0 : &s->authority[0];
+    m_accept_gzip = accepts_gzip( s->accept_encoding.c_str() );
+    m_if_none_match = s->if_none_match.empty() ? 0 : &s->if_none_match[0];
+    m_content_length = s->body.size();
+    m_string = s->body.empty() ? 0 : &s->body[0];
+
+    //转发、WebSocket和上传需要一个HTTP/1.1连接，客户端收到HTTP_1_1_REQUIRED后会用HTTP/1.1重试
+    bool method_not_allowed = false;
+    m_route = m_router->match( m_method, m_url, strlen( m_url ), &method_not_allowed );
+    if( m_route && ( m_route->type == ROUTE_PROXY || m_route->type == ROUTE_WEBSOCKET || m_route->type == ROUTE_UPLOAD ) ){
+        m_h2->reset( s, h2_session::H2_HTTP_1_1_REQUIRED );
+        return;
+    }
+    respond_h2( s, do_request() );
+}
+
+//把do_request的结果转换成HTTP/2响应，文件映射交给流，发送完后释放
+void http_conn::respond_h2( h2_stream* s, HTTP_CODE code ){
+    const char* body = 0;
+    long long len = 0;
+    char text[ 24 ];
+    bool has_length = true;
+    switch( code ){
+        case FILE_REQUEST:{
+            m_h2->begin_response( 200 );
+            if( m_content_type ){
+                m_h2->add_header( "content-type", m_content_type );
+            }
+            if( m_bundle_entry ){
+                m_h2->add_header( "etag", m_bundle_entry->etag );
+                if( m_bundle_entry->gzip_length > 0 ){
+                    m_h2->add_header( "vary", "accept-encoding" );
+                }
+                if( m_use_gzip ){
+                    m_h2->add_header( "content-encoding", "gzip" );
+                }
+            }
+            if( m_file_stat.st_size == 0 ){
+                body = "<html><body></body></html>";
+                len = strlen( body );
+            }else if( m_window.active() ){
+                //大文件交给流，发送时逐个窗口映射
+                s->file.take( m_window );
+                len = m_file_stat.st_size;
+            }else{
+                body = m_file_address;
+                len = m_file_stat.st_size;
+                if( !m_bundle_entry ){
+                    s->map = m_file_address;
+                    s->map_len = len;
+                }
+                m_file_address = 0;
+            }
+            break;
+        }
+        case NOT_MODIFIED:{
+            m_h2->begin_response( 304 );
+            m_h2->add_header( "etag", m_bundle_entry->etag );
+            has_length = false;
+            break;
+        }
+        case REDIRECT_REQUEST:{
+            m_h2->begin_response( m_route->code );
+            m_h2->add_header( "location", m_route->target.c_str() );
+            break;
+        }
+        case BUILTIN_REQUEST:{
+            char buf[ 512 ];
+            len = builtin_body( buf, sizeof( buf ) );
+            s->owned.assign( buf, len );
+            body = s->owned.data();
+            m_h2->begin_response( 200 );
+            m_h2->add_header( "content-type", m_content_type );
+            break;
+        }
+        default:{
+            int status = 500;
+            body = error_500_form;
+            switch( code ){
+                case BAD_REQUEST: status = 400; body = error_400_form; break;
+                case FORBIDDEN_REQUEST: status = 403; body = error_403_form; break;
+                case NO_RESOURCE: status = 404; body = error_404_form; break;
+                case METHOD_NOT_ALLOWED: status = 405; body = error_405_form; break;
+                case TOO_MANY_REQUESTS: status = 429; body = error_429_form; break;
+                default: break;
+            }
+            len = strlen( body );
+            m_h2->begin_response( status );
+            if( status == 429 ){
+                m_h2->add_header( "retry-after", "1" );
+            }
+            break;
+        }
+    }
+    if( has_length ){
+        snprintf( text, sizeof( text ), "%lld", len );
+        m_h2->add_header( "content-length", text );
+    }
+    m_h2->end_response( s, body, len, m_method == HEAD );
+    unmap();
+}
+
 //整个连接类的入口
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST )
-    {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+    if( m_handshaking ){
+        if( !tls_handshake() ){
+            close_conn();
+        }
+        return;
+    }
+    //已经切换到HTTP/2的连接
+    if( m_h2 ){
+        process_h2();
         return;
     }
+    //prior knowledge的h2c：连接一开始就是HTTP/2的连接序言
+    if( m_start_line == 0 && m_read_idx > 0 ){
+        int n = m_read_idx < h2_session::PREFACE_LEN ? m_read_idx : h2_session::PREFACE_LEN;
+        if( memcmp( m_read_buf, h2_session::PREFACE, n ) == 0 ){
+            if( n < h2_session::PREFACE_LEN ){
+                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                return;
+            }
+            m_h2 = new h2_session;
+            m_h2->start();
+            m_h2->feed( m_read_buf, m_read_idx );
+            process_h2();
+            return;
+        }
+    }
 
-    bool write_ret = process_write( read_ret );
-    if ( ! write_ret )
-    {
-        //这个函数本来是有参数的，但有初值
+    //一次处理读缓冲区中所有完整的请求
+    while( true ){
+        m_pipelined = false;
+        //正在上传时继续接收消息体，收齐后才生成响应；协程交过来的登录请求已经解析好
+        HTTP_CODE read_ret;
+        if( m_login_pending ){
+            m_login_pending = false;
+            read_ret = do_login();
+        }else{
+            read_ret = m_upload ? receive_upload() : process_read();
+        }
+        if ( read_ret == NO_REQUEST || read_ret == UPLOAD_REQUEST )
+        {
+            wait_read();
+            return;
+        }
+
+        stats_add( g_stats->requests, 1 );
+        if( want_h2c( read_ret ) && upgrade_h2( read_ret ) ){
+            return;
+        }
+        bool write_ret = process_write( read_ret );
+        if ( ! write_ret )
+        {
+            //这个函数本来是有参数的，但有初值
+            close_conn();
+            return;
+        }
+        //代理和WebSocket之后由reactor读写，交回给reactor
+        if( proxying() || websocket() ){
+            uncork();
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            return;
+        }
+
+        cork_pipeline();
+        //直接在工作线程中发送，大部分响应一次writev就发完，不用再等一次EPOLLOUT
+        SEND_STATUS st = send_response();
+        if( st == SEND_AGAIN ){
+            return;
+        }
+        if( st == SEND_DONE && m_linger && !m_draining ){
+            next_request();
+            //流水线上的下一个请求在这个线程中接着处理，连接还没有交回reactor
+            if( m_pipelined ){
+                continue;
+            }
+            wait_read();
+            return;
+        }
+        if( st == SEND_DONE ){
+            linger_graceful();
+        }
         close_conn();
+        return;
     }
-
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
-    
 }
 
 
-            
\ No newline at end of file
+            
+//协程模式：读请求、生成响应、发送、等下一个请求按顺序写在一起，等待读写时挂起，
+//reactor收到事件后从挂起的地方继续，不经过线程池，也不用在成员中记下做到哪一步
+//HTTP/2、转发、WebSocket、上传和登录注册交回原来的状态机，之后这个连接不再使用协程
+coro_task http_conn::serve( coro_loop* loop ){
+    m_loop = loop;
+    while( true ){
+        if( !m_pipelined ){
+            //空闲的长连接超过m_idle_ms就关闭
+            uint32_t ev = co_await loop->wait( m_sockfd, EPOLLIN, m_idle_ms );
+            if( ev == 0 ){
+                linger_graceful();
+                close_conn();
+                co_return;
+            }
+            if( ( ev & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) || !read() ){
+                close_conn();
+                co_return;
+            }
+        }
+        //prior knowledge的h2c，由process()接着处理连接序言
+        if( m_start_line == 0 && m_read_idx > 0 && memcmp( m_read_buf, h2_session::PREFACE,
+                m_read_idx < h2_session::PREFACE_LEN ? m_read_idx : h2_session::PREFACE_LEN ) == 0 ){
+            m_loop = 0;
+            process();
+            co_return;
+        }
+        m_pipelined = false;
+
+        HTTP_CODE read_ret = process_read();
+        if( read_ret == NO_REQUEST ){
+            continue;
+        }
+        //上传的消息体在线程池中接收，不占用reactor线程
+        if( read_ret == UPLOAD_REQUEST ){
+            m_loop = 0;
+            wait_read();
+            co_return;
+        }
+        //登录注册交给线程池，EPOLLOUT立即通知，reactor按read_pending把连接交给工作线程
+        if( read_ret == LOGIN_REQUEST ){
+            m_loop = 0;
+            m_login_pending = true;
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            co_return;
+        }
+        stats_add( g_stats->requests, 1 );
+        if( want_h2c( read_ret ) ){
+            m_loop = 0;
+            if( upgrade_h2( read_ret ) ){
+                co_return;
+            }
+            m_loop = loop;
+        }
+        if( !process_write( read_ret ) ){
+            close_conn();
+            co_return;
+        }
+        if( proxying() || websocket() ){
+            m_loop = 0;
+            uncork();
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            co_return;
+        }
+
+        cork_pipeline();
+        SEND_STATUS st;
+        while( ( st = send_response() ) == SEND_AGAIN ){
+            uint32_t ev = co_await loop->wait( m_sockfd, EPOLLOUT );
+            if( ev & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ){
+                close_conn();
+                co_return;
+            }
+            //reactor按每轮写出的字节计算预算
+            m_last_sent = 0;
+        }
+        if( st == SEND_DONE && m_linger && !m_draining ){
+            next_request();
+            if( !m_pipelined ){
+                uncork();
+            }
+            continue;
+        }
+        if( st == SEND_DONE ){
+            linger_graceful();
+        }
+        close_conn();
+        co_return;
+    }
+}
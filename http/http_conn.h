@@ -16,9 +16,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <atomic>
 #include "../locker/locker.h"
+#include "../bundle/bundle.h"
+#include "../router/router.h"
+#include "../auth/user_store.h"
+#include "../upstream/proxy.h"
+#include "../http2/h2_session.h"
+#include "../tls/tls.h"
+#include "../websocket/ws_hub.h"
+#include "../limit/rate_limiter.h"
+#include "../file/file_window.h"
+#include "../upload/upload.h"
+#include "../coro/coro.h"
 //m_read_buf-------m_start_line------m_checked_idx------m_read_idx
 
 class http_conn
@@ -35,29 +48,53 @@ public:
     //解析客户请求的时候，主机所处状态
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     //处理http请求的可能结果
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, METHOD_NOT_ALLOWED, REDIRECT_REQUEST, BUILTIN_REQUEST, PROXY_REQUEST, WEBSOCKET_REQUEST, UPGRADE_REQUIRED, UPLOAD_REQUEST, UPLOAD_DONE, LOGIN_REQUEST, LENGTH_REQUIRED, PAYLOAD_TOO_LARGE, TOO_MANY_REQUESTS, BAD_GATEWAY, SERVICE_UNAVAILABLE, GATEWAY_TIMEOUT, INTERNAL_ERROR, CLOSED_CONNECTION };
     //行的读取状态
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    //发送响应的结果，SEND_AGAIN时已经在等EPOLLOUT
+    enum SEND_STATUS { SEND_DONE = 0, SEND_AGAIN, SEND_FAILED };
 
 public:
     http_conn(){}
     ~http_conn(){}
 
 public:
-    //初始化新接受的连接
-    void init( int sockfd, const sockaddr_in& addr );
+    //初始化新接受的连接，epollfd是接受该连接的reactor的epoll，upstreams是该reactor的上游连接池
+    //tls为true时连接来自TLS监听端口，先完成握手
+    void init( int sockfd, const sockaddr_storage& addr, int epollfd, upstream_pool* upstreams, bool tls );
     //关闭连接
     void close_conn( bool real_close = true );
     //处理客户请求
     void process();
-    //非阻塞读
+    //协程模式：明文HTTP/1.1连接的整个生命周期在reactor线程中作为一个协程运行
+    coro_task serve( coro_loop* loop );
+    //非阻塞读，HTTP/2连接读到h2会话的缓冲区
     bool read();
     //非阻塞写
     bool write();
+    //请求正在转发给上游，连接上的事件由reactor直接交给proxy_io
+    bool proxying() const { return m_proxy != 0; }
+    //fd是客户连接或者上游连接，返回false时关闭客户连接
+    bool proxy_io( int fd, uint32_t events );
+    bool proxy_timeout();
+    //已经升级为WebSocket，连接上的事件由reactor直接交给ws_io
+    bool websocket() const { return m_ws != 0; }
+    //返回false时关闭连接
+    bool ws_io( uint32_t events );
+    //服务器状态的文本，/status和WebSocket状态频道共用
+    static int status_body( char* body, int size );
+    //TLS连接上还有OpenSSL解密好、epoll不会通知的请求数据，或者读缓冲区中还有流水线上的下一个请求
+    bool read_pending() const { return !m_handshaking && bytes_to_send == 0 && ( m_pipelined || m_login_pending || m_io.pending() ); }
+    //正在接收上传的消息体，在线程池中排在短任务后面
+    bool bulk() const { return m_upload != 0; }
+    //上一次write()写出的字节数，reactor用来计算每轮的预算
+    off_t last_sent() const { return m_last_sent; }
 
 private:
     //初始化连接
     void init();
+    //保持连接时准备下一个请求，读缓冲区中这个请求之后的数据移到开头
+    void next_request();
     //解析http请求
     HTTP_CODE process_read();
     //填充http应答
@@ -66,27 +103,79 @@ private:
     //下面的函数被process_read调用以分析http请求
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
+    void parse_connection( const char* text );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
+    HTTP_CODE serve_file( const char* path );
+    HTTP_CODE serve_bundle( const bundle_entry* e );
+    HTTP_CODE do_login();
+    HTTP_CODE start_proxy();
+    HTTP_CODE accept_websocket();
+    //upload路由：开始接收消息体，继续接收，收齐后提交
+    HTTP_CODE start_upload();
+    HTTP_CODE receive_upload();
+    bool proxy_finish( proxy_session::STATUS st );
+    //HTTP/2：升级、处理收齐的请求、发送
+    bool upgrade_h2( HTTP_CODE code );
+    void process_h2();
+    bool write_h2();
+    void serve_h2( h2_stream* s );
+    void respond_h2( h2_stream* s, HTTP_CODE code );
+    //正常关闭，不发送RST
+    void linger_graceful();
+    //TLS握手，返回false时关闭连接
+    bool tls_handshake();
+    //等待下一个请求
+    void wait_read();
+    //发送m_iv中的响应，直到发完或者EAGAIN
+    SEND_STATUS send_response();
+    void uncork();
+    //缓冲区中已经有下一个请求时打开CORK
+    void cork_pipeline();
+    //这个请求之后切换到HTTP/2
+    bool want_h2c( HTTP_CODE code ) const;
+    bool form_value( const char* key, char* out, size_t size );
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     //下面的函数被process_write调用填充http应答
     void unmap();
+    bool map_body( off_t offset );
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
     bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
+    bool add_headers( off_t content_length );
     bool add_content_type();
-    bool add_content_length( int content_length );
+    bool add_file_headers();
+    bool write_builtin();
+    int builtin_body( char* body, int size );
+    bool add_content_length( off_t content_length );
     bool add_linger();
     bool add_blank_line();
 
 public:
-    //所有socket事件都被注册到一个epoll中，所以设置static
-    static int m_epollfd;
-    //统计用户数量也是static
-    static int m_user_count;
+    //连接所属reactor的epoll，每个reactor有自己的epoll
+    int m_epollfd;
+    //统计用户数量是static，多个reactor同时修改
+    static std::atomic< int > m_user_count;
+    //进程正在平滑退出，响应发送完后不再保持连接
+    static std::atomic< bool > m_draining;
+    //启动时mmap的打包文件，为空时只从文件系统读取
+    static asset_bundle* m_bundle;
+    //启动时建立的路由表
+    static const router* m_router;
+    //内置的用户存储，为空时登录注册直接返回页面
+    static user_store* m_users;
+    //fork之前创建的TLS上下文，没有配置TLS端口时为空
+    static tls_context* m_tls;
+    //进程内WebSocket频道的发布/订阅
+    static ws_hub* m_hub;
+    //按客户端地址的限流，没有配置限制时为空
+    static rate_limiter* m_limiter;
+    //一个连接一次最多连续发送的字节数，0表示一直发到EAGAIN
+    static size_t m_write_quantum;
+    //协程模式下空闲的长连接等待下一个请求的毫秒数，0表示一直等
+    static int m_idle_ms;
     //读为0, 写为1
     int m_state;  
 
@@ -94,7 +183,17 @@ private:
     //负责连接对方的socket
     int m_sockfd;
     //对方的addr
-    sockaddr_in m_address;
+    sockaddr_storage m_address;
+    //限流表中对方地址（前缀）的key
+    rate_limiter::key m_client;
+    //unix socket上的客户端都在本机（通常是前面的代理），不计入限流
+    bool m_limited;
+    //socket上的读写，TLS连接经过OpenSSL或者内核TLS
+    conn_io m_io;
+    //TLS握手还没有完成
+    bool m_handshaking;
+    //连接由协程处理，等待读写时挂起在这个调度上；为NULL时由reactor和线程池处理
+    coro_loop* m_loop;
 
     //读缓冲区
     char m_read_buf[ READ_BUFFER_SIZE ];
@@ -104,6 +203,12 @@ private:
     int m_checked_idx;
     //正在解析的行的起始位置
     int m_start_line;
+    //当前请求（包括读缓冲区中的消息体）结束的位置，之后是流水线上的下一个请求；为0时不保留之后的数据
+    int m_request_end;
+    //读缓冲区开头是上一个请求之后收到的数据，还没有处理
+    bool m_pipelined;
+    //连续发送流水线上的多个响应时打开了TCP_CORK
+    bool m_corked;
     //写缓冲区
     char m_write_buf[ WRITE_BUFFER_SIZE ];
     //写缓冲区待发送字节数，也就是要发送的最后一个后一个字节位置
@@ -113,24 +218,79 @@ private:
     CHECK_STATE m_check_state;
     //请求方法，见头文件定义
     METHOD m_method;
+    //请求匹配到的路由
+    const route* m_route;
+    //正在进行的代理请求，只在reactor线程中访问
+    proxy_session* m_proxy;
+    //所属reactor的上游连接池
+    upstream_pool* m_upstreams;
+    //请求头在读缓冲区中的范围，消息体的起始位置
+    int m_headers_start;
+    int m_headers_end;
+    int m_body_start;
+    //连接已经切换到HTTP/2，为NULL时是HTTP/1.1
+    h2_session* m_h2;
+    //本轮收齐的HTTP/2请求
+    std::vector< h2_stream* > m_h2_ready;
+    //连接已经升级为WebSocket
+    ws_session* m_ws;
+    //正在把消息体写到文件，reactor不再读这个连接，数据由工作线程直接搬到文件
+    upload_session* m_upload;
+    //上传覆盖了已有的文件，返回200而不是201
+    bool m_upload_replaced;
+    //协程模式下解析好的登录注册请求，密码哈希在工作线程中计算，不占用reactor线程
+    bool m_login_pending;
 
     //客户请求的目标文件完整路径，其内容等于doc_root + m_url,doc_root是网站根目录
     char m_real_file[ FILENAME_LEN ];
     //客户请求的目标文件文件名
     char* m_url;
+    //查询串，没有时为NULL
+    char* m_query;
     //http协议版本号
     char* m_version;
     //主机名
     char* m_host;
     //http请求消息体的长度
-    int m_content_length;
-    //http请求是否要保持连接
+    off_t m_content_length;
+    //http请求是否要保持连接，请求头收齐后按版本和Connection决定
     bool m_linger;
+    //请求行是HTTP/1.0：默认不保持连接，不使用100 Continue，也不能升级协议
+    bool m_http10;
+    //Connection中的close和keep-alive选项
+    bool m_connection_close;
+    bool m_connection_keep;
+    //客户端接受gzip编码
+    bool m_accept_gzip;
+    //If-None-Match请求头
+    char* m_if_none_match;
+    //请求带有Upgrade: h2c、Connection: Upgrade和HTTP2-Settings
+    bool m_upgrade_h2c;
+    bool m_connection_upgrade;
+    char* m_http2_settings;
+    //Upgrade: websocket和握手用到的头部
+    bool m_upgrade_websocket;
+    char* m_ws_key;
+    char* m_ws_version;
+    //Expect: 100-continue，客户端等我们同意后才发送消息体
+    bool m_expect_continue;
+    //带有Transfer-Encoding，不支持分块的消息体
+    bool m_chunked;
 
     //客户请求的目标文件被mmap到内存中的起始位置
     char* m_file_address;
     //目标文件的状态，通过stat可以获得文件是否存在、是否为目录、是否可读，获取文件大小
     struct stat m_file_stat;
+    //超过一个窗口的文件不整体映射，m_file_address为空，发送时按窗口映射
+    file_window m_window;
+    //响应体来自打包文件，m_file_address指向打包文件中的切片，不需要munmap
+    const bundle_entry* m_bundle_entry;
+    //发送的是打包文件中的gzip版本
+    bool m_use_gzip;
+    //响应的Content-Type
+    const char* m_content_type;
+    //响应体在m_write_buf中的起始位置，HEAD的响应在这里截断
+    int m_body_idx;
     //使用writev()执行写操作，也就是散布写，第一行是内存块，第二行是块数量
     struct iovec m_iv[2];
     int m_iv_count;
@@ -139,9 +299,11 @@ private:
     //存储请求头数据        
     char *m_string;
     //还要再发送的长度 
-    int bytes_to_send;
+    off_t bytes_to_send;
     //已发送长度
-    int bytes_have_send;
+    off_t bytes_have_send;
+    //这一次发送写出的长度
+    off_t m_last_sent;
     //文件目录
     char *doc_root;
 
@@ -0,0 +1,873 @@
+#include "h2_session.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+const char h2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+//帧的标志位
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+//SETTINGS的参数
+static const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+
+//窗口的上限和初始值
+static const long long MAX_WINDOW = 0x7fffffff;
+static const long long DEFAULT_WINDOW = 65535;
+
+static uint32_t get32( const uint8_t* p ){
+    return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) | ( (uint32_t)p[2] << 8 ) | p[3];
+}
+
+static void put32( uint8_t* p, uint32_t v ){
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+//HTTP2-Settings是不带填充的base64url
+static bool base64url_decode( const char* s, std::string& out ){
+    uint32_t acc = 0;
+    int bits = 0;
+    for( ; *s && *s != '='; ++s ){
+        int v;
+        char c = *s;
+        if( c >= 'A' && c <= 'Z' ){
+            v = c - 'A';
+        }else if( c >= 'a' && c <= 'z' ){
+            v = c - 'a' + 26;
+        }else if( c >= '0' && c <= '9' ){
+            v = c - '0' + 52;
+        }else if( c == '-' || c == '+' ){
+            v = 62;
+        }else if( c == '_' || c == '/' ){
+            v = 63;
+        }else{
+            return false;
+        }
+        acc = ( acc << 6 ) | v;
+        bits += 6;
+        if( bits >= 8 ){
+            bits -= 8;
+            out.push_back( (char)( acc >> bits ) );
+        }
+    }
+    return true;
+}
+
+h2_stream::h2_stream( uint32_t stream_id ):
+    id( stream_id ), body_overflow( false ), data( 0 ), data_left( 0 ), map( 0 ), map_len( 0 ),
+    file_offset( 0 ), file_left( 0 ),
+    send_window( DEFAULT_WINDOW ), remote_closed( false ), local_closed( false ), reset( false ), queued( 0 ){
+}
+
+h2_stream::~h2_stream(){
+    if( map ){
+        munmap( map, map_len );
+    }
+}
+
+h2_session::h2_session():
+    m_in_len( 0 ), m_preface_done( false ), m_settings_seen( false ),
+    m_block_stream( 0 ), m_block_flags( 0 ), m_in_block( false ), m_last_stream( 0 ),
+    m_peer_window( DEFAULT_WINDOW ), m_peer_max_frame( MAX_FRAME_SIZE ),
+    m_send_window( DEFAULT_WINDOW ), m_recv_window( DEFAULT_WINDOW ), m_recv_credit( 0 ),
+    m_out_offset( 0 ), m_out_bytes( 0 ), m_blocked( false ), m_yielded( false ), m_bytes_sent( 0 ),
+    m_goaway_sent( false ), m_peer_goaway( false ), m_failed( false ){
+}
+
+h2_session::~h2_session(){
+    //输出队列还引用着的流，等队列里的片段都丢弃后再释放
+    for( std::map< uint32_t, h2_stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it ){
+        it->second->local_closed = true;
+        if( it->second->queued == 0 ){
+            m_dead.push_back( it->second );
+        }
+    }
+    m_streams.clear();
+    for( size_t i = 0; i < m_out.size(); ++i ){
+        h2_stream* s = m_out[i].stream;
+        if( s && --s->queued == 0 ){
+            m_dead.push_back( s );
+        }
+    }
+    collect();
+}
+
+void h2_session::start(){
+    uint8_t settings[ 6 ] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS };
+    put32( settings + 2, MAX_STREAMS );
+    queue_frame( sizeof( settings ), SETTINGS, 0, 0 );
+    queue( settings, sizeof( settings ) );
+}
+
+h2_stream* h2_session::upgrade( const char* settings ){
+    std::string payload;
+    if( !settings || !base64url_decode( settings, payload ) || payload.size() % 6 != 0
+            || apply_settings( (const uint8_t*)payload.data(), payload.size() ) != 0 ){
+        return 0;
+    }
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    queue( switching, sizeof( switching ) - 1 );
+    start();
+    //升级前的请求就是流1，它的请求已经收齐
+    h2_stream* s = new h2_stream( 1 );
+    s->send_window = m_peer_window;
+    s->remote_closed = true;
+    m_streams[ 1 ] = s;
+    m_last_stream = 1;
+    return s;
+}
+
+bool h2_session::feed( const char* data, int len ){
+    if( len > INPUT_SIZE - m_in_len ){
+        return false;
+    }
+    memcpy( m_in + m_in_len, data, len );
+    m_in_len += len;
+    return true;
+}
+
+bool h2_session::read( conn_io& io ){
+    //回复还没有发出去时不再读，对方的帧留在socket中，输出队列不会因为它继续变长
+    if( backlogged() ){
+        return true;
+    }
+    while( m_in_len < INPUT_SIZE ){
+        ssize_t n = io.recv( m_in + m_in_len, INPUT_SIZE - m_in_len );
+        if( n < 0 ){
+            if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                break;
+            }
+            if( errno == EINTR ){
+                continue;
+            }
+            return false;
+        }
+        if( n == 0 ){
+            return false;
+        }
+        m_in_len += n;
+    }
+    return true;
+}
+
+bool h2_session::process( std::vector< h2_stream* >& ready ){
+    collect();
+    if( m_failed ){
+        return false;
+    }
+    int pos = 0;
+    if( !m_preface_done ){
+        int n = m_in_len < PREFACE_LEN ? m_in_len : PREFACE_LEN;
+        if( memcmp( m_in, PREFACE, n ) != 0 ){
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        if( n < PREFACE_LEN ){
+            return true;
+        }
+        pos = PREFACE_LEN;
+        m_preface_done = true;
+    }
+
+    bool ok = true;
+    while( ok && m_in_len - pos >= FRAME_HEADER ){
+        const uint8_t* h = (const uint8_t*)m_in + pos;
+        uint32_t len = ( (uint32_t)h[0] << 16 ) | ( (uint32_t)h[1] << 8 ) | h[2];
+        if( len > (uint32_t)MAX_FRAME_SIZE ){
+            ok = connection_error( H2_FRAME_SIZE_ERROR );
+            break;
+        }
+        //帧还没有收完整，留到下一次
+        if( m_in_len - pos < FRAME_HEADER + (int)len ){
+            break;
+        }
+        ok = on_frame( h[3], h[4], get32( h + 5 ) & 0x7fffffff, h + FRAME_HEADER, len, ready );
+        pos += FRAME_HEADER + len;
+    }
+    memmove( m_in, m_in + pos, m_in_len - pos );
+    m_in_len -= pos;
+
+    //本轮收到的DATA一次性归还连接级窗口
+    if( ok && m_recv_credit > 0 ){
+        queue_window_update( 0, m_recv_credit );
+        m_recv_window += m_recv_credit;
+        m_recv_credit = 0;
+    }
+    if( ok && m_out_bytes > (size_t)CONTROL_HIGH ){
+        ok = connection_error( H2_ENHANCE_YOUR_CALM );
+    }
+    return ok;
+}
+
+bool h2_session::on_frame( uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready ){
+    //连接序言之后的第一个帧必须是SETTINGS，头部块中间不能插入其他帧
+    if( ( !m_settings_seen && type != SETTINGS ) || ( m_in_block && type != CONTINUATION ) ){
+        return connection_error( H2_PROTOCOL_ERROR );
+    }
+    switch( type ){
+        case DATA:{
+            return on_data( flags, id, p, len, ready );
+        }
+        case HEADERS:{
+            return on_headers( flags, id, p, len, ready );
+        }
+        case CONTINUATION:{
+            if( !m_in_block || id != m_block_stream ){
+                return connection_error( H2_PROTOCOL_ERROR );
+            }
+            if( m_block.size() + len > (size_t)MAX_HEADER_BLOCK ){
+                return connection_error( H2_ENHANCE_YOUR_CALM );
+            }
+            m_block.append( (const char*)p, len );
+            if( flags & FLAG_END_HEADERS ){
+                m_in_block = false;
+                return end_headers( ready );
+            }
+            return true;
+        }
+        case PRIORITY:{
+            //不按优先级调度，只检查格式
+            if( id == 0 ){
+                return connection_error( H2_PROTOCOL_ERROR );
+            }
+            if( len != 5 ){
+                queue_rst( id, H2_FRAME_SIZE_ERROR );
+            }
+            return true;
+        }
+        case RST_STREAM:{
+            if( id == 0 || id > m_last_stream ){
+                return connection_error( H2_PROTOCOL_ERROR );
+            }
+            if( len != 4 ){
+                return connection_error( H2_FRAME_SIZE_ERROR );
+            }
+            h2_stream* s = find( id );
+            if( s ){
+                s->reset = true;
+                close_stream( s );
+            }
+            return true;
+        }
+        case SETTINGS:{
+            return on_settings( flags, id, p, len );
+        }
+        case PUSH_PROMISE:{
+            //客户端不能推送
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        case PING:{
+            if( id != 0 ){
+                return connection_error( H2_PROTOCOL_ERROR );
+            }
+            if( len != 8 ){
+                return connection_error( H2_FRAME_SIZE_ERROR );
+            }
+            if( !( flags & FLAG_ACK ) ){
+                queue_frame( 8, PING, FLAG_ACK, 0 );
+                queue( p, 8 );
+            }
+            return true;
+        }
+        case GOAWAY:{
+            if( id != 0 ){
+                return connection_error( H2_PROTOCOL_ERROR );
+            }
+            if( len < 8 ){
+                return connection_error( H2_FRAME_SIZE_ERROR );
+            }
+            //已经开始的流照常处理完
+            m_peer_goaway = true;
+            return true;
+        }
+        case WINDOW_UPDATE:{
+            return on_window_update( id, p, len );
+        }
+        default:{
+            //未知类型的帧必须忽略
+            return true;
+        }
+    }
+}
+
+bool h2_session::on_headers( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready ){
+    //客户端发起的流编号都是奇数
+    if( id == 0 || !( id & 1 ) ){
+        return connection_error( H2_PROTOCOL_ERROR );
+    }
+    if( flags & FLAG_PADDED ){
+        if( len < 1 || p[0] >= len ){
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        len -= 1 + p[0];
+        ++p;
+    }
+    if( flags & FLAG_PRIORITY ){
+        if( len < 5 ){
+            return connection_error( H2_FRAME_SIZE_ERROR );
+        }
+        p += 5;
+        len -= 5;
+    }
+    m_block.assign( (const char*)p, len );
+    m_block_stream = id;
+    m_block_flags = flags;
+    if( flags & FLAG_END_HEADERS ){
+        return end_headers( ready );
+    }
+    m_in_block = true;
+    return true;
+}
+
+bool h2_session::end_headers( std::vector< h2_stream* >& ready ){
+    //拒绝的流也要解码，否则动态表和对方不一致
+    m_headers.clear();
+    if( !m_decoder.decode( (const uint8_t*)m_block.data(), m_block.size(), m_headers, MAX_HEADER_LIST ) ){
+        return connection_error( H2_COMPRESSION_ERROR );
+    }
+    uint32_t id = m_block_stream;
+    bool end_stream = m_block_flags & FLAG_END_STREAM;
+    h2_stream* s = find( id );
+    if( s ){
+        //请求的尾部，内容用不到，只表示请求结束
+        if( s->remote_closed ){
+            return connection_error( H2_STREAM_CLOSED );
+        }
+        if( !end_stream ){
+            reset( s, H2_PROTOCOL_ERROR );
+            return true;
+        }
+        s->remote_closed = true;
+        ready.push_back( s );
+        return true;
+    }
+    //已经结束的流，可能是我们刚拒绝的，忽略
+    if( id <= m_last_stream ){
+        return true;
+    }
+    m_last_stream = id;
+    //GOAWAY之后的新流不再处理
+    if( m_goaway_sent ){
+        return true;
+    }
+    if( (int)m_streams.size() >= MAX_STREAMS ){
+        queue_rst( id, H2_REFUSED_STREAM );
+        return true;
+    }
+    s = new h2_stream( id );
+    s->send_window = m_peer_window;
+    m_streams[ id ] = s;
+    if( !fill_request( s ) ){
+        reset( s, H2_PROTOCOL_ERROR );
+        return true;
+    }
+    if( end_stream ){
+        s->remote_closed = true;
+        ready.push_back( s );
+    }
+    return true;
+}
+
+bool h2_session::fill_request( h2_stream* s ){
+    bool regular = false;
+    bool scheme = false;
+    for( size_t i = 0; i < m_headers.size(); ++i ){
+        const std::string& name = m_headers[i].name;
+        const std::string& value = m_headers[i].value;
+        if( name.empty() ){
+            return false;
+        }
+        for( size_t j = 0; j < name.size(); ++j ){
+            if( name[j] >= 'A' && name[j] <= 'Z' ){
+                return false;
+            }
+        }
+        //伪头部必须在普通头部之前
+        if( name[0] == ':' ){
+            if( regular ){
+                return false;
+            }
+            if( name == ":method" ){
+                s->method = value;
+            }else if( name == ":path" ){
+                s->path = value;
+            }else if( name == ":authority" ){
+                s->authority = value;
+            }else if( name == ":scheme" ){
+                scheme = true;
+            }else{
+                return false;
+            }
+            continue;
+        }
+        regular = true;
+        //连接相关的头部在HTTP/2中没有意义
+        if( name == "connection" || name == "keep-alive" || name == "proxy-connection"
+                || name == "transfer-encoding" || name == "upgrade" || ( name == "te" && value != "trailers" ) ){
+            return false;
+        }
+        if( name == "host" ){
+            if( s->authority.empty() ){
+                s->authority = value;
+            }
+        }else if( name == "accept-encoding" ){
+            if( !s->accept_encoding.empty() ){
+                s->accept_encoding += ", ";
+            }
+            s->accept_encoding += value;
+        }else if( name == "if-none-match" ){
+            s->if_none_match = value;
+        }
+    }
+    return scheme && !s->method.empty() && !s->path.empty();
+}
+
+bool h2_session::on_data( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready ){
+    if( id == 0 ){
+        return connection_error( H2_PROTOCOL_ERROR );
+    }
+    //填充也占用窗口
+    uint32_t total = len;
+    if( flags & FLAG_PADDED ){
+        if( len < 1 || p[0] >= len ){
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        len -= 1 + p[0];
+        ++p;
+    }
+    m_recv_window -= total;
+    if( m_recv_window < 0 ){
+        return connection_error( H2_FLOW_CONTROL_ERROR );
+    }
+    m_recv_credit += total;
+
+    h2_stream* s = find( id );
+    if( !s ){
+        if( id > m_last_stream ){
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        return true;
+    }
+    if( s->remote_closed ){
+        reset( s, H2_STREAM_CLOSED );
+        return true;
+    }
+    if( s->body.size() + len > (size_t)MAX_BODY ){
+        s->body_overflow = true;
+    }else{
+        s->body.append( (const char*)p, len );
+    }
+    if( flags & FLAG_END_STREAM ){
+        s->remote_closed = true;
+        ready.push_back( s );
+    }else if( total > 0 ){
+        queue_window_update( id, total );
+    }
+    return true;
+}
+
+bool h2_session::on_settings( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len ){
+    if( id != 0 ){
+        return connection_error( H2_PROTOCOL_ERROR );
+    }
+    if( flags & FLAG_ACK ){
+        return len == 0 || connection_error( H2_FRAME_SIZE_ERROR );
+    }
+    if( len % 6 != 0 ){
+        return connection_error( H2_FRAME_SIZE_ERROR );
+    }
+    uint32_t code = apply_settings( p, len );
+    if( code != 0 ){
+        return connection_error( code );
+    }
+    m_settings_seen = true;
+    queue_frame( 0, SETTINGS, FLAG_ACK, 0 );
+    return true;
+}
+
+uint32_t h2_session::apply_settings( const uint8_t* p, uint32_t len ){
+    for( uint32_t i = 0; i + 6 <= len; i += 6 ){
+        uint16_t key = ( p[i] << 8 ) | p[ i + 1 ];
+        uint32_t value = get32( p + i + 2 );
+        switch( key ){
+            case SETTINGS_ENABLE_PUSH:{
+                if( value > 1 ){
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            }
+            case SETTINGS_INITIAL_WINDOW_SIZE:{
+                if( value > MAX_WINDOW ){
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                //已经打开的流按差值调整
+                long long delta = (long long)value - m_peer_window;
+                for( std::map< uint32_t, h2_stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it ){
+                    it->second->send_window += delta;
+                    if( it->second->send_window > MAX_WINDOW ){
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                }
+                m_peer_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:{
+                if( value < (uint32_t)MAX_FRAME_SIZE || value > 16777215 ){
+                    return H2_PROTOCOL_ERROR;
+                }
+                m_peer_max_frame = value;
+                break;
+            }
+            default:{
+                //动态表大小不影响我们（编码器不用动态表），其余参数用不到
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+bool h2_session::on_window_update( uint32_t id, const uint8_t* p, uint32_t len ){
+    if( len != 4 ){
+        return connection_error( H2_FRAME_SIZE_ERROR );
+    }
+    uint32_t increment = get32( p ) & 0x7fffffff;
+    if( id == 0 ){
+        if( increment == 0 ){
+            return connection_error( H2_PROTOCOL_ERROR );
+        }
+        m_send_window += increment;
+        return m_send_window <= MAX_WINDOW || connection_error( H2_FLOW_CONTROL_ERROR );
+    }
+    h2_stream* s = find( id );
+    if( !s ){
+        return id <= m_last_stream || connection_error( H2_PROTOCOL_ERROR );
+    }
+    if( increment == 0 ){
+        reset( s, H2_PROTOCOL_ERROR );
+        return true;
+    }
+    s->send_window += increment;
+    if( s->send_window > MAX_WINDOW ){
+        reset( s, H2_FLOW_CONTROL_ERROR );
+    }
+    return true;
+}
+
+bool h2_session::connection_error( uint32_t code ){
+    if( !m_failed ){
+        queue_goaway( code );
+        m_failed = true;
+    }
+    return false;
+}
+
+void h2_session::begin_response( int status ){
+    char text[ 8 ];
+    snprintf( text, sizeof( text ), "%d", status );
+    m_resp.clear();
+    hpack_encoder::encode( m_resp, ":status", text );
+}
+
+void h2_session::add_header( const char* name, const char* value ){
+    hpack_encoder::encode( m_resp, name, value );
+}
+
+void h2_session::end_response( h2_stream* s, const char* body, long long len, bool head ){
+    if( s->local_closed ){
+        return;
+    }
+    bool end = head || len == 0;
+    //头部块超过对方的最大帧时用CONTINUATION继续
+    size_t offset = 0;
+    do{
+        size_t n = m_resp.size() - offset;
+        if( n > m_peer_max_frame ){
+            n = m_peer_max_frame;
+        }
+        uint8_t flags = offset + n == m_resp.size() ? FLAG_END_HEADERS : 0;
+        if( offset == 0 && end ){
+            flags |= FLAG_END_STREAM;
+        }
+        queue_frame( n, offset == 0 ? HEADERS : CONTINUATION, flags, s->id );
+        queue( m_resp.data() + offset, n );
+        offset += n;
+    }while( offset < m_resp.size() );
+
+    if( end ){
+        close_stream( s );
+        return;
+    }
+    if( s->file.active() ){
+        s->data = 0;
+        s->data_left = 0;
+        s->file_offset = 0;
+        s->file_left = len;
+    }else{
+        s->data = body;
+        s->data_left = len;
+    }
+    m_sending.push_back( s );
+}
+
+void h2_session::reset( h2_stream* s, uint32_t code ){
+    if( s->local_closed ){
+        return;
+    }
+    queue_rst( s->id, code );
+    s->reset = true;
+    close_stream( s );
+}
+
+void h2_session::shutdown(){
+    if( !m_goaway_sent ){
+        queue_goaway( H2_NO_ERROR );
+    }
+}
+
+bool h2_session::finished() const {
+    if( !m_out.empty() ){
+        return false;
+    }
+    return m_failed || ( ( m_goaway_sent || m_peer_goaway ) && m_streams.empty() );
+}
+
+long long h2_session::take_bytes_sent(){
+    long long n = m_bytes_sent;
+    m_bytes_sent = 0;
+    return n;
+}
+
+h2_stream* h2_session::find( uint32_t id ) const {
+    std::map< uint32_t, h2_stream* >::const_iterator it = m_streams.find( id );
+    return it == m_streams.end() ? 0 : it->second;
+}
+
+//流的两个方向都结束了，输出队列不再引用它时释放
+void h2_session::close_stream( h2_stream* s ){
+    if( s->local_closed ){
+        return;
+    }
+    s->local_closed = true;
+    m_streams.erase( s->id );
+    for( size_t i = 0; i < m_sending.size(); ++i ){
+        if( m_sending[i] == s ){
+            m_sending.erase( m_sending.begin() + i );
+            break;
+        }
+    }
+    if( s->queued == 0 ){
+        m_dead.push_back( s );
+    }
+}
+
+//process返回的ready还可能引用本轮结束的流，所以释放推迟到下一次process或者flush
+void h2_session::collect(){
+    for( size_t i = 0; i < m_dead.size(); ++i ){
+        delete m_dead[i];
+    }
+    m_dead.clear();
+}
+
+//控制帧和头部拷贝到队尾的片段中，连续的小帧合并成一个iovec
+void h2_session::queue( const void* data, size_t len ){
+    if( m_out.empty() || m_out.back().data ){
+        m_out.push_back( segment() );
+        m_out.back().data = 0;
+        m_out.back().len = 0;
+        m_out.back().stream = 0;
+    }
+    m_out.back().bytes.append( (const char*)data, len );
+    m_out_bytes += len;
+}
+
+void h2_session::queue_frame( uint32_t len, uint8_t type, uint8_t flags, uint32_t id ){
+    uint8_t h[ FRAME_HEADER ];
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32( h + 5, id );
+    queue( h, sizeof( h ) );
+}
+
+//响应体不拷贝，片段直接指向文件映射，发送完之前流不能释放
+void h2_session::queue_body( h2_stream* s, const char* data, size_t len ){
+    segment seg;
+    seg.data = data;
+    seg.len = len;
+    seg.stream = s;
+    m_out.push_back( seg );
+    m_out_bytes += len;
+    ++s->queued;
+}
+
+void h2_session::queue_window_update( uint32_t id, uint32_t increment ){
+    uint8_t payload[ 4 ];
+    put32( payload, increment );
+    queue_frame( 4, WINDOW_UPDATE, 0, id );
+    queue( payload, 4 );
+}
+
+void h2_session::queue_rst( uint32_t id, uint32_t code ){
+    uint8_t payload[ 4 ];
+    put32( payload, code );
+    queue_frame( 4, RST_STREAM, 0, id );
+    queue( payload, 4 );
+}
+
+void h2_session::queue_goaway( uint32_t code ){
+    uint8_t payload[ 8 ];
+    put32( payload, m_last_stream );
+    put32( payload + 4, code );
+    queue_frame( 8, GOAWAY, 0, 0 );
+    queue( payload, 8 );
+    m_goaway_sent = true;
+}
+
+//在连接和流的窗口内，轮流给每个有响应体的流生成一个DATA帧，直到输出队列足够长
+bool h2_session::next_window( h2_stream* s ){
+    if( s->queued > 0 ){
+        return false;
+    }
+    size_t len = 0;
+    const char* p = s->file.map( s->file_offset, &len );
+    if( !p ){
+        //文件读不出来，只能放弃这个流
+        reset( s, H2_INTERNAL_ERROR );
+        return false;
+    }
+    if( (off_t)len > s->file_left ){
+        len = s->file_left;
+    }
+    s->data = p;
+    s->data_left = len;
+    s->file_offset += len;
+    s->file_left -= len;
+    return true;
+}
+
+bool h2_session::produce(){
+    bool produced = false;
+    bool progress = true;
+    while( progress && m_out_bytes < (size_t)OUTPUT_HIGH && m_send_window > 0 && !m_sending.empty() ){
+        progress = false;
+        for( size_t i = 0; i < m_sending.size() && m_out_bytes < (size_t)OUTPUT_HIGH; ){
+            h2_stream* s = m_sending[i];
+            if( s->data_left == 0 && s->file_left > 0 && !next_window( s ) ){
+                //窗口还被引用时先发其他流；映射失败时流已经从m_sending中移除
+                if( !s->local_closed ){
+                    ++i;
+                }
+                continue;
+            }
+            long long n = s->data_left;
+            if( n > m_peer_max_frame ){
+                n = m_peer_max_frame;
+            }
+            if( n > m_send_window ){
+                n = m_send_window;
+            }
+            if( n > s->send_window ){
+                n = s->send_window;
+            }
+            if( n <= 0 ){
+                ++i;
+                continue;
+            }
+            bool last = n == s->data_left && s->file_left == 0;
+            queue_frame( n, DATA, last ? FLAG_END_STREAM : 0, s->id );
+            queue_body( s, s->data, n );
+            s->data += n;
+            s->data_left -= n;
+            s->send_window -= n;
+            m_send_window -= n;
+            progress = produced = true;
+            if( last ){
+                close_stream( s );
+            }else{
+                ++i;
+            }
+        }
+    }
+    return produced;
+}
+
+void h2_session::consume( size_t n ){
+    m_out_bytes -= n;
+    while( n > 0 ){
+        segment& seg = m_out.front();
+        size_t left = ( seg.data ? seg.len : seg.bytes.size() ) - m_out_offset;
+        if( n < left ){
+            m_out_offset += n;
+            return;
+        }
+        n -= left;
+        m_out_offset = 0;
+        if( seg.stream && --seg.stream->queued == 0 && seg.stream->local_closed ){
+            m_dead.push_back( seg.stream );
+        }
+        m_out.pop_front();
+    }
+}
+
+bool h2_session::flush( conn_io& io, size_t quantum ){
+    size_t sent = 0;
+    m_yielded = false;
+    while( true ){
+        produce();
+        if( m_out.empty() ){
+            break;
+        }
+        //一个连接上的大文件不能一直占着线程，剩下的排到其他连接后面
+        if( quantum > 0 && sent >= quantum ){
+            m_blocked = true;
+            m_yielded = true;
+            collect();
+            return true;
+        }
+        struct iovec iv[ 64 ];
+        int count = 0;
+        size_t offset = m_out_offset;
+        for( std::deque< segment >::iterator it = m_out.begin(); it != m_out.end() && count < 64; ++it ){
+            const char* base = it->data ? it->data : it->bytes.data();
+            size_t len = it->data ? it->len : it->bytes.size();
+            iv[ count ].iov_base = (void*)( base + offset );
+            iv[ count ].iov_len = len - offset;
+            ++count;
+            offset = 0;
+        }
+        ssize_t n = io.writev( iv, count );
+        if( n < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                m_blocked = true;
+                collect();
+                return true;
+            }
+            return false;
+        }
+        m_bytes_sent += n;
+        sent += n;
+        consume( n );
+    }
+    m_blocked = false;
+    collect();
+    return true;
+}
@@ -0,0 +1,213 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "hpack.h"
+#include "../tls/tls.h"
+#include "../file/file_window.h"
+
+//HTTP/2连接上的一个流，也就是一个请求和它的响应
+struct h2_stream{
+    uint32_t id;
+
+    //请求的伪头部和用到的头部
+    std::string method;
+    std::string path;
+    std::string authority;
+    std::string accept_encoding;
+    std::string if_none_match;
+    //消息体，超过h2_session::MAX_BODY时只记录overflow
+    std::string body;
+    bool body_overflow;
+
+    //响应体，指向文件映射、打包文件、静态字符串或者owned
+    const char* data;
+    long long data_left;
+    //发送完后要munmap的文件映射
+    char* map;
+    size_t map_len;
+    //大文件：data指向当前窗口，当前窗口发完并且输出队列不再引用后映射下一个窗口
+    file_window file;
+    off_t file_offset;
+    off_t file_left;
+    //服务器生成的响应体
+    std::string owned;
+
+    //对方允许我们在这个流上发送的字节数，对方修改初始窗口时可能变成负数
+    long long send_window;
+    //收到了对方的END_STREAM
+    bool remote_closed;
+    //已经发出END_STREAM或者RST_STREAM，不会再产生输出
+    bool local_closed;
+    //对方发来了RST_STREAM，或者我们拒绝了这个流
+    bool reset;
+    //输出队列中引用data的片段数，为0后才能释放
+    int queued;
+
+    h2_stream( uint32_t stream_id );
+    ~h2_stream();
+};
+
+//一个HTTP/2（h2c）连接的协议状态：帧解析、HPACK、流和流量控制
+//一个连接同一时刻只在一个线程中处理（EPOLLONESHOT），不需要加锁
+//输入由工作线程解析，收齐的请求交给http_conn生成响应；输出可以在工作线程或reactor中发送
+class h2_session{
+public:
+    //客户端连接序言
+    static const char PREFACE[];
+    static const int PREFACE_LEN = 24;
+    static const int FRAME_HEADER = 9;
+    //我们接受的最大帧，也就是协议默认值，不在SETTINGS中修改
+    static const int MAX_FRAME_SIZE = 16384;
+    //同时打开的流上限，在SETTINGS中告诉对方
+    static const int MAX_STREAMS = 100;
+    //每个流缓存的消息体上限，HTTP/2上只有登录注册表单会用到消息体
+    static const int MAX_BODY = 8192;
+    //头部块（HEADERS加上CONTINUATION）和解码后头部的大小上限
+    static const int MAX_HEADER_BLOCK = 65536;
+    static const int MAX_HEADER_LIST = 16384;
+    //输入缓冲区至少能放下两个最大的帧
+    static const int INPUT_SIZE = 2 * ( MAX_FRAME_SIZE + FRAME_HEADER );
+    //输出队列超过这个长度就不再生成DATA帧，等发出去一部分再说
+    static const int OUTPUT_HIGH = 65536;
+    //对方只发不读时PING/SETTINGS的ACK、WINDOW_UPDATE和RST_STREAM在输出队列中越积越多，
+    //超过这个长度就发GOAWAY(ENHANCE_YOUR_CALM)断开
+    static const int CONTROL_HIGH = 4 * OUTPUT_HIGH;
+
+    enum FRAME_TYPE { DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION };
+    enum ERROR_CODE {
+        H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+        H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+        H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM, H2_INADEQUATE_SECURITY, H2_HTTP_1_1_REQUIRED
+    };
+
+    h2_session();
+    ~h2_session();
+
+    //发送我们的SETTINGS，prior knowledge时在收到连接序言前调用
+    void start();
+    //Upgrade: h2c，先发101再发SETTINGS，升级前的请求作为已经收齐的流1返回
+    //settings是HTTP2-Settings头部的值（base64url），不合法时返回NULL，不能升级
+    h2_stream* upgrade( const char* settings );
+    //HTTP/1.1解析时已经读进来、属于HTTP/2的字节
+    bool feed( const char* data, int len );
+    //循环读到EAGAIN或者缓冲区满，对方关闭或出错返回false
+    bool read( conn_io& io );
+    //处理缓冲区中所有完整的帧，收齐的请求追加到ready
+    //连接出错时返回false，GOAWAY已经放入输出队列，发送后关闭连接
+    bool process( std::vector< h2_stream* >& ready );
+
+    //为一个收齐的请求生成响应：begin_response，add_header若干次，end_response
+    void begin_response( int status );
+    void add_header( const char* name, const char* value );
+    //body在流结束前必须一直有效，head为true时只发头部
+    //流的file打开时body为NULL，响应体从文件按窗口读取
+    void end_response( h2_stream* s, const char* body, long long len, bool head );
+    //拒绝一个流，例如需要HTTP/1.1的代理路由
+    void reset( h2_stream* s, uint32_t code );
+    //平滑退出：发出GOAWAY，不再接受新的流，已有的流处理完后连接结束
+    void shutdown();
+
+    //在窗口允许的范围内生成DATA帧并写到socket，出错返回false
+    //输出队列只在末尾追加，TLS写不动时下一次还是从同样的数据开始
+    //quantum不为0时最多发送这么多字节就停下，和socket写满一样等EPOLLOUT再继续
+    bool flush( conn_io& io, size_t quantum = 0 );
+    //上次flush因为socket写满或者用完配额而停下，需要等EPOLLOUT
+    bool blocked() const { return m_blocked; }
+    //输出队列超过OUTPUT_HIGH，先把它发出去，不再读对方的输入
+    bool backlogged() const { return m_out_bytes > (size_t)OUTPUT_HIGH; }
+    //上次flush是因为用完配额停下的
+    bool yielded() const { return m_yielded; }
+    //连接已经没有事情可做，可以关闭
+    bool finished() const;
+    //上次调用之后写到socket的字节数，用于统计
+    long long take_bytes_sent();
+
+private:
+    struct segment{
+        //data为NULL时发送bytes，否则发送流的响应体中的一段
+        std::string bytes;
+        const char* data;
+        size_t len;
+        h2_stream* stream;
+    };
+
+    bool on_frame( uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready );
+    bool on_headers( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready );
+    bool end_headers( std::vector< h2_stream* >& ready );
+    bool on_data( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len, std::vector< h2_stream* >& ready );
+    bool on_settings( uint8_t flags, uint32_t id, const uint8_t* p, uint32_t len );
+    bool on_window_update( uint32_t id, const uint8_t* p, uint32_t len );
+    //返回0或者连接错误码
+    uint32_t apply_settings( const uint8_t* p, uint32_t len );
+    bool connection_error( uint32_t code );
+    //流的头部不合法（RFC 9113 8.1.1），返回false
+    bool fill_request( h2_stream* s );
+
+    h2_stream* find( uint32_t id ) const;
+    void close_stream( h2_stream* s );
+    void collect();
+
+    void queue( const void* data, size_t len );
+    void queue_frame( uint32_t len, uint8_t type, uint8_t flags, uint32_t id );
+    void queue_body( h2_stream* s, const char* data, size_t len );
+    void queue_window_update( uint32_t id, uint32_t increment );
+    void queue_rst( uint32_t id, uint32_t code );
+    void queue_goaway( uint32_t code );
+    bool produce();
+    //当前窗口发完后映射文件的下一个窗口，还有片段引用当前窗口时返回false
+    bool next_window( h2_stream* s );
+    void consume( size_t n );
+
+    //输入
+    char m_in[ INPUT_SIZE ];
+    int m_in_len;
+    bool m_preface_done;
+    bool m_settings_seen;
+
+    //正在收的头部块，HEADERS之后直到END_HEADERS只能是同一个流的CONTINUATION
+    std::string m_block;
+    uint32_t m_block_stream;
+    uint8_t m_block_flags;
+    bool m_in_block;
+    hpack_decoder m_decoder;
+    std::vector< hpack_header > m_headers;
+
+    //打开的流，结束后移出；m_sending是还有响应体没有发完的流，按顺序轮流发送
+    std::map< uint32_t, h2_stream* > m_streams;
+    std::vector< h2_stream* > m_sending;
+    //已经结束、等待输出队列不再引用后释放的流
+    std::vector< h2_stream* > m_dead;
+    uint32_t m_last_stream;
+
+    //对方的设置
+    long long m_peer_window;
+    uint32_t m_peer_max_frame;
+    //连接级的发送窗口，以及本轮已经消费、还没有通过WINDOW_UPDATE归还的接收窗口
+    long long m_send_window;
+    long long m_recv_window;
+    uint32_t m_recv_credit;
+
+    //正在组装的响应头部块
+    std::string m_resp;
+
+    //输出队列
+    std::deque< segment > m_out;
+    size_t m_out_offset;
+    size_t m_out_bytes;
+    bool m_blocked;
+    bool m_yielded;
+    long long m_bytes_sent;
+
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+    //发生了连接错误，只剩下把GOAWAY发出去
+    bool m_failed;
+};
+
+#endif
@@ -0,0 +1,419 @@
+#include "hpack.h"
+
+#include <string.h>
+
+const hpack_static_entry hpack_static_table[ HPACK_STATIC_COUNT + 1 ] = {
+    { "", "" },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+//RFC 7541附录B，每个符号的编码和位数，256为EOS
+struct huffman_code{
+    uint32_t code;
+    int bits;
+};
+static const huffman_code huffman_codes[ 257 ] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 }
+};
+
+//解码用的二叉树，启动后第一次使用时建立
+//child中非负数是内部节点的下标，负数表示叶子，符号为-child-1
+struct huffman_tree{
+    short child[ 512 ][ 2 ];
+    int count;
+
+    huffman_tree(): count( 1 ){
+        memset( child, 0, sizeof( child ) );
+        for( int sym = 0; sym < 257; ++sym ){
+            int node = 0;
+            for( int i = huffman_codes[ sym ].bits - 1; i > 0; --i ){
+                int bit = ( huffman_codes[ sym ].code >> i ) & 1;
+                if( child[ node ][ bit ] == 0 ){
+                    child[ node ][ bit ] = count++;
+                }
+                node = child[ node ][ bit ];
+            }
+            child[ node ][ huffman_codes[ sym ].code & 1 ] = -sym - 1;
+        }
+    }
+};
+
+static const huffman_tree& tree(){
+    static const huffman_tree t;
+    return t;
+}
+
+bool hpack_huffman_decode( const uint8_t* data, size_t len, std::string& out ){
+    const huffman_tree& t = tree();
+    int node = 0;
+    //上一个符号之后读过的位数，以及这些位是否全是1，结尾只允许不超过7位的全1填充
+    int pending = 0;
+    bool ones = true;
+    for( size_t i = 0; i < len; ++i ){
+        for( int b = 7; b >= 0; --b ){
+            int bit = ( data[i] >> b ) & 1;
+            int next = t.child[ node ][ bit ];
+            ++pending;
+            ones = ones && bit;
+            if( next < 0 ){
+                int sym = -next - 1;
+                if( sym == 256 ){
+                    return false;
+                }
+                out.push_back( (char)sym );
+                node = 0;
+                pending = 0;
+                ones = true;
+            }else if( next == 0 ){
+                return false;
+            }else{
+                node = next;
+            }
+        }
+    }
+    return pending <= 7 && ones;
+}
+
+size_t hpack_huffman_length( const char* data, size_t len ){
+    size_t bits = 0;
+    for( size_t i = 0; i < len; ++i ){
+        bits += huffman_codes[ (uint8_t)data[i] ].bits;
+    }
+    return ( bits + 7 ) / 8;
+}
+
+void hpack_huffman_encode( const char* data, size_t len, std::string& out ){
+    uint64_t acc = 0;
+    int bits = 0;
+    for( size_t i = 0; i < len; ++i ){
+        const huffman_code& c = huffman_codes[ (uint8_t)data[i] ];
+        acc = ( acc << c.bits ) | c.code;
+        bits += c.bits;
+        while( bits >= 8 ){
+            bits -= 8;
+            out.push_back( (char)( acc >> bits ) );
+        }
+    }
+    //用EOS的前缀（全1）补齐最后一个字节
+    if( bits > 0 ){
+        out.push_back( (char)( ( acc << ( 8 - bits ) ) | ( 0xff >> bits ) ) );
+    }
+}
+
+//prefix位前缀的整数，超过2^32视为出错
+static bool decode_int( const uint8_t*& p, const uint8_t* end, int prefix, uint64_t* value ){
+    if( p >= end ){
+        return false;
+    }
+    uint64_t max = ( 1u << prefix ) - 1;
+    uint64_t v = *p++ & max;
+    if( v < max ){
+        *value = v;
+        return true;
+    }
+    for( int shift = 0; p < end && shift <= 28; shift += 7 ){
+        uint8_t b = *p++;
+        v += (uint64_t)( b & 0x7f ) << shift;
+        if( !( b & 0x80 ) ){
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void encode_int( std::string& out, uint8_t first, int prefix, uint64_t v ){
+    uint64_t max = ( 1u << prefix ) - 1;
+    if( v < max ){
+        out.push_back( (char)( first | v ) );
+        return;
+    }
+    out.push_back( (char)( first | max ) );
+    v -= max;
+    while( v >= 128 ){
+        out.push_back( (char)( 0x80 | ( v & 0x7f ) ) );
+        v >>= 7;
+    }
+    out.push_back( (char)v );
+}
+
+static bool decode_string( const uint8_t*& p, const uint8_t* end, std::string& out ){
+    if( p >= end ){
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if( !decode_int( p, end, 7, &len ) || len > (uint64_t)( end - p ) ){
+        return false;
+    }
+    out.clear();
+    if( huffman ){
+        if( !hpack_huffman_decode( p, len, out ) ){
+            return false;
+        }
+    }else{
+        out.assign( (const char*)p, len );
+    }
+    p += len;
+    return true;
+}
+
+//Huffman更短时使用Huffman编码
+static void encode_string( std::string& out, const char* s ){
+    size_t len = strlen( s );
+    size_t huffman_len = hpack_huffman_length( s, len );
+    if( huffman_len < len ){
+        encode_int( out, 0x80, 7, huffman_len );
+        hpack_huffman_encode( s, len, out );
+    }else{
+        encode_int( out, 0, 7, len );
+        out.append( s, len );
+    }
+}
+
+hpack_decoder::hpack_decoder(): m_size( 0 ), m_max_size( DEFAULT_TABLE_SIZE ){
+}
+
+bool hpack_decoder::lookup( uint64_t index, std::string* name, std::string* value ) const {
+    if( index == 0 ){
+        return false;
+    }
+    if( index <= (uint64_t)HPACK_STATIC_COUNT ){
+        *name = hpack_static_table[ index ].name;
+        if( value ){
+            *value = hpack_static_table[ index ].value;
+        }
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if( index >= m_table.size() ){
+        return false;
+    }
+    *name = m_table[ index ].name;
+    if( value ){
+        *value = m_table[ index ].value;
+    }
+    return true;
+}
+
+//每个表项按名字、值的长度加32计算大小
+void hpack_decoder::evict( size_t limit ){
+    while( m_size > limit && !m_table.empty() ){
+        m_size -= m_table.back().name.size() + m_table.back().value.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert( const std::string& name, const std::string& value ){
+    size_t size = name.size() + value.size() + 32;
+    //比整个表还大的表项会清空动态表，自己也不插入
+    if( size > m_max_size ){
+        evict( 0 );
+        return;
+    }
+    evict( m_max_size - size );
+    hpack_header h;
+    h.name = name;
+    h.value = value;
+    m_table.push_front( h );
+    m_size += size;
+}
+
+bool hpack_decoder::decode( const uint8_t* data, size_t len, std::vector< hpack_header >& out, size_t max_list_size ){
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    size_t list_size = 0;
+    //动态表大小更新只能出现在头部块开头
+    bool header_seen = false;
+    while( p < end ){
+        uint8_t b = *p;
+        uint64_t index;
+        hpack_header h;
+        if( b & 0x80 ){
+            //已索引的字段
+            if( !decode_int( p, end, 7, &index ) || !lookup( index, &h.name, &h.value ) ){
+                return false;
+            }
+        }else if( ( b & 0xe0 ) == 0x20 ){
+            uint64_t size;
+            if( header_seen || !decode_int( p, end, 5, &size ) || size > DEFAULT_TABLE_SIZE ){
+                return false;
+            }
+            m_max_size = size;
+            evict( m_max_size );
+            continue;
+        }else{
+            //字面值：01带增量索引，0000不索引，0001永不索引
+            bool indexing = ( b & 0xc0 ) == 0x40;
+            if( !decode_int( p, end, indexing ? 6 : 4, &index ) ){
+                return false;
+            }
+            if( index == 0 ){
+                if( !decode_string( p, end, h.name ) ){
+                    return false;
+                }
+            }else if( !lookup( index, &h.name, 0 ) ){
+                return false;
+            }
+            if( !decode_string( p, end, h.value ) ){
+                return false;
+            }
+            if( indexing ){
+                insert( h.name, h.value );
+            }
+        }
+        header_seen = true;
+        list_size += h.name.size() + h.value.size() + 32;
+        if( list_size > max_list_size ){
+            return false;
+        }
+        out.push_back( h );
+    }
+    return true;
+}
+
+void hpack_encoder::encode( std::string& out, const char* name, const char* value ){
+    int name_index = 0;
+    for( int i = 1; i <= HPACK_STATIC_COUNT; ++i ){
+        if( strcmp( hpack_static_table[i].name, name ) != 0 ){
+            continue;
+        }
+        if( strcmp( hpack_static_table[i].value, value ) == 0 ){
+            encode_int( out, 0x80, 7, i );
+            return;
+        }
+        if( name_index == 0 ){
+            name_index = i;
+        }
+    }
+    //不索引的字面值，名字能引用静态表时只写下标
+    encode_int( out, 0, 4, name_index );
+    if( name_index == 0 ){
+        encode_string( out, name );
+    }
+    encode_string( out, value );
+}
@@ -0,0 +1,60 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+//HPACK（RFC 7541）：HTTP/2的头部压缩
+
+//一个头部字段，名字都是小写
+struct hpack_header{
+    std::string name;
+    std::string value;
+};
+
+//静态表，编码和解码共用，下标从1开始
+struct hpack_static_entry{
+    const char* name;
+    const char* value;
+};
+static const int HPACK_STATIC_COUNT = 61;
+extern const hpack_static_entry hpack_static_table[ HPACK_STATIC_COUNT + 1 ];
+
+//Huffman编码的字符串，出错（EOS、填充不合法）返回false
+bool hpack_huffman_decode( const uint8_t* data, size_t len, std::string& out );
+void hpack_huffman_encode( const char* data, size_t len, std::string& out );
+size_t hpack_huffman_length( const char* data, size_t len );
+
+//每个连接一个，保存对方插入的动态表，只在处理该连接的线程中使用
+class hpack_decoder{
+public:
+    //我们在SETTINGS中声明的动态表大小上限
+    static const size_t DEFAULT_TABLE_SIZE = 4096;
+
+    hpack_decoder();
+    //解码一个完整的头部块，追加到out，解码后的头部总长度超过max_list_size也算出错
+    //出错时连接的压缩状态已经不可用，只能以COMPRESSION_ERROR关闭连接
+    bool decode( const uint8_t* data, size_t len, std::vector< hpack_header >& out, size_t max_list_size );
+
+private:
+    bool lookup( uint64_t index, std::string* name, std::string* value ) const;
+    void insert( const std::string& name, const std::string& value );
+    void evict( size_t limit );
+
+    //新插入的在前面，动态表的下标从HPACK_STATIC_COUNT + 1开始
+    std::deque< hpack_header > m_table;
+    size_t m_size;
+    //对方通过动态表大小更新指定的当前上限，不能超过DEFAULT_TABLE_SIZE
+    size_t m_max_size;
+};
+
+//只引用静态表，从不插入动态表，对方的解码器不需要为我们保存任何状态
+class hpack_encoder{
+public:
+    static void encode( std::string& out, const char* name, const char* value );
+};
+
+#endif
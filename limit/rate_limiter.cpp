@@ -0,0 +1,240 @@
+#include "rate_limiter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <new>
+
+//拿不到分片的锁时最多自旋的次数，超过后当作没有限制放行
+static const int LOCK_SPINS = 1000;
+//令牌桶容量的上限，千分之一个令牌为单位时要放得进槽位中的int32_t
+static const int MAX_BURST = 1000000;
+
+//一个客户端（地址前缀）的令牌桶和连接数，last为0表示空槽位
+struct rate_limiter::slot{
+    uint64_t hi;
+    uint64_t lo;
+    long long last;
+    int32_t tokens;
+    int32_t conns;
+};
+
+//分片独占缓存行，不同分片的锁不会互相干扰
+struct alignas( 64 ) rate_limiter::shard{
+    std::atomic< uint32_t > lock;
+    slot* slots;
+};
+
+static long long now_ms(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+static uint64_t mix( uint64_t h ){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+//高prefix位的掩码，prefix为0时全部清零
+static uint64_t prefix_mask( int prefix ){
+    if( prefix <= 0 ){
+        return 0;
+    }
+    if( prefix >= 64 ){
+        return ~0ull;
+    }
+    return ~0ull << ( 64 - prefix );
+}
+
+rate_limiter::rate_limiter():
+    m_shards( 0 ), m_map_len( 0 ), m_shard_slots( 0 ), m_rate( 0 ), m_burst( 0 ),
+    m_max_conns( 0 ), m_prefix4( 32 ), m_prefix6( 64 ), m_seed( 0 ){
+}
+
+rate_limiter::~rate_limiter(){
+    if( m_shards ){
+        munmap( m_shards, m_map_len );
+    }
+}
+
+bool rate_limiter::init( const server_config& cfg ){
+    m_rate = cfg.rate_limit;
+    m_burst = cfg.rate_burst > 0 ? cfg.rate_burst : cfg.rate_limit;
+    if( m_burst > MAX_BURST ){
+        m_burst = MAX_BURST;
+    }
+    m_burst *= 1000;
+    m_max_conns = cfg.conn_limit;
+    m_prefix4 = cfg.limit_prefix4 > 32 ? 32 : cfg.limit_prefix4;
+    m_prefix6 = cfg.limit_prefix6 > 128 ? 128 : cfg.limit_prefix6;
+    if( ( m_rate == 0 && m_max_conns == 0 ) || cfg.limit_slots <= 0 ){
+        return true;
+    }
+
+    //每个分片的槽位数取2的幂，至少一个探测窗口
+    uint32_t per = PROBES;
+    while( (uint64_t)per * SHARDS < (uint64_t)cfg.limit_slots && per < ( 1u << 24 ) ){
+        per <<= 1;
+    }
+    m_shard_slots = per;
+    m_map_len = sizeof( shard ) * SHARDS + sizeof( slot ) * per * SHARDS;
+    //匿名共享映射按页分配，没有用到的槽位不占物理内存
+    void* p = mmap( NULL, m_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED ){
+        printf( "cannot map rate limit table of %d slots\n", cfg.limit_slots );
+        return false;
+    }
+    m_shards = ( shard* )p;
+    slot* slots = ( slot* )( m_shards + SHARDS );
+    for( int i = 0; i < SHARDS; ++i ){
+        new( &m_shards[i] ) shard;
+        m_shards[i].lock.store( 0 );
+        m_shards[i].slots = slots + (size_t)per * i;
+    }
+    if( getrandom( &m_seed, sizeof( m_seed ), 0 ) != sizeof( m_seed ) ){
+        m_seed = mix( (uint64_t)now_ms() ^ ( (uint64_t)getpid() << 32 ) );
+    }
+    return true;
+}
+
+rate_limiter::key rate_limiter::key_of( const struct sockaddr* addr ) const{
+    key k = { 0, 0 };
+    if( addr->sa_family == AF_INET6 ){
+        const unsigned char* b = ( ( const struct sockaddr_in6* )addr )->sin6_addr.s6_addr;
+        for( int i = 0; i < 8; ++i ){
+            k.hi = ( k.hi << 8 ) | b[i];
+            k.lo = ( k.lo << 8 ) | b[ 8 + i ];
+        }
+        //IPv4映射的地址和IPv4连接用同一个前缀
+        if( k.hi == 0 && ( k.lo >> 32 ) == 0xffff ){
+            k.lo = ( 0xffffull << 32 ) | ( k.lo & ( prefix_mask( m_prefix4 ) >> 32 ) );
+        }else{
+            k.hi &= prefix_mask( m_prefix6 );
+            k.lo &= prefix_mask( m_prefix6 - 64 );
+        }
+    }else if( addr->sa_family == AF_INET ){
+        uint64_t ip = ntohl( ( ( const struct sockaddr_in* )addr )->sin_addr.s_addr );
+        k.lo = ( 0xffffull << 32 ) | ( ip & ( prefix_mask( m_prefix4 ) >> 32 ) );
+    }
+    return k;
+}
+
+rate_limiter::slot* rate_limiter::lookup( const key& k, shard** locked, long long now ){
+    uint64_t h = mix( k.hi ^ m_seed ) ^ mix( k.lo + m_seed );
+    shard* sh = &m_shards[ h % SHARDS ];
+    bool got = false;
+    for( int i = 0; i < LOCK_SPINS && !got; ++i ){
+        uint32_t expected = 0;
+        got = sh->lock.compare_exchange_weak( expected, 1, std::memory_order_acquire );
+        if( !got && i % 64 == 63 ){
+            sched_yield();
+        }
+    }
+    if( !got ){
+        return NULL;
+    }
+    *locked = sh;
+
+    //槽位只会被覆盖不会清空，窗口中遇到的第一个空槽位之后不会再有这个地址
+    uint32_t mask = m_shard_slots - 1;
+    uint32_t start = ( h / SHARDS ) & mask;
+    slot* victim = 0;
+    for( int i = 0; i < PROBES; ++i ){
+        slot* s = &sh->slots[ ( start + i ) & mask ];
+        if( s->last == 0 ){
+            victim = s;
+            break;
+        }
+        if( s->hi == k.hi && s->lo == k.lo ){
+            return s;
+        }
+        //没有连接的槽位优先，其次是最久没有访问的
+        if( !victim || ( victim->conns > 0 && s->conns == 0 )
+                || ( ( victim->conns > 0 ) == ( s->conns > 0 ) && s->last < victim->last ) ){
+            victim = s;
+        }
+    }
+    victim->hi = k.hi;
+    victim->lo = k.lo;
+    victim->last = now;
+    victim->tokens = m_burst;
+    victim->conns = 0;
+    return victim;
+}
+
+void rate_limiter::refill( slot* s, long long now ){
+    long long elapsed = now - s->last;
+    if( elapsed <= 0 ){
+        return;
+    }
+    int64_t tokens = s->tokens + elapsed * m_rate;
+    s->tokens = tokens > m_burst ? m_burst : tokens;
+    s->last = now;
+}
+
+bool rate_limiter::connect( const key& k ){
+    if( !m_shards || m_max_conns == 0 ){
+        return true;
+    }
+    shard* sh = 0;
+    long long now = now_ms();
+    slot* s = lookup( k, &sh, now );
+    if( !s ){
+        return true;
+    }
+    refill( s, now );
+    bool ok = s->conns < m_max_conns;
+    if( ok ){
+        ++s->conns;
+    }
+    sh->lock.store( 0, std::memory_order_release );
+    return ok;
+}
+
+void rate_limiter::disconnect( const key& k ){
+    if( !m_shards || m_max_conns == 0 ){
+        return;
+    }
+    //槽位可能已经被淘汰后重新分配，计数为0时不再减
+    shard* sh = 0;
+    long long now = now_ms();
+    slot* s = lookup( k, &sh, now );
+    if( !s ){
+        return;
+    }
+    refill( s, now );
+    if( s->conns > 0 ){
+        --s->conns;
+    }
+    sh->lock.store( 0, std::memory_order_release );
+}
+
+bool rate_limiter::request( const key& k ){
+    if( !m_shards || m_rate == 0 ){
+        return true;
+    }
+    shard* sh = 0;
+    long long now = now_ms();
+    slot* s = lookup( k, &sh, now );
+    if( !s ){
+        return true;
+    }
+    refill( s, now );
+    bool ok = s->tokens >= 1000;
+    if( ok ){
+        s->tokens -= 1000;
+    }
+    sh->lock.store( 0, std::memory_order_release );
+    return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include "../config/config.h"
+
+//按客户端地址限制请求速率和并发连接数，超过限制的客户端收到429
+//地址按前缀聚合（默认IPv4按单个地址，IPv6按/64），IPv4转换成::ffff:a.b.c.d统一处理
+//
+//表在fork之前mmap，所有worker共享，大小固定：分成SHARDS个分片，每个分片一个自旋锁，
+//分片内开放寻址，只在PROBES个相邻槽位中查找；找不到空槽位时淘汰其中最久没有访问的，
+//优先淘汰没有连接的槽位（近似LRU）。不同地址再多也只占用这张表，被淘汰的地址重新开始计数
+//令牌在访问时按经过的时间补充，不需要定时器
+class rate_limiter{
+public:
+    static const int SHARDS = 64;
+    static const int PROBES = 8;
+
+    //聚合后的客户端地址
+    struct key{
+        uint64_t hi;
+        uint64_t lo;
+    };
+
+    rate_limiter();
+    ~rate_limiter();
+
+    //没有配置任何限制时不创建表，enabled()为false
+    bool init( const server_config& cfg );
+    bool enabled() const { return m_shards != 0; }
+    key key_of( const struct sockaddr* addr ) const;
+
+    //新连接，超过并发连接数时返回false，连接没有被计数
+    bool connect( const key& k );
+    //connect返回true的连接关闭时调用
+    void disconnect( const key& k );
+    //取一个令牌，令牌用完时返回false
+    bool request( const key& k );
+
+private:
+    struct slot;
+    struct shard;
+
+    //加锁后在分片中查找，没有时占用一个槽位；拿不到锁时返回NULL，调用的地方放行
+    slot* lookup( const key& k, shard** locked, long long now );
+    void refill( slot* s, long long now );
+
+    shard* m_shards;
+    size_t m_map_len;
+    //每个分片的槽位数，2的幂
+    uint32_t m_shard_slots;
+    //令牌以千分之一个为单位：每毫秒补充m_rate个（即每秒m_rate个令牌），桶容量m_burst
+    //m_rate为0表示不限制请求速率，m_max_conns为0表示不限制连接数
+    int64_t m_rate;
+    int64_t m_burst;
+    int m_max_conns;
+    int m_prefix4;
+    int m_prefix6;
+    //哈希种子，客户端无法构造落在同一分片的地址
+    uint64_t m_seed;
+};
+
+#endif
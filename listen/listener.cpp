@@ -0,0 +1,216 @@
+#include "listener.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+bool listen_resolve( const char* ip, int port, bool tls, listen_addr& out ){
+    if( port <= 0 || port > 65535 ){
+        return false;
+    }
+    memset( &out.addr, 0, sizeof( out.addr ) );
+    out.tls = tls;
+    sockaddr_in* in4 = (sockaddr_in*)&out.addr;
+    sockaddr_in6* in6 = (sockaddr_in6*)&out.addr;
+    if( strcmp( ip, "*" ) == 0 ){
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons( port );
+        out.len = sizeof( sockaddr_in6 );
+    }else if( strchr( ip, ':' ) ){
+        if( inet_pton( AF_INET6, ip, &in6->sin6_addr ) != 1 ){
+            return false;
+        }
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons( port );
+        out.len = sizeof( sockaddr_in6 );
+    }else{
+        if( inet_pton( AF_INET, ip, &in4->sin_addr ) != 1 ){
+            return false;
+        }
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons( port );
+        out.len = sizeof( sockaddr_in );
+    }
+    char text[ 128 ];
+    snprintf( text, sizeof( text ), strchr( ip, ':' ) ? "[%s]:%d" : "%s:%d", ip, port );
+    out.text = text;
+    return true;
+}
+
+bool listen_parse( const char* spec, listen_addr& out ){
+    char addr[ 256 ], flag[ 16 ];
+    int n = sscanf( spec, "%255s %15s", addr, flag );
+    if( n < 1 || ( n == 2 && strcasecmp( flag, "tls" ) != 0 ) ){
+        return false;
+    }
+    bool tls = n == 2;
+    if( strncmp( addr, "unix:", 5 ) == 0 ){
+        const char* path = addr + 5;
+        sockaddr_un* un = (sockaddr_un*)&out.addr;
+        //sun_path要带上结尾的\0
+        if( *path != '/' || strlen( path ) >= sizeof( un->sun_path ) ){
+            return false;
+        }
+        memset( &out.addr, 0, sizeof( out.addr ) );
+        un->sun_family = AF_UNIX;
+        strcpy( un->sun_path, path );
+        out.len = offsetof( sockaddr_un, sun_path ) + strlen( path ) + 1;
+        out.tls = tls;
+        out.text = addr;
+        return true;
+    }
+    //[IPV6]:PORT，或者 HOST:PORT 按最后一个冒号分开
+    std::string host, port;
+    if( addr[0] == '[' ){
+        const char* close = strchr( addr, ']' );
+        if( !close || close[1] != ':' ){
+            return false;
+        }
+        host.assign( addr + 1, close - addr - 1 );
+        port = close + 2;
+    }else{
+        const char* colon = strrchr( addr, ':' );
+        if( !colon ){
+            return false;
+        }
+        host.assign( addr, colon - addr );
+        port = colon + 1;
+    }
+    char* end = 0;
+    long p = strtol( port.c_str(), &end, 10 );
+    if( port.empty() || *end ){
+        return false;
+    }
+    return listen_resolve( host.c_str(), p, tls, out );
+}
+
+//路径上已经有socket文件：能连上说明有别的进程在监听，连不上的是上次没有清理的
+static bool unlink_stale( const char* path ){
+    struct stat st;
+    if( lstat( path, &st ) < 0 ){
+        return errno == ENOENT;
+    }
+    if( !S_ISSOCK( st.st_mode ) ){
+        errno = EADDRINUSE;
+        return false;
+    }
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ){
+        return false;
+    }
+    sockaddr_un un;
+    memset( &un, 0, sizeof( un ) );
+    un.sun_family = AF_UNIX;
+    strcpy( un.sun_path, path );
+    bool alive = connect( fd, (sockaddr*)&un, sizeof( un ) ) == 0 || errno != ECONNREFUSED;
+    close( fd );
+    if( alive ){
+        errno = EADDRINUSE;
+        return false;
+    }
+    return unlink( path ) == 0;
+}
+
+int listen_open( const listen_addr& a, bool reuseport, int incoming_cpu ){
+    int family = a.addr.ss_family;
+    if( family == AF_UNIX && !unlink_stale( ( (const sockaddr_un*)&a.addr )->sun_path ) ){
+        return -1;
+    }
+    int listenfd = socket( family, SOCK_STREAM, 0 );
+    if( listenfd < 0 ){
+        return -1;
+    }
+
+    if( family != AF_UNIX ){
+        //设定close的时候的行为
+        //当onoff不为0 且linger为0, close将立即返回, TCP将丢弃发送缓冲区的残留数据, 同时发送一个复位报文段
+        struct linger tmp = {1, 0};
+        setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ));
+
+        //代理正常关闭的连接会留下TIME_WAIT，重启时仍然可以绑定同一个端口
+        int reuse = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ));
+        if( reuseport ){
+            int on = 1;
+            setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof( on ));
+        }
+        //内核在reuseport组中优先选择incoming cpu和处理该包的cpu相同的socket
+        //配合网卡RX队列中断亲和性，可以让连接在收包的那个cpu所属的reactor上处理
+        if( incoming_cpu >= 0 ){
+            if( setsockopt( listenfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof( incoming_cpu )) != 0 ){
+                printf( "SO_INCOMING_CPU not supported, errno is: %d\n", errno );
+            }
+        }
+    }
+    //IPv6通配地址同时接受IPv4连接，不受net.ipv6.bindv6only影响
+    if( family == AF_INET6 ){
+        int off = 0;
+        setsockopt( listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof( off ));
+    }
+
+    if( bind( listenfd, (const struct sockaddr* )&a.addr, a.len ) < 0
+            || listen( listenfd, 5) < 0 ){
+        int save_errno = errno;
+        close( listenfd );
+        errno = save_errno;
+        return -1;
+    }
+    return listenfd;
+}
+
+bool listen_matches( int fd, const listen_addr& a ){
+    sockaddr_storage bound;
+    socklen_t len = sizeof( bound );
+    if( getsockname( fd, (struct sockaddr*)&bound, &len ) < 0 || bound.ss_family != a.addr.ss_family ){
+        return false;
+    }
+    if( bound.ss_family == AF_INET ){
+        const sockaddr_in* x = (const sockaddr_in*)&bound;
+        const sockaddr_in* y = (const sockaddr_in*)&a.addr;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if( bound.ss_family == AF_INET6 ){
+        const sockaddr_in6* x = (const sockaddr_in6*)&bound;
+        const sockaddr_in6* y = (const sockaddr_in6*)&a.addr;
+        return x->sin6_port == y->sin6_port && memcmp( &x->sin6_addr, &y->sin6_addr, sizeof( in6_addr ) ) == 0;
+    }
+    if( bound.ss_family == AF_UNIX ){
+        return strcmp( ( (const sockaddr_un*)&bound )->sun_path, ( (const sockaddr_un*)&a.addr )->sun_path ) == 0;
+    }
+    return false;
+}
+
+void peer_text( const struct sockaddr* addr, char* buf, size_t len ){
+    buf[0] = '\0';
+    if( addr->sa_family == AF_INET ){
+        inet_ntop( AF_INET, &( (const sockaddr_in*)addr )->sin_addr, buf, len );
+    }else if( addr->sa_family == AF_INET6 ){
+        const in6_addr* a = &( (const sockaddr_in6*)addr )->sin6_addr;
+        //双栈socket上的IPv4客户端，上游看到的仍然是IPv4地址
+        if( IN6_IS_ADDR_V4MAPPED( a ) ){
+            inet_ntop( AF_INET, a->s6_addr + 12, buf, len );
+        }else{
+            inet_ntop( AF_INET6, a, buf, len );
+        }
+    }else if( addr->sa_family == AF_UNIX ){
+        snprintf( buf, len, "unix:" );
+    }
+}
+
+int peer_port( const struct sockaddr* addr ){
+    if( addr->sa_family == AF_INET ){
+        return ntohs( ( (const sockaddr_in*)addr )->sin_port );
+    }
+    if( addr->sa_family == AF_INET6 ){
+        return ntohs( ( (const sockaddr_in6*)addr )->sin6_port );
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <string>
+
+//一个监听地址：IPv4、IPv6（通配地址同时接受IPv4连接）或者unix socket
+//TCP地址每个reactor一个socket，由SO_REUSEPORT分发；unix socket不支持SO_REUSEPORT，
+//只创建一个，所有reactor和worker通过EPOLLEXCLUSIVE共享
+struct listen_addr{
+    sockaddr_storage addr;
+    socklen_t len;
+    //这个地址上的连接先做TLS握手
+    bool tls;
+    //配置中的写法，用于输出
+    std::string text;
+
+    bool local() const { return addr.ss_family == AF_UNIX; }
+};
+
+//解析 HOST:PORT、[IPV6]:PORT、*:PORT（IPv6双栈通配）或 unix:PATH，后面可以跟一个 tls
+bool listen_parse( const char* spec, listen_addr& out );
+//ip和port组成的地址，ip中有冒号时为IPv6
+bool listen_resolve( const char* ip, int port, bool tls, listen_addr& out );
+//创建监听socket；unix socket的路径上留有没人监听的旧socket时先删除
+int listen_open( const listen_addr& a, bool reuseport, int incoming_cpu );
+//fd绑定的是否就是这个地址，二进制升级时用来认领旧进程交过来的socket
+bool listen_matches( int fd, const listen_addr& a );
+
+//客户端地址的文本形式，IPv4映射的IPv6地址写成IPv4，unix socket上的客户端为"unix:"
+void peer_text( const struct sockaddr* addr, char* buf, size_t len );
+//客户端端口，unix socket上为0
+int peer_port( const struct sockaddr* addr );
+
+#endif
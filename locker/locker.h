@@ -4,6 +4,7 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 class sem{
 public:
@@ -43,11 +44,40 @@ public:
     bool unlock(){
         return pthread_mutex_unlock( &m_mutex) == 0;
     }
+    //给条件变量使用
+    pthread_mutex_t* get(){
+        return &m_mutex;
+    }
 
 private:
     pthread_mutex_t m_mutex;
 };
 
+//读写锁，读多写少的共享结构使用
+class rwlocker{
+public:
+    rwlocker(){
+        if( pthread_rwlock_init( &m_rwlock, NULL) != 0){
+            throw std::exception();
+        }
+    }
+    ~rwlocker(){
+        pthread_rwlock_destroy( &m_rwlock);
+    }
+    bool rdlock(){
+        return pthread_rwlock_rdlock( &m_rwlock) == 0;
+    }
+    bool wrlock(){
+        return pthread_rwlock_wrlock( &m_rwlock) == 0;
+    }
+    bool unlock(){
+        return pthread_rwlock_unlock( &m_rwlock) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+};
+
 class cond{
 public:
     cond(){
@@ -69,9 +99,20 @@ public:
         pthread_mutex_unlock( &m_mutex);
         return ret == 0;
     }
+    //使用外部互斥锁，调用前必须已经加锁
+    bool wait( pthread_mutex_t* mutex ){
+        return pthread_cond_wait( &m_cond, mutex) == 0;
+    }
+    //超时返回false，t是CLOCK_REALTIME的绝对时间
+    bool timewait( pthread_mutex_t* mutex, const struct timespec& t ){
+        return pthread_cond_timedwait( &m_cond, mutex, &t) == 0;
+    }
     bool signal(){
         return pthread_cond_signal( &m_cond) == 0;
     }
+    bool broadcast(){
+        return pthread_cond_broadcast( &m_cond) == 0;
+    }
 private:
     pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
@@ -9,16 +9,53 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <vector>
+#include <new>
 
 #include "./locker/locker.h"
 #include "./threadpool/threadpool.h"
 #include "./http/http_conn.h"
+#include "./config/config.h"
+#include "./affinity/affinity.h"
+#include "./master/master.h"
+#include "./stats/stats.h"
+#include "./auth/user_store.h"
+#include "./upstream/upstream.h"
+#include "./upstream/proxy.h"
+#include "./tls/tls.h"
+#include "./websocket/ws_hub.h"
+#include "./limit/rate_limiter.h"
+#include "./upload/upload.h"
+#include "./coro/coro.h"
+#include "./listen/listener.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
 
 extern int addfd( int epollfd, int fd, bool one_shot );
 extern int removefd( int epollfd, int fd );
+extern void modfd( int epollfd, int fd, int ev );
+
+//信号通过管道通知所有reactor，每个reactor的epoll都监听读端
+static int sig_pipefd[2];
+//SIGTERM/SIGINT立即退出，SIGQUIT不再accept，处理完已有连接后退出
+static volatile sig_atomic_t stop_server = 0;
+static volatile sig_atomic_t drain_server = 0;
+
+static void sig_handler( int sig ){
+    int save_errno = errno;
+    if( sig == SIGQUIT ){
+        drain_server = 1;
+    }else{
+        stop_server = 1;
+    }
+    char msg = sig;
+    send( sig_pipefd[1], &msg, 1, 0 );
+    errno = save_errno;
+}
 
 //添加信号和回调函数,先把每个信号都屏蔽。
 void addsig( int sig, void( handler )(int), bool restart = true){
@@ -39,63 +76,220 @@ void show_error( int connfd, const char* info ){
     close( connfd );
 }
 
-int main( int argc, char* argv[] ){
-    if( argc <= 2 ){
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
-        return true;
-    }
-    const char* ip = argv[1];//获取ip地址
-    int port = atoi( argv[2]);//端口转换成数字
+//reactor监听的一个socket
+struct reactor_listener{
+    int fd;
+    //这个socket上的连接先做TLS握手
+    bool tls;
+    //多进程模式下的监听socket和unix socket由多个epoll共享
+    bool shared;
+};
 
-    //忽略SIGPIPE信号
-    addsig( SIGPIPE, SIG_IGN );
+//每个reactor拥有自己的监听socket、epoll、连接数组和线程池
+//reactor和它的工作线程绑定在同一组cpu上，连接数组从本节点分配
+struct reactor{
+    int id;
+    std::vector< reactor_listener > listeners;
+    const server_config* cfg;
+    cpu_placement place;
+    pthread_t thread;
+};
 
-    //创建线程池
-    threadpool< http_conn >* pool = NULL;
-    try{
-        pool = new threadpool< http_conn >;
-    }catch( ... ){
-        return 1;
+//配置中的一个监听地址和它的socket：TCP地址每个reactor一个，unix socket只有一个
+struct listen_slot{
+    listen_addr addr;
+    std::vector< int > fds;
+};
+//在main中创建，fork出来的worker直接使用
+static std::vector< listen_slot > g_slots;
+
+//监听socket加入epoll
+//多个worker进程共享同一个监听socket时使用EPOLLEXCLUSIVE，一个连接只唤醒一个进程
+static void add_listener( int epollfd, int listenfd, bool shared ){
+    if( !shared ){
+        addfd( epollfd, listenfd, false );
+        return;
     }
+    epoll_event event;
+    event.data.fd = listenfd;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, listenfd, &event );
+    fcntl( listenfd, F_SETFL, fcntl( listenfd, F_GETFL ) | O_NONBLOCK );
+}
 
-    //预先分配http_conn对象给每个用户
-    http_conn* users = new http_conn[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
+//fd是这个reactor的哪个监听socket，不是时返回NULL
+static const reactor_listener* find_listener( const reactor* r, int fd ){
+    for( size_t i = 0; i < r->listeners.size(); ++i ){
+        if( r->listeners[i].fd == fd ){
+            return &r->listeners[i];
+        }
+    }
+    return NULL;
+}
 
-    //创建监听socket
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0);
-    assert( listenfd >= 0 );
+//边沿触发或多个进程共享时都要一直accept到EAGAIN
+//loop不为空时明文连接由协程处理
+//built记录users中哪些fd上的对象已经构造，第一次accept到这个fd时才构造
+static void accept_all( int listenfd, int epollfd, http_conn* users, std::vector< bool >& built,
+        upstream_pool* upstreams, bool tls, coro_loop* loop ){
+    while( true ){
+        //用来接收客户端socket的addr，IPv4、IPv6或者unix socket
+        struct sockaddr_storage client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        //接收连接socket并填充addr
+        int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+        if ( connfd < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK ){
+                printf( "errno is: %d\n", errno );
+            }
+            break;
+        }
+        if( http_conn::m_user_count >= MAX_FD )
+        {
+            show_error( connfd, "Internal server busy" );
+            continue;
+        }
+        //同一个客户端的连接太多，不占用连接数组的槽位；TLS端口上还没有握手，只能直接关闭
+        //unix socket上的客户端都在本机，不限流
+        rate_limiter* limiter = http_conn::m_limiter;
+        if( limiter && client_address.ss_family != AF_UNIX && !limiter->connect( limiter->key_of( ( struct sockaddr* )&client_address ) ) ){
+            static const char response[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            if( !tls ){
+                send( connfd, response, sizeof( response ) - 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+            }
+            close( connfd );
+            stats_add( g_stats->rate_limited, 1 );
+            continue;
+        }
+        stats_add( g_stats->accepted, 1 );
+        //放入数组中并根据socket/addr初始化，第一次用到这个fd时才构造
+        if( !built[ connfd ] ){
+            new ( &users[ connfd ] ) http_conn();
+            built[ connfd ] = true;
+        }
+        users[connfd].init( connfd, client_address, epollfd, upstreams, tls );
+        //TLS握手仍然由线程池完成
+        if( loop && !tls ){
+            users[connfd].serve( loop );
+        }
+        //这里不用将连接加入epoll，后面也不用在主函数中处理
+        //因为加入users数组后根据来到的信息分配给线程池
+        //实现半反应堆效果，线程之间竞争任务队列
+    }
+}
 
-    //设定close的时候的行为
-    //当onoff不为0 且linger为0, close将立即返回, TCP将丢弃发送缓冲区的残留数据, 同时发送一个复位报文段
-    struct linger tmp = {1, 0};
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ));
+static long long now_ms(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;//address family
-    inet_pton( AF_INET, ip, &address.sin_addr );//ip转为网络字节序
-    address.sin_port = htons( port );//将port转换为网络字节序
+//第一个cpu，没有cpu时返回-1
+static int first_cpu( const cpu_set_t& set ){
+    for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ){
+        if( CPU_ISSET( cpu, &set ) ){
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static void* reactor_loop( void* arg ){
+    reactor* r = ( reactor* )arg;
+    const server_config& cfg = *r->cfg;
+    if( cfg.pin && !pin_thread( pthread_self(), r->place.cpus ) ){
+        printf( "reactor %d: cannot pin thread\n", r->id );
+    }
 
-    //sockaddr和sockaddr_in大小是一样的，都是16字节
-    ret = bind( listenfd, (struct sockaddr* )&address, sizeof( address ));
-    assert( ret >= 0 );
+    //创建线程池，工作线程和reactor使用同一组cpu
+    threadpool< http_conn >* pool = NULL;
+    try{
+        pool = new threadpool< http_conn >( cfg.threads, cfg.max_requests, cfg.pin ? &r->place.cpus : NULL );
+        if( cfg.max_threads > cfg.threads ){
+            pool->set_autoscale( cfg.max_threads, cfg.grow_wait_us, cfg.idle_ms );
+        }
+    }catch( ... ){
+        printf( "reactor %d: cannot create threadpool\n", r->id );
+        return NULL;
+    }
 
-    ret = listen( listenfd, 5);
-    assert( ret >= 0);
+    //按fd下标的http_conn数组，由mmap得到，物理页在第一次使用时才分配，所以先设置内存策略
+    //http_conn的构造函数会写整个对象，只在第一次accept到某个fd时原地构造，空闲的槽位不占内存
+    size_t users_len = sizeof( http_conn ) * MAX_FD;
+    void* users_mem = mmap( NULL, users_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    assert( users_mem != MAP_FAILED );
+    if( cfg.numa && r->place.node >= 0 && !prefer_node_memory( users_mem, users_len, r->place.node ) ){
+        printf( "reactor %d: cannot bind memory to node %d\n", r->id, r->place.node );
+    }
+    http_conn* users = (http_conn*)users_mem;
+    std::vector< bool > built( MAX_FD, false );
 
     epoll_event events[ MAX_EVENT_NUMBER ];
 
     int epollfd = epoll_create( 5 );
     assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false);
-    //所有连接共用的static成员
-    http_conn::m_epollfd = epollfd;
+    for( size_t i = 0; i < r->listeners.size(); ++i ){
+        add_listener( epollfd, r->listeners[i].fd, r->listeners[i].shared );
+    }
+    //边沿触发，每个epoll都会收到一次通知，读端不需要读出数据
+    addfd( epollfd, sig_pipefd[0], false);
+    //到上游的长连接和客户连接在同一个epoll中
+    upstream_pool upstreams( epollfd );
+    std::vector< proxy_session* > timed_out;
+    //协程模式下明文连接的协程挂起在这里，由这个reactor恢复
+    coro_loop loop( epollfd );
+    coro_loop* coro = cfg.coro ? &loop : NULL;
+    //这一轮中可以继续发送响应的连接，读事件和新请求处理完后再发送
+    std::vector< int > writable;
+    const off_t budget = (off_t)cfg.reactor_budget_kb << 10;
 
-    while(true){
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1);
+    bool draining = false;
+    long long drain_deadline = 0;
+    long long next_status = 0;
+    while( !stop_server ){
+        //平滑退出：不再accept，新的连接由其他worker处理，已有连接处理完再退出
+        if( drain_server && !draining ){
+            draining = true;
+            drain_deadline = now_ms() + cfg.drain_ms;
+            http_conn::m_draining = true;
+            for( size_t i = 0; i < r->listeners.size(); ++i ){
+                epoll_ctl( epollfd, EPOLL_CTL_DEL, r->listeners[i].fd, 0 );
+            }
+            //WebSocket连接不会自己结束，发出close(1001)后等对方关闭
+            if( r->id == 0 ){
+                http_conn::m_hub->shutdown();
+            }
+        }
+        if( draining && ( http_conn::m_user_count == 0 || now_ms() >= drain_deadline ) ){
+            break;
+        }
+
+        //有代理请求时至少每秒醒来一次检查超时
+        int timeout = draining ? 100 : -1;
+        if( upstreams.active() > 0 && timeout < 0 ){
+            timeout = 1000;
+        }
+        //有人订阅服务器状态时由第0个reactor每秒发布一次
+        if( r->id == 0 && http_conn::m_hub->subscribers( ws_hub::STATUS_CHANNEL ) > 0 ){
+            long long now = now_ms();
+            if( now >= next_status ){
+                char body[ 512 ];
+                int len = http_conn::status_body( body, sizeof( body ) );
+                http_conn::m_hub->publish( ws_hub::STATUS_CHANNEL, WS_TEXT, body, len );
+                next_status = now + 1000;
+            }
+            if( timeout < 0 || next_status - now < timeout ){
+                timeout = next_status - now;
+            }
+        }
+        //协程的超时和sleep
+        int coro_timeout = loop.next_timeout();
+        if( coro_timeout >= 0 && ( timeout < 0 || coro_timeout < timeout ) ){
+            timeout = coro_timeout;
+        }
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, timeout );
         if( ( number < 0 ) && ( errno != EINTR ) ){
             printf( "epoll failure ");
             break;
@@ -103,49 +297,386 @@ int main( int argc, char* argv[] ){
 
         for( int i = 0; i < number; ++i){
             int sockfd = events[i].data.fd;
-            if( sockfd == listenfd){
-                //用来接收客户端socket的addr
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                //接收连接socket并填充addr
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
-                {
-                    printf( "errno is: %d\n", errno );
-                    continue;
+            const reactor_listener* listener;
+            if( sockfd == sig_pipefd[0] ){
+                //信号已经记录在标志中，回到循环开头处理
+                continue;
+            }else if( ( listener = find_listener( r, sockfd ) ) ){
+                accept_all( sockfd, epollfd, users, built, &upstreams, listener->tls, coro );
+            }else if( upstreams.owns( sockfd ) ){
+                //上游连接上的事件交给使用它的客户连接，空闲连接上的旧事件忽略
+                proxy_session* s = upstreams.session( sockfd );
+                if( s ){
+                    http_conn& conn = users[ s->client_fd() ];
+                    if( !conn.proxy_io( sockfd, events[i].events ) ){
+                        conn.close_conn();
+                    }
                 }
-                if( http_conn::m_user_count >= MAX_FD )
-                {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
+            }else if( loop.waiting( sockfd ) ){
+                //协程在等这个连接上的事件，只能写的和其他连接的发送一起放到后面
+                if( events[i].events == EPOLLOUT ){
+                    writable.push_back( sockfd );
+                }else{
+                    loop.resume( sockfd, events[i].events );
                 }
-                //放入数组中并根据socket/addr初始化
-                users[connfd].init( connfd, client_address );
-                //这里不用将连接加入epoll，后面也不用在主函数中处理
-                //因为加入users数组后根据来到的信息分配给线程池
-                //实现半反应堆效果，线程之间竞争任务队列
             }else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR )){
                 //对方挂断/socket挂断/错误都会导致关闭连接
                 users[sockfd].close_conn();
-            }else if( events[i].events & EPOLLIN ){
+            }else if( users[sockfd].proxying() ){
+                //转发中的请求在reactor线程中直接读写，不进入线程池
+                if( !users[sockfd].proxy_io( sockfd, events[i].events ) ){
+                    users[sockfd].close_conn();
+                }
+            }else if( users[sockfd].websocket() ){
+                if( !users[sockfd].ws_io( events[i].events ) ){
+                    users[sockfd].close_conn();
+                }
+            }else if( ( events[i].events & EPOLLIN ) || users[sockfd].read_pending() ){
                 if( users[sockfd].read()){
-                    //如果读取数据成功，就将此http连接加入pool
-                    pool -> append( users + sockfd );
+                    //如果读取数据成功，就将此http连接加入pool，上传的消息体排在短任务后面
+                    bool bulk = users[sockfd].bulk();
+                    if( pool -> append( users + sockfd, bulk ) && bulk ){
+                        stats_add( g_stats->bulk_tasks, 1 );
+                    }
                 }else{
                     users[sockfd].close_conn();
                 }
             }else if( events[i].events & EPOLLOUT){
-                if( !users[sockfd].write() ){
-                    users[sockfd].close_conn();
-                }
+                writable.push_back( sockfd );
             }else{
 
             }
         }
+
+        //大块的响应最后发送，每个连接一次最多发送一个配额
+        //这一轮写出的字节超过预算后，剩下的连接重新注册EPOLLOUT，下一轮先处理新到的请求
+        off_t written = 0;
+        for( size_t i = 0; i < writable.size(); ++i ){
+            int sockfd = writable[i];
+            if( budget > 0 && written >= budget ){
+                modfd( epollfd, sockfd, EPOLLOUT );
+                stats_add( g_stats->write_deferred, 1 );
+                continue;
+            }
+            if( loop.waiting( sockfd ) ){
+                loop.resume( sockfd, EPOLLOUT );
+            }else if( !users[sockfd].write() ){
+                users[sockfd].close_conn();
+            }
+            written += users[sockfd].last_sent();
+        }
+        writable.clear();
+        loop.run_timers();
+
+        timed_out.clear();
+        upstreams.expire( now_ms(), timed_out );
+        for( size_t i = 0; i < timed_out.size(); ++i ){
+            http_conn& conn = users[ timed_out[i]->client_fd() ];
+            if( !conn.proxy_timeout() ){
+                conn.close_conn();
+            }
+        }
     }
-    close( epollfd );
-    close( listenfd );
-    delete [] users;
+    //先等工作线程全部退出，再释放它们可能还在访问的连接
     delete pool;
+    close( epollfd );
+    for( int i = 0; i < MAX_FD; ++i ){
+        if( built[i] ){
+            users[i].~http_conn();
+        }
+    }
+    munmap( users_mem, users_len );
+    return NULL;
+}
+
+//默认路由表，再加上配置中的规则
+static bool build_router( router& r, const server_config& cfg ){
+    int pages = router::method_mask( "GET,POST,HEAD" );
+    r.add( "/*", pages, ROUTE_STATIC, 0 );
+    //欢迎界面和它上面的注册、登录按钮
+    r.add( "/", pages, ROUTE_ALIAS, "/judge.html" );
+    r.add( "/0*", pages, ROUTE_ALIAS, "/register.html" );
+    r.add( "/1*", pages, ROUTE_ALIAS, "/log.html" );
+    //登录和注册表单提交
+    r.add( "/2*", router::method_mask( "POST" ), ROUTE_CGI, "login", 2 );
+    r.add( "/3*", router::method_mask( "POST" ), ROUTE_CGI, "register", 3 );
+    r.add( "/status", router::method_mask( "GET" ), ROUTE_INTERNAL, "status" );
+    //WebSocket频道，/ws/status每秒推送服务器状态
+    r.add( "/ws/*", router::method_mask( "GET" ), ROUTE_WEBSOCKET, 0 );
+    for( size_t i = 0; i < cfg.routes.size(); ++i ){
+        if( !r.add_rule( cfg.routes[i].c_str() ) ){
+            printf( "bad route: %s\n", cfg.routes[i].c_str() );
+            return false;
+        }
+        //proxy路由的上游必须已经定义
+        char type[ 16 ], target[ 512 ];
+        if( sscanf( cfg.routes[i].c_str(), "%*s %*s %15s %511s", type, target ) == 2
+                && strcasecmp( type, "proxy" ) == 0 && !upstream_find( target ) ){
+            printf( "route %s: unknown upstream %s\n", cfg.routes[i].c_str(), target );
+            return false;
+        }
+    }
+    return true;
+}
+
+//worker进程（单进程模式下就是主进程）：启动所有reactor，直到收到退出信号
+//监听socket都在g_slots中，reactor按g_slots分配
+static int run_worker( const server_config& cfg ){
+    if( !g_stats ){
+        g_stats_segment = stats_create( 1 );
+        assert( g_stats_segment );
+        g_stats = &g_stats_segment->worker[0];
+        stats_reset( g_stats, getpid(), 1 );
+    }
+
+    //用户存储在worker中打开，每个进程有自己的文件描述符，flock才能在进程之间互斥
+    user_store users;
+    if( !cfg.user_db.empty() ){
+        if( !users.open( cfg.user_db.c_str(), cfg.user_db_sync ) ){
+            return 1;
+        }
+        http_conn::m_users = &users;
+    }
+    ws_hub hub;
+    http_conn::m_hub = &hub;
+    http_conn::m_write_quantum = (size_t)cfg.write_quantum_kb << 10;
+    http_conn::m_idle_ms = cfg.coro_idle_ms;
+
+    //SIGTERM/SIGINT时正常退出，释放线程池；SIGQUIT时平滑退出
+    int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, sig_pipefd );
+    assert( ret != -1 );
+    fcntl( sig_pipefd[1], F_SETFL, fcntl( sig_pipefd[1], F_GETFL ) | O_NONBLOCK );
+    addsig( SIGTERM, sig_handler, false );
+    addsig( SIGINT, sig_handler, false );
+    addsig( SIGQUIT, sig_handler, false );
+
+    //规划每个reactor使用的cpu，reactor数量由TCP地址的监听socket数决定
+    size_t count = 0;
+    for( size_t i = 0; i < g_slots.size() && count == 0; ++i ){
+        if( !g_slots[i].addr.local() ){
+            count = g_slots[i].fds.size();
+        }
+    }
+    cpu_set_t allowed;
+    if( cfg.cpus.empty() || !parse_cpu_list( cfg.cpus.c_str(), &allowed ) ){
+        online_cpus( &allowed );
+    }
+    std::vector< cpu_placement > plan = plan_placement( allowed, cfg.reactors );
+    if( count > 0 && plan.size() != count ){
+        plan = plan_placement( allowed, count );
+    }
+
+    //TCP地址的第i个socket给第i个reactor，unix socket所有reactor都监听
+    std::vector< reactor > reactors( plan.size() );
+    for( size_t i = 0; i < plan.size(); ++i ){
+        reactors[i].id = i;
+        reactors[i].cfg = &cfg;
+        for( size_t j = 0; j < g_slots.size(); ++j ){
+            const listen_slot& slot = g_slots[j];
+            reactor_listener l;
+            l.fd = slot.addr.local() ? slot.fds[0] : slot.fds[i];
+            l.tls = slot.addr.tls;
+            l.shared = cfg.workers > 0 || ( slot.addr.local() && plan.size() > 1 );
+            reactors[i].listeners.push_back( l );
+        }
+        reactors[i].place = plan[i];
+        printf( "reactor %d: node %d, %d cpus\n", (int)i, plan[i].node, CPU_COUNT( &plan[i].cpus ) );
+    }
+
+    //第0个reactor在主线程中运行
+    for( size_t i = 1; i < reactors.size(); ++i ){
+        if( pthread_create( &reactors[i].thread, NULL, reactor_loop, &reactors[i] ) != 0 ){
+            printf( "cannot start reactor %d\n", (int)i );
+            return 1;
+        }
+    }
+    reactor_loop( &reactors[0] );
+
+    //第0个reactor退出后让其他reactor也退出
+    if( !stop_server && !drain_server ){
+        stop_server = 1;
+        send( sig_pipefd[1], "", 1, 0 );
+    }
+    for( size_t i = 1; i < reactors.size(); ++i ){
+        pthread_join( reactors[i].thread, NULL );
+    }
+    http_conn::m_users = 0;
+    http_conn::m_hub = 0;
     return 0;
-}
\ No newline at end of file
+}
+
+int main( int argc, char* argv[] ){
+    server_config cfg;
+    if( !config_parse_args( cfg, argc, argv ) ){
+        return 1;
+    }
+    //多进程时按行刷新，避免fork时缓冲区中的内容被输出两次
+    if( cfg.workers > 0 ){
+        setvbuf( stdout, NULL, _IOLBF, 0 );
+    }
+
+    //忽略SIGPIPE信号
+    addsig( SIGPIPE, SIG_IGN );
+
+    //上游服务在fork之前建立，路由中的proxy规则要用到
+    for( size_t i = 0; i < cfg.upstreams.size(); ++i ){
+        if( !upstream_add_group( cfg.upstreams[i].c_str() ) ){
+            printf( "bad upstream: %s\n", cfg.upstreams[i].c_str() );
+            return 1;
+        }
+    }
+
+    router routes;
+    if( !build_router( routes, cfg ) ){
+        return 1;
+    }
+    http_conn::m_router = &routes;
+
+    //打包文件在fork之前映射，所有worker共享
+    asset_bundle bundle;
+    if( !cfg.bundle.empty() ){
+        if( !bundle.open( cfg.bundle.c_str() ) ){
+            return 1;
+        }
+        http_conn::m_bundle = &bundle;
+    }
+
+    //规划每个reactor使用的cpu
+    cpu_set_t allowed;
+    if( cfg.cpus.empty() ){
+        online_cpus( &allowed );
+    }else if( !parse_cpu_list( cfg.cpus.c_str(), &allowed ) ){
+        printf( "bad cpu list: %s\n", cfg.cpus.c_str() );
+        return 1;
+    }
+    std::vector< cpu_placement > plan = plan_placement( allowed, cfg.reactors );
+    if( plan.empty() ){
+        printf( "no cpu available\n" );
+        return 1;
+    }
+
+    //监听地址：ip:port、ip:tls_port，再加上listen中的地址
+    if( cfg.port > 0 ){
+        g_slots.push_back( listen_slot() );
+        if( !listen_resolve( cfg.ip.c_str(), cfg.port, false, g_slots.back().addr ) ){
+            printf( "bad listen address: %s\n", cfg.ip.c_str() );
+            return 1;
+        }
+    }
+    if( cfg.tls_port > 0 ){
+        if( cfg.tls_port == cfg.port ){
+            printf( "tls_port needs its own port\n" );
+            return 1;
+        }
+        g_slots.push_back( listen_slot() );
+        if( !listen_resolve( cfg.ip.c_str(), cfg.tls_port, true, g_slots.back().addr ) ){
+            printf( "bad listen address: %s\n", cfg.ip.c_str() );
+            return 1;
+        }
+    }
+    bool need_tls = cfg.tls_port > 0;
+    for( size_t i = 0; i < cfg.listens.size(); ++i ){
+        listen_slot slot;
+        if( !listen_parse( cfg.listens[i].c_str(), slot.addr ) ){
+            printf( "bad listen address: %s\n", cfg.listens[i].c_str() );
+            return 1;
+        }
+        //SO_REUSEPORT下同一个地址绑定两次不会报错，连接会被分到两组socket上
+        for( size_t j = 0; j < g_slots.size(); ++j ){
+            if( g_slots[j].addr.len == slot.addr.len && memcmp( &g_slots[j].addr.addr, &slot.addr.addr, slot.addr.len ) == 0 ){
+                printf( "duplicate listen address: %s\n", slot.addr.text.c_str() );
+                return 1;
+            }
+        }
+        need_tls = need_tls || slot.addr.tls;
+        g_slots.push_back( slot );
+    }
+    if( g_slots.empty() ){
+        printf( "nothing to listen on\n" );
+        return 1;
+    }
+
+    //TLS上下文在fork之前创建，所有worker共享session ticket密钥和会话缓存
+    tls_context tls;
+    if( need_tls ){
+        if( cfg.tls_cert.empty() || cfg.tls_key.empty() ){
+            printf( "TLS listeners need tls_cert and tls_key\n" );
+            return 1;
+        }
+        if( !tls.init( cfg ) ){
+            return 1;
+        }
+        http_conn::m_tls = &tls;
+    }
+
+    //限流表在fork之前创建，同一个客户端的连接落在哪个worker都计入同一个令牌桶
+    rate_limiter limiter;
+    if( !limiter.init( cfg ) ){
+        return 1;
+    }
+    if( limiter.enabled() ){
+        http_conn::m_limiter = &limiter;
+    }
+
+    //上传的总量限制由所有worker共享
+    if( !upload_session::init( cfg ) ){
+        return 1;
+    }
+
+    //创建监听socket，TCP地址每个reactor一个，多个reactor时使用SO_REUSEPORT；unix socket只创建一个
+    //二进制升级启动的进程直接使用旧master交过来的socket，按绑定的地址认领
+    std::vector< int > inherited;
+    if( cfg.workers > 0 && master_inherit_listeners( inherited ) ){
+        printf( "inherited %d listening sockets\n", (int)inherited.size() );
+        for( size_t i = 0; i < inherited.size(); ++i ){
+            listen_slot* slot = NULL;
+            for( size_t j = 0; j < g_slots.size() && !slot; ++j ){
+                if( listen_matches( inherited[i], g_slots[j].addr ) ){
+                    slot = &g_slots[j];
+                }
+            }
+            if( slot && !( slot->addr.local() && !slot->fds.empty() ) ){
+                slot->fds.push_back( inherited[i] );
+            }else{
+                close( inherited[i] );
+            }
+        }
+        //reactor数量沿用旧进程的
+        for( size_t j = 0; j < g_slots.size(); ++j ){
+            if( !g_slots[j].addr.local() && !g_slots[j].fds.empty() ){
+                plan = plan_placement( allowed, g_slots[j].fds.size() );
+                break;
+            }
+        }
+    }
+    std::vector< int > listenfds;
+    for( size_t j = 0; j < g_slots.size(); ++j ){
+        listen_slot& slot = g_slots[j];
+        size_t want = slot.addr.local() ? 1 : plan.size();
+        while( slot.fds.size() > want ){
+            close( slot.fds.back() );
+            slot.fds.pop_back();
+        }
+        for( size_t i = slot.fds.size(); i < want; ++i ){
+            int incoming_cpu = cfg.incoming_cpu && !slot.addr.local() ? first_cpu( plan[i].cpus ) : -1;
+            int listenfd = listen_open( slot.addr, plan.size() > 1, incoming_cpu );
+            if( listenfd < 0 ){
+                printf( "cannot listen on %s, errno is: %d\n", slot.addr.text.c_str(), errno );
+                return 1;
+            }
+            slot.fds.push_back( listenfd );
+        }
+        listenfds.insert( listenfds.end(), slot.fds.begin(), slot.fds.end() );
+    }
+
+    int ret = 0;
+    if( cfg.workers > 0 ){
+        ret = master_run( argc, argv, cfg, listenfds, run_worker );
+    }else{
+        ret = run_worker( cfg );
+    }
+    for( size_t i = 0; i < listenfds.size(); ++i ){
+        close( listenfds[i] );
+    }
+    return ret;
+}
@@ -0,0 +1,453 @@
+#include "master.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string>
+#include <algorithm>
+
+#include "../stats/stats.h"
+
+//环境变量：监听socket列表和旧master的pid
+static const char* ENV_LISTEN_FDS = "HTTPWS_LISTEN_FDS";
+static const char* ENV_UPGRADE_FROM = "HTTPWS_UPGRADE_FROM";
+
+static volatile sig_atomic_t sig_child = 0;
+static volatile sig_atomic_t sig_reload = 0;
+static volatile sig_atomic_t sig_upgrade = 0;
+static volatile sig_atomic_t sig_dump = 0;
+static volatile sig_atomic_t sig_quit = 0;
+static volatile sig_atomic_t sig_terminate = 0;
+static volatile sig_atomic_t sig_alarm = 0;
+
+static void master_sig_handler( int sig ){
+    switch( sig ){
+        case SIGCHLD: sig_child = 1; break;
+        case SIGHUP: sig_reload = 1; break;
+        case SIGUSR2: sig_upgrade = 1; break;
+        case SIGUSR1: sig_dump = 1; break;
+        case SIGQUIT: sig_quit = 1; break;
+        case SIGALRM: sig_alarm = 1; break;
+        default: sig_terminate = 1; break;
+    }
+}
+
+static const int master_signals[] = { SIGCHLD, SIGHUP, SIGUSR2, SIGUSR1, SIGQUIT, SIGALRM, SIGTERM, SIGINT };
+static const int master_signals_count = sizeof( master_signals ) / sizeof( master_signals[0] );
+
+//worker槽位，和共享内存中的统计槽位一一对应
+struct worker_slot{
+    pid_t pid;
+    int generation;
+    //已经通知退出，退出后不再拉起
+    bool retiring;
+    //启动时间，用来判断worker是不是刚启动就退出了
+    time_t started;
+};
+
+//运行不到这么久就退出的worker延迟拉起，延迟从1秒开始加倍，最多RESPAWN_MAX_DELAY秒
+static const int RESPAWN_MIN_UPTIME = 5;
+static const int RESPAWN_MAX_DELAY = 32;
+
+struct master_state{
+    int argc;
+    char** argv;
+    server_config* cfg;
+    const std::vector< int >* listenfds;
+    worker_main_fn worker_main;
+    std::vector< worker_slot > slots;
+    stats_segment* seg;
+    sigset_t old_mask;
+    int generation;
+    pid_t upgrade_pid;
+    std::string exe_path;
+    //等待拉起的worker数量和当前的延迟秒数
+    int pending_respawns;
+    int respawn_delay;
+};
+
+//在空闲槽位上fork一个worker
+static bool spawn_worker( master_state& m ){
+    int slot = -1;
+    for( size_t i = 0; i < m.slots.size(); ++i ){
+        if( m.slots[i].pid == 0 ){
+            slot = i;
+            break;
+        }
+    }
+    if( slot < 0 ){
+        printf( "master: no free worker slot\n" );
+        return false;
+    }
+
+    pid_t pid = fork();
+    if( pid < 0 ){
+        printf( "master: fork failed, errno is: %d\n", errno );
+        return false;
+    }
+    if( pid == 0 ){
+        //子进程恢复默认的信号处理和信号掩码，再由worker_main安装自己的处理函数
+        for( int i = 0; i < master_signals_count; ++i ){
+            signal( master_signals[i], SIG_DFL );
+        }
+        signal( SIGHUP, SIG_IGN );
+        signal( SIGUSR1, SIG_IGN );
+        signal( SIGUSR2, SIG_IGN );
+        sigprocmask( SIG_SETMASK, &m.old_mask, NULL );
+        g_stats = &m.seg->worker[ slot ];
+        stats_reset( g_stats, getpid(), m.generation );
+        _exit( m.worker_main( *m.cfg ) );
+    }
+    m.slots[ slot ].pid = pid;
+    m.slots[ slot ].generation = m.generation;
+    m.slots[ slot ].retiring = false;
+    m.slots[ slot ].started = time( NULL );
+    printf( "master: worker %d pid %d generation %d\n", slot, (int)pid, m.generation );
+    return true;
+}
+
+static int live_workers( const master_state& m ){
+    int n = 0;
+    for( size_t i = 0; i < m.slots.size(); ++i ){
+        if( m.slots[i].pid != 0 ){
+            ++n;
+        }
+    }
+    return n;
+}
+
+//向某一代（generation<0时为全部）worker发送信号
+static void signal_workers( master_state& m, int generation, int sig ){
+    for( size_t i = 0; i < m.slots.size(); ++i ){
+        worker_slot& s = m.slots[i];
+        if( s.pid != 0 && ( generation < 0 || s.generation == generation ) ){
+            s.retiring = true;
+            kill( s.pid, sig );
+        }
+    }
+}
+
+//worker刚启动就退出时，很可能马上又会退出，延迟拉起避免不停地fork
+static void schedule_respawn( master_state& m, bool quick_exit ){
+    if( !quick_exit ){
+        m.respawn_delay = 0;
+        m.seg->respawns.fetch_add( 1 );
+        spawn_worker( m );
+        return;
+    }
+    m.respawn_delay = m.respawn_delay == 0 ? 1 : std::min( m.respawn_delay * 2, RESPAWN_MAX_DELAY );
+    if( m.pending_respawns++ == 0 ){
+        alarm( m.respawn_delay );
+    }
+    printf( "master: worker exited right after start, respawn in %d seconds\n", m.respawn_delay );
+}
+
+//回收退出的子进程，意外退出的worker重新拉起
+static void reap_children( master_state& m, bool respawn ){
+    int status;
+    pid_t pid;
+    while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ){
+        if( pid == m.upgrade_pid ){
+            printf( "master: new binary %d exited, upgrade failed\n", (int)pid );
+            m.upgrade_pid = 0;
+            continue;
+        }
+        for( size_t i = 0; i < m.slots.size(); ++i ){
+            worker_slot& s = m.slots[i];
+            if( s.pid != pid ){
+                continue;
+            }
+            bool crashed = WIFSIGNALED( status ) || ( WIFEXITED( status ) && WEXITSTATUS( status ) != 0 );
+            printf( "master: worker %d pid %d exited%s\n", (int)i, (int)pid, crashed ? " abnormally" : "" );
+            s.pid = 0;
+            m.seg->worker[i].pid.store( 0 );
+            if( !respawn || s.retiring || s.generation != m.generation ){
+                break;
+            }
+            //退出码1是worker启动时出错（比如reactor线程创建失败），再拉起也是一样的结果
+            if( WIFEXITED( status ) && WEXITSTATUS( status ) == 1 ){
+                printf( "master: worker %d failed to start, not respawned\n", (int)i );
+                break;
+            }
+            schedule_respawn( m, time( NULL ) - s.started < RESPAWN_MIN_UPTIME );
+            break;
+        }
+    }
+}
+
+//SIGHUP：重新读取配置，启动新一代worker，通知旧的一代处理完连接后退出
+static void reload( master_state& m ){
+    server_config fresh;
+    optind = 0;
+    if( !config_parse_args( fresh, m.argc, m.argv ) ){
+        printf( "master: reload failed, keep the old configuration\n" );
+        return;
+    }
+    if( fresh.ip != m.cfg->ip || fresh.port != m.cfg->port || fresh.listens != m.cfg->listens ){
+        printf( "master: listen address change needs a binary upgrade, ignored\n" );
+        fresh.ip = m.cfg->ip;
+        fresh.port = m.cfg->port;
+        fresh.listens = m.cfg->listens;
+    }
+    //证书在fork之前加载，worker继承的是同一个TLS上下文
+    if( fresh.tls_port != m.cfg->tls_port || fresh.tls_cert != m.cfg->tls_cert || fresh.tls_key != m.cfg->tls_key
+            || fresh.tls_ktls != m.cfg->tls_ktls || fresh.tls_cache != m.cfg->tls_cache ){
+        printf( "master: TLS settings change needs a binary upgrade, ignored\n" );
+        fresh.tls_port = m.cfg->tls_port;
+        fresh.tls_cert = m.cfg->tls_cert;
+        fresh.tls_key = m.cfg->tls_key;
+        fresh.tls_ktls = m.cfg->tls_ktls;
+        fresh.tls_cache = m.cfg->tls_cache;
+    }
+    //限流表和限制值都在fork之前确定
+    if( fresh.rate_limit != m.cfg->rate_limit || fresh.rate_burst != m.cfg->rate_burst
+            || fresh.conn_limit != m.cfg->conn_limit || fresh.limit_prefix4 != m.cfg->limit_prefix4
+            || fresh.limit_prefix6 != m.cfg->limit_prefix6 || fresh.limit_slots != m.cfg->limit_slots ){
+        printf( "master: rate limit change needs a binary upgrade, ignored\n" );
+        fresh.rate_limit = m.cfg->rate_limit;
+        fresh.rate_burst = m.cfg->rate_burst;
+        fresh.conn_limit = m.cfg->conn_limit;
+        fresh.limit_prefix4 = m.cfg->limit_prefix4;
+        fresh.limit_prefix6 = m.cfg->limit_prefix6;
+        fresh.limit_slots = m.cfg->limit_slots;
+    }
+    if( fresh.upload_max_mb != m.cfg->upload_max_mb || fresh.upload_total_mb != m.cfg->upload_total_mb
+            || fresh.upload_sync != m.cfg->upload_sync ){
+        printf( "master: upload limit change needs a binary upgrade, ignored\n" );
+        fresh.upload_max_mb = m.cfg->upload_max_mb;
+        fresh.upload_total_mb = m.cfg->upload_total_mb;
+        fresh.upload_sync = m.cfg->upload_sync;
+    }
+    //上游服务、路由表和打包文件都在fork之前建立
+    if( fresh.routes != m.cfg->routes || fresh.upstreams != m.cfg->upstreams || fresh.bundle != m.cfg->bundle ){
+        printf( "master: route, upstream or bundle change needs a binary upgrade, ignored\n" );
+        fresh.routes = m.cfg->routes;
+        fresh.upstreams = m.cfg->upstreams;
+        fresh.bundle = m.cfg->bundle;
+    }
+    //worker槽位和统计槽位在启动时按worker数量分配；改成0会让reload变成退出
+    if( fresh.workers != m.cfg->workers ){
+        printf( "master: worker count change needs a binary upgrade, ignored\n" );
+        fresh.workers = m.cfg->workers;
+    }
+    //上一次reload的旧worker可能还没退出，槽位不够整整一代时不启动新的worker
+    int free_slots = (int)m.slots.size() - live_workers( m );
+    if( free_slots < fresh.workers ){
+        printf( "master: %d workers still draining, reload ignored\n", (int)m.slots.size() - free_slots );
+        return;
+    }
+    server_config old_cfg = *m.cfg;
+    *m.cfg = fresh;
+    int old_generation = m.generation++;
+    //等待拉起的是旧一代的worker，新的一代会整代启动
+    int old_pending = m.pending_respawns;
+    m.pending_respawns = 0;
+    int spawned = 0;
+    while( spawned < m.cfg->workers && spawn_worker( m ) ){
+        ++spawned;
+    }
+    //新的一代全部启动后才让旧的一代退出，否则退回旧的配置，让已经启动的新worker退出
+    if( spawned < m.cfg->workers ){
+        printf( "master: reload failed, keep the old workers\n" );
+        signal_workers( m, m.generation, SIGQUIT );
+        *m.cfg = old_cfg;
+        m.generation = old_generation;
+        m.pending_respawns = old_pending;
+        return;
+    }
+    signal_workers( m, old_generation, SIGQUIT );
+}
+
+//SIGUSR2：保留监听socket执行新的二进制文件
+static void upgrade( master_state& m ){
+    if( m.upgrade_pid != 0 ){
+        printf( "master: upgrade already in progress\n" );
+        return;
+    }
+    std::string fds;
+    for( size_t i = 0; i < m.listenfds->size(); ++i ){
+        char buf[ 16 ];
+        snprintf( buf, sizeof( buf ), "%s%d", i ? "," : "", ( *m.listenfds )[i] );
+        fds += buf;
+    }
+    char parent[ 16 ];
+    snprintf( parent, sizeof( parent ), "%d", (int)getpid() );
+
+    pid_t pid = fork();
+    if( pid < 0 ){
+        printf( "master: fork failed, errno is: %d\n", errno );
+        return;
+    }
+    if( pid == 0 ){
+        for( size_t i = 0; i < m.listenfds->size(); ++i ){
+            int fd = ( *m.listenfds )[i];
+            fcntl( fd, F_SETFD, fcntl( fd, F_GETFD ) & ~FD_CLOEXEC );
+        }
+        setenv( ENV_LISTEN_FDS, fds.c_str(), 1 );
+        setenv( ENV_UPGRADE_FROM, parent, 1 );
+        for( int i = 0; i < master_signals_count; ++i ){
+            signal( master_signals[i], SIG_DFL );
+        }
+        sigprocmask( SIG_SETMASK, &m.old_mask, NULL );
+        //alarm会保留到exec之后，新master装好信号处理函数之前收到SIGALRM会直接退出
+        alarm( 0 );
+        execv( m.exe_path.c_str(), m.argv );
+        printf( "master: exec %s failed, errno is: %d\n", m.exe_path.c_str(), errno );
+        _exit( 1 );
+    }
+    m.upgrade_pid = pid;
+    printf( "master: started new binary pid %d\n", (int)pid );
+}
+
+bool master_inherit_listeners( std::vector< int >& listenfds ){
+    const char* env = getenv( ENV_LISTEN_FDS );
+    if( !env || !*env ){
+        return false;
+    }
+    listenfds.clear();
+    const char* p = env;
+    while( *p ){
+        char* end = 0;
+        long fd = strtol( p, &end, 10 );
+        if( end == p || fd < 0 || fcntl( fd, F_GETFD ) < 0 ){
+            listenfds.clear();
+            return false;
+        }
+        listenfds.push_back( fd );
+        p = ( *end == ',' ) ? end + 1 : end;
+    }
+    unsetenv( ENV_LISTEN_FDS );
+    return !listenfds.empty();
+}
+
+int master_run( int argc, char* argv[], server_config& cfg,
+        const std::vector< int >& listenfds, worker_main_fn worker_main ){
+    master_state m;
+    m.argc = argc;
+    m.argv = argv;
+    m.cfg = &cfg;
+    m.listenfds = &listenfds;
+    m.worker_main = worker_main;
+    m.generation = 1;
+    m.upgrade_pid = 0;
+    m.pending_respawns = 0;
+    m.respawn_delay = 0;
+
+    //升级时替换的是磁盘上的文件，所以启动时就记下路径
+    char exe[ 4096 ];
+    ssize_t n = readlink( "/proc/self/exe", exe, sizeof( exe ) - 1 );
+    if( n > 0 ){
+        exe[n] = '\0';
+        m.exe_path = exe;
+    }else{
+        m.exe_path = argv[0];
+    }
+
+    //留出两倍的槽位给SIGHUP时新旧两代worker同时存在
+    int slots = cfg.workers * 2;
+    m.slots.resize( slots );
+    for( int i = 0; i < slots; ++i ){
+        m.slots[i].pid = 0;
+        m.slots[i].generation = 0;
+        m.slots[i].retiring = false;
+        m.slots[i].started = 0;
+    }
+    m.seg = stats_create( slots );
+    if( !m.seg ){
+        printf( "master: cannot create stats segment\n" );
+        return 1;
+    }
+    g_stats_segment = m.seg;
+
+    //信号只在sigsuspend中处理，避免和主循环竞争
+    sigset_t block;
+    sigemptyset( &block );
+    for( int i = 0; i < master_signals_count; ++i ){
+        sigaddset( &block, master_signals[i] );
+        struct sigaction sa;
+        memset( &sa, '\0', sizeof( sa ) );
+        sa.sa_handler = master_sig_handler;
+        sigfillset( &sa.sa_mask );
+        sigaction( master_signals[i], &sa, NULL );
+    }
+    sigprocmask( SIG_BLOCK, &block, &m.old_mask );
+    sigset_t wait_mask = m.old_mask;
+    for( int i = 0; i < master_signals_count; ++i ){
+        sigdelset( &wait_mask, master_signals[i] );
+    }
+
+    for( int i = 0; i < cfg.workers; ++i ){
+        spawn_worker( m );
+    }
+
+    //由旧master启动的：新的worker已经开始accept，通知旧master退出
+    const char* from = getenv( ENV_UPGRADE_FROM );
+    if( from ){
+        pid_t old_master = atoi( from );
+        unsetenv( ENV_UPGRADE_FROM );
+        if( old_master > 1 && live_workers( m ) > 0 ){
+            printf( "master: take over from %d\n", (int)old_master );
+            kill( old_master, SIGQUIT );
+        }
+    }
+
+    bool quitting = false;
+    while( true ){
+        sigsuspend( &wait_mask );
+
+        if( sig_terminate ){
+            sig_terminate = 0;
+            signal_workers( m, -1, SIGTERM );
+            quitting = true;
+        }
+        if( sig_quit ){
+            sig_quit = 0;
+            signal_workers( m, -1, SIGQUIT );
+            quitting = true;
+        }
+        if( sig_child ){
+            sig_child = 0;
+            reap_children( m, !quitting );
+            //worker都启动失败了，没有可以拉起的
+            if( !quitting && live_workers( m ) == 0 && m.pending_respawns == 0 ){
+                printf( "master: no worker left\n" );
+                return 1;
+            }
+        }
+        if( quitting ){
+            if( live_workers( m ) == 0 ){
+                break;
+            }
+            continue;
+        }
+        if( sig_alarm ){
+            sig_alarm = 0;
+            for( ; m.pending_respawns > 0; --m.pending_respawns ){
+                m.seg->respawns.fetch_add( 1 );
+                spawn_worker( m );
+            }
+        }
+        if( sig_reload ){
+            sig_reload = 0;
+            reload( m );
+        }
+        if( sig_upgrade ){
+            sig_upgrade = 0;
+            upgrade( m );
+        }
+        if( sig_dump ){
+            sig_dump = 0;
+            stats_dump( m.seg, stdout );
+        }
+    }
+    printf( "master: all workers exited\n" );
+    return 0;
+}
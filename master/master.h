@@ -0,0 +1,24 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#include <vector>
+#include "../config/config.h"
+
+//worker进程的入口，返回值作为进程退出码
+typedef int ( *worker_main_fn )( const server_config& cfg );
+
+//多进程模式：master只负责监听socket和worker进程的管理，不处理连接
+//  SIGCHLD  非正常退出的worker会被重新拉起，刚启动就退出的延迟拉起，启动出错（退出码1）的不再拉起
+//  SIGHUP   重新读取配置，启动新一代worker，旧的worker处理完已有连接后退出
+//  SIGUSR2  二进制升级，exec新的可执行文件并通过环境变量交给它监听socket，
+//           新master启动worker后向旧master发送SIGQUIT
+//  SIGUSR1  打印共享内存中的统计信息
+//  SIGQUIT  所有worker处理完已有连接后退出
+//  SIGTERM/SIGINT  立即退出
+int master_run( int argc, char* argv[], server_config& cfg,
+        const std::vector< int >& listenfds, worker_main_fn worker_main );
+
+//二进制升级时从环境变量取得旧master交过来的监听socket，没有则返回false
+bool master_inherit_listeners( std::vector< int >& listenfds );
+
+#endif
@@ -0,0 +1,265 @@
+#include "router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+//顺序和http_conn::METHOD一致
+static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+static const int method_count = sizeof( method_names ) / sizeof( method_names[0] );
+
+router::router(){
+    m_root = new node;
+}
+
+router::~router(){
+    destroy( m_root );
+}
+
+void router::destroy( node* n ){
+    for( size_t i = 0; i < n->children.size(); ++i ){
+        destroy( n->children[i] );
+    }
+    delete n;
+}
+
+int router::method_mask( const char* names ){
+    if( strcmp( names, "*" ) == 0 ){
+        return ( 1 << method_count ) - 1;
+    }
+    int mask = 0;
+    const char* p = names;
+    while( *p ){
+        size_t n = strcspn( p, "," );
+        int i = 0;
+        for( ; i < method_count; ++i ){
+            if( strlen( method_names[i] ) == n && strncasecmp( p, method_names[i], n ) == 0 ){
+                mask |= 1 << i;
+                break;
+            }
+        }
+        if( i == method_count ){
+            return 0;
+        }
+        p += n;
+        if( *p == ',' ){
+            ++p;
+        }
+    }
+    //可以GET的路径也接受HEAD，响应头相同，只是没有响应体
+    if( mask & ( 1 << method_id( "GET" ) ) ){
+        mask |= 1 << method_id( "HEAD" );
+    }
+    return mask;
+}
+
+const char* router::method_name( int method ){
+    return method >= 0 && method < method_count ? method_names[ method ] : "GET";
+}
+
+int router::method_id( const char* name ){
+    for( int i = 0; i < method_count; ++i ){
+        if( strcmp( name, method_names[i] ) == 0 ){
+            return i;
+        }
+    }
+    return -1;
+}
+
+//插入路径，沿途按最长公共前缀拆分节点，返回路径对应的节点
+router::node* router::insert( const char* path, size_t len ){
+    node* n = m_root;
+    size_t i = 0;
+    while( i < len ){
+        node* child = 0;
+        size_t slot = 0;
+        for( ; slot < n->children.size(); ++slot ){
+            if( n->children[ slot ]->label[0] == path[i] ){
+                child = n->children[ slot ];
+                break;
+            }
+        }
+        if( !child ){
+            child = new node;
+            child->label.assign( path + i, len - i );
+            n->children.push_back( child );
+            return child;
+        }
+        size_t common = 0;
+        while( common < child->label.size() && i + common < len && child->label[ common ] == path[ i + common ] ){
+            ++common;
+        }
+        if( common < child->label.size() ){
+            //公共部分成为新的中间节点
+            node* mid = new node;
+            mid->label = child->label.substr( 0, common );
+            child->label.erase( 0, common );
+            mid->children.push_back( child );
+            n->children[ slot ] = mid;
+            child = mid;
+        }
+        i += common;
+        n = child;
+    }
+    return n;
+}
+
+void router::add( const char* path, int methods, ROUTE_TYPE type, const char* target, int code ){
+    size_t len = strlen( path );
+    bool is_prefix = len > 0 && path[ len - 1 ] == '*';
+    if( is_prefix ){
+        --len;
+    }
+    node* n = insert( path, len );
+    route r;
+    r.type = type;
+    r.methods = methods;
+    r.target = target ? target : "";
+    r.code = code;
+    r.prefix_len = len;
+    //后加入的同名路由优先，配置文件中的规则可以覆盖默认规则
+    std::vector< route >& list = is_prefix ? n->prefix : n->exact;
+    list.insert( list.begin(), r );
+}
+
+bool router::add_rule( const char* rule ){
+    char methods[ 64 ], path[ 512 ], type[ 16 ], target[ 512 ];
+    int code = 0;
+    target[0] = '\0';
+    int n = sscanf( rule, "%63s %511s %15s %511s %d", methods, path, type, target, &code );
+    if( n < 3 || path[0] != '/' ){
+        return false;
+    }
+    int mask = method_mask( methods );
+    if( mask == 0 ){
+        return false;
+    }
+    if( strcasecmp( type, "static" ) == 0 ){
+        add( path, mask, ROUTE_STATIC, 0 );
+    }else if( strcasecmp( type, "alias" ) == 0 && n >= 4 && target[0] == '/' ){
+        add( path, mask, ROUTE_ALIAS, target );
+    }else if( strcasecmp( type, "redirect" ) == 0 && n >= 4 ){
+        add( path, mask, ROUTE_REDIRECT, target, ( code >= 300 && code < 400 ) ? code : 302 );
+    }else if( strcasecmp( type, "internal" ) == 0 && n >= 4 ){
+        add( path, mask, ROUTE_INTERNAL, target );
+    }else if( strcasecmp( type, "cgi" ) == 0 && n >= 5 ){
+        add( path, mask, ROUTE_CGI, target, code );
+    }else if( strcasecmp( type, "proxy" ) == 0 && n >= 4 ){
+        add( path, mask, ROUTE_PROXY, target );
+    }else if( strcasecmp( type, "websocket" ) == 0 && ( n < 4 || strcasecmp( target, "publish" ) == 0 ) ){
+        add( path, mask, ROUTE_WEBSOCKET, n >= 4 ? "publish" : 0 );
+    }else if( strcasecmp( type, "upload" ) == 0 && n >= 4 && target[0] == '/' ){
+        add( path, mask, ROUTE_UPLOAD, target );
+    }else{
+        return false;
+    }
+    return true;
+}
+
+const route* router::pick( const std::vector< route >& routes, int method, bool* matched ){
+    for( size_t i = 0; i < routes.size(); ++i ){
+        *matched = true;
+        if( routes[i].methods & ( 1 << method ) ){
+            return &routes[i];
+        }
+    }
+    return 0;
+}
+
+const route* router::match( int method, const char* path, size_t len, bool* method_not_allowed ) const{
+    const node* n = m_root;
+    const route* best = 0;
+    bool matched = false;
+    size_t i = 0;
+    while( true ){
+        //记录一路上最长的前缀路由
+        const route* r = pick( n->prefix, method, &matched );
+        if( r ){
+            best = r;
+        }
+        if( i == len ){
+            r = pick( n->exact, method, &matched );
+            if( r ){
+                best = r;
+            }
+            break;
+        }
+        const node* next = 0;
+        for( size_t c = 0; c < n->children.size(); ++c ){
+            if( n->children[c]->label[0] == path[i] ){
+                next = n->children[c];
+                break;
+            }
+        }
+        if( !next || len - i < next->label.size()
+                || memcmp( path + i, next->label.data(), next->label.size() ) != 0 ){
+            break;
+        }
+        i += next->label.size();
+        n = next;
+    }
+    *method_not_allowed = !best && matched;
+    return best;
+}
+
+static int hex_value( char c ){
+    if( c >= '0' && c <= '9' ){
+        return c - '0';
+    }
+    return ( tolower( (unsigned char)c ) - 'a' ) + 10;
+}
+
+bool normalize_path( char* path ){
+    if( path[0] != '/' ){
+        return false;
+    }
+    path[ strcspn( path, "?#" ) ] = '\0';
+
+    //解码%xx，解码后可能出现的..也会在下面被拒绝
+    char* r = path;
+    char* w = path;
+    while( *r ){
+        if( r[0] == '%' && isxdigit( (unsigned char)r[1] ) && isxdigit( (unsigned char)r[2] ) ){
+            char c = hex_value( r[1] ) * 16 + hex_value( r[2] );
+            //解码出来的控制字符（包括\0、CR、LF）不能进入文件名，也不能被转发到上游的请求行中
+            if( (unsigned char)c < 0x20 || c == 0x7f ){
+                return false;
+            }
+            *w++ = c;
+            r += 3;
+        }else if( (unsigned char)*r < 0x20 || *r == 0x7f ){
+            return false;
+        }else{
+            *w++ = *r++;
+        }
+    }
+    *w = '\0';
+
+    r = path;
+    w = path;
+    while( *r ){
+        if( r[0] == '/' ){
+            //合并连续的/
+            while( r[1] == '/' ){
+                ++r;
+            }
+            //去掉 /.
+            if( r[1] == '.' && ( r[2] == '/' || r[2] == '\0' ) ){
+                r += 2;
+                continue;
+            }
+            //不允许访问上级目录
+            if( r[1] == '.' && r[2] == '.' && ( r[3] == '/' || r[3] == '\0' ) ){
+                return false;
+            }
+        }
+        *w++ = *r++;
+    }
+    if( w == path ){
+        *w++ = '/';
+    }
+    *w = '\0';
+    return true;
+}
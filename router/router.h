@@ -0,0 +1,70 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+//路由的处理方式
+enum ROUTE_TYPE {
+    ROUTE_STATIC = 0,   //doc_root下和url同名的文件
+    ROUTE_ALIAS,        //固定返回target指定的文件
+    ROUTE_REDIRECT,     //返回code指定的3xx，Location为target
+    ROUTE_INTERNAL,     //服务器内部生成的响应，target为名字
+    ROUTE_CGI,          //动态请求，code区分具体动作
+    ROUTE_PROXY,        //转发给target指定的上游服务
+    ROUTE_WEBSOCKET,    //升级为WebSocket，订阅和路径同名的频道，target为publish时对方也可以发布
+    ROUTE_UPLOAD        //消息体保存为target目录中和url最后一段同名的文件
+};
+
+struct route{
+    ROUTE_TYPE type;
+    //允许的请求方法，第i位对应http_conn::METHOD中的第i个
+    int methods;
+    std::string target;
+    int code;
+    //路径去掉结尾*之后的长度，前缀匹配时请求路径在这之后的部分由路由自己解释
+    size_t prefix_len;
+};
+
+//启动时建立的基数树，按 方法+路径 找到路由
+//查找只读、不分配内存，复杂度和路径长度成正比，建立之后可以被所有线程共享
+//路由分精确匹配和前缀匹配两种，优先精确匹配，其次最长的前缀匹配
+class router{
+public:
+    router();
+    ~router();
+
+    //path以*结尾表示前缀匹配
+    void add( const char* path, int methods, ROUTE_TYPE type, const char* target, int code = 0 );
+    //解析配置中的一条路由：METHOD[,METHOD] PATH TYPE [TARGET] [CODE]
+    bool add_rule( const char* rule );
+    //找不到时返回NULL，路径存在但方法不允许时method_not_allowed为true
+    const route* match( int method, const char* path, size_t len, bool* method_not_allowed ) const;
+
+    //方法名转为掩码，未知方法返回0
+    static int method_mask( const char* names );
+    //http_conn::METHOD对应的方法名
+    static const char* method_name( int method );
+    //方法名（区分大小写）对应的http_conn::METHOD，未知方法返回-1
+    static int method_id( const char* name );
+
+private:
+    struct node{
+        std::string label;
+        std::vector< node* > children;
+        std::vector< route > exact;
+        std::vector< route > prefix;
+    };
+    node* insert( const char* path, size_t len );
+    static void destroy( node* n );
+    static const route* pick( const std::vector< route >& routes, int method, bool* matched );
+
+    node* m_root;
+};
+
+//规范化请求路径：去掉查询串、解码%xx、合并//、去掉/./，出现..或控制字符（包括%00、%0d、%0a）时返回false
+//原地修改，结果一定不长于原串
+bool normalize_path( char* path );
+
+#endif
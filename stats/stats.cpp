@@ -0,0 +1,117 @@
+#include "stats.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+worker_stats* g_stats = 0;
+stats_segment* g_stats_segment = 0;
+
+stats_segment* stats_create( int slots ){
+    if( slots < 1 ){
+        slots = 1;
+    }
+    size_t size = offsetof( stats_segment, worker ) + sizeof( worker_stats ) * slots;
+    //匿名共享映射，fork之后父子进程看到同一份物理页，初始内容为0
+    void* addr = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( addr == MAP_FAILED ){
+        return 0;
+    }
+    stats_segment* seg = ( stats_segment* )addr;
+    seg->slots = slots;
+    return seg;
+}
+
+void stats_reset( worker_stats* s, int pid, int generation ){
+    s->accepted.store( 0 );
+    s->requests.store( 0 );
+    s->bytes_sent.store( 0 );
+    s->active.store( 0 );
+    s->tls_handshakes.store( 0 );
+    s->tls_resumed.store( 0 );
+    s->ktls_send.store( 0 );
+    s->rate_limited.store( 0 );
+    s->write_yields.store( 0 );
+    s->write_deferred.store( 0 );
+    s->bulk_tasks.store( 0 );
+    s->pools.store( 0 );
+    s->pool_threads.store( 0 );
+    s->pool_idle.store( 0 );
+    s->pool_wait_us.store( 0 );
+    s->generation.store( generation );
+    s->pid.store( pid );
+}
+
+void stats_aggregate( const stats_segment* seg, stats_total* total ){
+    total->workers = 0;
+    total->accepted = 0;
+    total->requests = 0;
+    total->bytes_sent = 0;
+    total->active = 0;
+    total->tls_handshakes = 0;
+    total->tls_resumed = 0;
+    total->ktls_send = 0;
+    total->rate_limited = 0;
+    total->write_yields = 0;
+    total->write_deferred = 0;
+    total->bulk_tasks = 0;
+    total->pool_threads = 0;
+    total->pool_idle = 0;
+    total->pool_wait_us = 0;
+    int64_t pools = 0;
+    total->respawns = seg->respawns.load( std::memory_order_relaxed );
+    for( int i = 0; i < seg->slots; ++i ){
+        const worker_stats& s = seg->worker[i];
+        if( s.pid.load( std::memory_order_relaxed ) == 0 ){
+            continue;
+        }
+        ++total->workers;
+        total->accepted += s.accepted.load( std::memory_order_relaxed );
+        total->requests += s.requests.load( std::memory_order_relaxed );
+        total->bytes_sent += s.bytes_sent.load( std::memory_order_relaxed );
+        total->active += s.active.load( std::memory_order_relaxed );
+        total->tls_handshakes += s.tls_handshakes.load( std::memory_order_relaxed );
+        total->tls_resumed += s.tls_resumed.load( std::memory_order_relaxed );
+        total->ktls_send += s.ktls_send.load( std::memory_order_relaxed );
+        total->rate_limited += s.rate_limited.load( std::memory_order_relaxed );
+        total->write_yields += s.write_yields.load( std::memory_order_relaxed );
+        total->write_deferred += s.write_deferred.load( std::memory_order_relaxed );
+        total->bulk_tasks += s.bulk_tasks.load( std::memory_order_relaxed );
+        pools += s.pools.load( std::memory_order_relaxed );
+        total->pool_threads += s.pool_threads.load( std::memory_order_relaxed );
+        total->pool_idle += s.pool_idle.load( std::memory_order_relaxed );
+        total->pool_wait_us += s.pool_wait_us.load( std::memory_order_relaxed );
+    }
+    if( pools > 0 ){
+        total->pool_wait_us /= pools;
+    }
+}
+
+void stats_dump( const stats_segment* seg, FILE* fp ){
+    stats_total t;
+    stats_aggregate( seg, &t );
+    fprintf( fp, "workers %d accepted %llu requests %llu bytes_sent %llu active %lld respawns %llu"
+            " tls_handshakes %llu tls_resumed %llu ktls_send %llu rate_limited %llu"
+            " write_yields %llu write_deferred %llu bulk_tasks %llu"
+            " pool_threads %lld pool_idle %lld pool_wait_us %lld\n",
+            t.workers, (unsigned long long)t.accepted, (unsigned long long)t.requests,
+            (unsigned long long)t.bytes_sent, (long long)t.active, (unsigned long long)t.respawns,
+            (unsigned long long)t.tls_handshakes, (unsigned long long)t.tls_resumed, (unsigned long long)t.ktls_send,
+            (unsigned long long)t.rate_limited, (unsigned long long)t.write_yields,
+            (unsigned long long)t.write_deferred, (unsigned long long)t.bulk_tasks,
+            (long long)t.pool_threads, (long long)t.pool_idle, (long long)t.pool_wait_us );
+    for( int i = 0; i < seg->slots; ++i ){
+        const worker_stats& s = seg->worker[i];
+        int pid = s.pid.load( std::memory_order_relaxed );
+        if( pid == 0 ){
+            continue;
+        }
+        fprintf( fp, "  worker %d pid %d gen %d accepted %llu requests %llu active %lld threads %lld idle %lld\n",
+                i, pid, s.generation.load( std::memory_order_relaxed ),
+                (unsigned long long)s.accepted.load( std::memory_order_relaxed ),
+                (unsigned long long)s.requests.load( std::memory_order_relaxed ),
+                (long long)s.active.load( std::memory_order_relaxed ),
+                (long long)s.pool_threads.load( std::memory_order_relaxed ),
+                (long long)s.pool_idle.load( std::memory_order_relaxed ) );
+    }
+    fflush( fp );
+}
@@ -0,0 +1,78 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+
+//每个worker进程一个槽位，master在fork之前用共享内存创建，所有进程都能看到
+//计数只由所属进程修改，使用relaxed原子操作，不需要加锁
+struct worker_stats{
+    std::atomic< int > pid;
+    std::atomic< int > generation;
+    std::atomic< uint64_t > accepted;
+    std::atomic< uint64_t > requests;
+    std::atomic< uint64_t > bytes_sent;
+    std::atomic< int64_t > active;
+    //完成的TLS握手，其中恢复了会话的，以及发送交给了内核TLS的
+    std::atomic< uint64_t > tls_handshakes;
+    std::atomic< uint64_t > tls_resumed;
+    std::atomic< uint64_t > ktls_send;
+    //因为超过客户端的连接数或请求速率而拒绝的连接和请求
+    std::atomic< uint64_t > rate_limited;
+    //调度的公平性：用完写配额后让给其他连接的次数，超过reactor每轮字节预算推迟到下一轮的写事件，
+    //进入低优先级队列的大块传输任务（上传）
+    std::atomic< uint64_t > write_yields;
+    std::atomic< uint64_t > write_deferred;
+    std::atomic< uint64_t > bulk_tasks;
+    //线程池的当前状态，由每个reactor的线程池加减：线程池个数、线程数、空闲线程数、
+    //各线程池排队时间（微秒，指数平均）之和
+    std::atomic< int64_t > pools;
+    std::atomic< int64_t > pool_threads;
+    std::atomic< int64_t > pool_idle;
+    std::atomic< int64_t > pool_wait_us;
+};
+
+struct stats_segment{
+    int slots;
+    std::atomic< uint64_t > respawns;
+    worker_stats worker[1];
+};
+
+//汇总结果
+struct stats_total{
+    int workers;
+    uint64_t accepted;
+    uint64_t requests;
+    uint64_t bytes_sent;
+    int64_t active;
+    uint64_t respawns;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t ktls_send;
+    uint64_t rate_limited;
+    uint64_t write_yields;
+    uint64_t write_deferred;
+    uint64_t bulk_tasks;
+    int64_t pool_threads;
+    int64_t pool_idle;
+    //所有线程池排队时间的平均值
+    int64_t pool_wait_us;
+};
+
+//创建有slots个槽位的共享段，fork出来的子进程共享同一块内存
+stats_segment* stats_create( int slots );
+//当前进程使用的槽位，单进程模式下指向一块私有内存
+extern worker_stats* g_stats;
+extern stats_segment* g_stats_segment;
+
+void stats_reset( worker_stats* s, int pid, int generation );
+void stats_aggregate( const stats_segment* seg, stats_total* total );
+void stats_dump( const stats_segment* seg, FILE* fp );
+
+inline void stats_add( std::atomic< uint64_t >& counter, uint64_t n ){
+    counter.fetch_add( n, std::memory_order_relaxed );
+}
+
+#endif
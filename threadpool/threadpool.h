@@ -3,106 +3,282 @@
 
 #include <cstdio>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
 #include <list>
 #include <exception>
 #include "../locker/locker.h"
+#include "../stats/stats.h"
 
+//线程池在[min, max]之间自动伸缩
+//扩容：任务的排队时间（指数平均）超过阈值且没有空闲线程
+//缩容：线程空闲超过idle时间，且排队时间低于阈值的1/4、忙碌线程不足一半
+//两个阈值之间留出滞回区间，避免线程数来回抖动；空闲线程阻塞在条件变量上
+//线程数、空闲线程数和排队时间累加到本进程的统计槽位中，由/status和SIGUSR1输出
+//
+//任务分两个优先级：解析请求头、生成响应这类短任务优先；大块传输（上传）放在低优先级队列，
+//有短任务排队时每处理PRIORITY_RUN个短任务才处理一个大块传输，两边都不会饿死
 template< typename T >
 class threadpool{
 public:
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    //cpus不为空时所有工作线程都绑定到这组cpu上
+    threadpool( int thread_number = 8, int max_requests = 10000, const cpu_set_t* cpus = NULL );
     ~threadpool();
-    bool append( T* request );
+    //开启自动伸缩，线程数上限max_threads，排队超过grow_wait_us微秒扩容，空闲idle_ms毫秒的线程退出
+    void set_autoscale( int max_threads, int grow_wait_us, int idle_ms );
+    //bulk为true时进入低优先级队列
+    bool append( T* request, bool bulk = false );
+
 private:
     //使用static是因为pthread_create只能传入静态的函数
     static void* worker( void* arg );
     void run();
+    //创建一个工作线程，调用前已加锁
+    bool spawn();
+    //通知所有线程退出并等待，调用前已加锁
+    void stop_all();
+    static uint64_t now_us();
+    //把排队时间的变化累加到统计中，调用前已加锁
+    void publish_wait();
 
 private:
-    int m_thread_number;//线程池中的线程数
+    //低优先级任务等待时最多连续处理的短任务数
+    static const int PRIORITY_RUN = 4;
+
+    struct task{
+        T* request;
+        uint64_t enqueue_us;
+    };
+    //取出下一个任务，调用前已加锁且至少有一个队列不为空
+    task pop();
+
+    int m_min_threads;//常驻线程数
+    int m_max_threads;//线程数上限
     int m_max_requests;//请求队列中的最大允许数量
-    pthread_t* m_threads;//描述线程池的数组
-    std::list< T* > m_workqueue;//请求队列
-    locker m_queuelocker;//保护请求队列的互斥锁
-    sem m_queuestat;//是否有任务要处理
+    int m_grow_wait_us;//扩容阈值
+    int m_idle_ms;//空闲线程退出的时间
+    bool m_has_cpus;
+    cpu_set_t m_cpus;//工作线程绑定的cpu
+
+    int m_live;//存活的线程数
+    int m_idle;//阻塞等待任务的线程数
+    int m_busy;//正在处理任务的线程数
+    uint64_t m_wait_avg_us;//排队时间的指数平均
+    uint64_t m_wait_published;//已经计入统计的排队时间
+    uint64_t m_last_grow_us;//上次扩容的时间
+
+    std::list< task > m_workqueue;//请求队列
+    std::list< task > m_bulkqueue;//大块传输的请求队列
+    int m_priority_run;//低优先级任务等待期间连续处理的短任务数
+    locker m_queuelocker;//保护请求队列和上面计数的互斥锁
+    cond m_queuecond;//有任务要处理
+    cond m_exitcond;//线程退出，析构时等待
     bool m_stop; //是否结束线程
 
 };
 
 template< typename T>
-threadpool<T>::threadpool( int thread_number, int max_requests ):
-    m_thread_number( thread_number), m_max_requests( max_requests){
+threadpool<T>::threadpool( int thread_number, int max_requests, const cpu_set_t* cpus ):
+    m_min_threads( thread_number), m_max_threads( thread_number), m_max_requests( max_requests),
+    m_grow_wait_us( 0 ), m_idle_ms( 0 ), m_has_cpus( cpus != NULL ),
+    m_live( 0 ), m_idle( 0 ), m_busy( 0 ), m_wait_avg_us( 0 ), m_wait_published( 0 ), m_last_grow_us( 0 ),
+    m_priority_run( 0 ), m_stop( false ){
     if((thread_number <= 0) || (max_requests <= 0) ){
         throw std::exception();
     }
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads ){
-        throw std::exception();
+    if( cpus ){
+        m_cpus = *cpus;
     }
 
-    //创建线程将他们设置脱离unjoinable
+    //创建线程将他们设置脱离unjoinable，退出时通过m_exitcond通知
+    m_queuelocker.lock();
     for(int i = 0; i< thread_number; ++i){
-        printf("create the %dth thread\n", i);
-        //进程号，属性，执行函数，传参
-        if( pthread_create( m_threads + i, NULL, worker, this) != 0){
-            delete [] m_threads;
-            throw std::exception();
-        }
-        if( pthread_detach( m_threads[i] ) ){
-            delete [] m_threads;
+        if( !spawn() ){
+            //已经创建的线程要先退出
+            stop_all();
+            m_queuelocker.unlock();
             throw std::exception();
         }
     }
+    m_queuelocker.unlock();
+    g_stats->pools.fetch_add( 1, std::memory_order_relaxed );
 }
+
 template <typename T>
 threadpool<T>::~threadpool(){
-    delete [] m_threads;
-    m_stop=true;
+    m_queuelocker.lock();
+    stop_all();
+    m_wait_avg_us = 0;
+    publish_wait();
+    m_queuelocker.unlock();
+    g_stats->pools.fetch_sub( 1, std::memory_order_relaxed );
 }
 
 template< typename T>
-bool threadpool< T >::append( T* request ){
+void threadpool<T>::stop_all(){
+    //唤醒所有阻塞的线程，等它们全部退出
+    m_stop = true;
+    m_queuecond.broadcast();
+    while( m_live > 0 ){
+        m_exitcond.wait( m_queuelocker.get() );
+    }
+}
+
+template< typename T>
+void threadpool<T>::set_autoscale( int max_threads, int grow_wait_us, int idle_ms ){
+    m_queuelocker.lock();
+    m_max_threads = max_threads > m_min_threads ? max_threads : m_min_threads;
+    m_grow_wait_us = grow_wait_us;
+    m_idle_ms = idle_ms;
+    m_queuelocker.unlock();
+}
+
+template< typename T>
+uint64_t threadpool<T>::now_us(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template< typename T>
+bool threadpool<T>::spawn(){
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if( m_has_cpus && pthread_attr_setaffinity_np( &attr, sizeof( m_cpus ), &m_cpus ) != 0 ){
+        printf("cannot pin the %dth thread\n", m_live);
+    }
+    printf("create the %dth thread\n", m_live);
+    pthread_t tid;
+    //进程号，属性，执行函数，传参
+    int ret = pthread_create( &tid, &attr, worker, this);
+    pthread_attr_destroy( &attr );
+    if( ret != 0 ){
+        return false;
+    }
+    ++m_live;
+    g_stats->pool_threads.fetch_add( 1, std::memory_order_relaxed );
+    return true;
+}
+
+template< typename T>
+void threadpool<T>::publish_wait(){
+    g_stats->pool_wait_us.fetch_add( (int64_t)m_wait_avg_us - (int64_t)m_wait_published, std::memory_order_relaxed );
+    m_wait_published = m_wait_avg_us;
+}
+
+template< typename T>
+bool threadpool< T >::append( T* request, bool bulk ){
     //操作工作队列一定要加锁
     m_queuelocker.lock();
-    if( m_workqueue.size() > m_max_requests){
+    if( (int)( m_workqueue.size() + m_bulkqueue.size() ) >= m_max_requests){
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back( request );
+    task t = { request, now_us() };
+    std::list< task >& queue = bulk ? m_bulkqueue : m_workqueue;
+    queue.push_back( t );
+
+    if( m_idle > 0 ){
+        //有空闲线程就唤醒一个
+        m_queuecond.signal();
+    }else if( m_live < m_max_threads && ( m_wait_avg_us > (uint64_t)m_grow_wait_us
+                || t.enqueue_us - queue.front().enqueue_us > (uint64_t)m_grow_wait_us ) ){
+        //所有线程都在忙并且排队时间过长（平均值或者队头已经等待的时间），扩容
+        //两次扩容至少间隔一个阈值的时间，让新线程的效果先体现在平均排队时间上
+        if( t.enqueue_us - m_last_grow_us > (uint64_t)m_grow_wait_us ){
+            m_last_grow_us = t.enqueue_us;
+            spawn();
+        }
+    }
     m_queuelocker.unlock();
-    //设置信号量加一，只要不是零，就可以处理队列
-    m_queuestat.post();
     return true;
 }
 
+template< typename T>
+typename threadpool<T>::task threadpool<T>::pop(){
+    //短任务优先，低优先级任务已经让过PRIORITY_RUN次时轮到它
+    bool bulk = m_workqueue.empty() || ( !m_bulkqueue.empty() && m_priority_run >= PRIORITY_RUN );
+    std::list< task >& queue = bulk ? m_bulkqueue : m_workqueue;
+    task t = queue.front();
+    queue.pop_front();
+    m_priority_run = bulk || m_bulkqueue.empty() ? 0 : m_priority_run + 1;
+    return t;
+}
+
 template< typename T>
 void* threadpool<T>::worker( void* arg){
     threadpool* pool = ( threadpool* )arg;
     pool->run();
-    return pool;
+    return NULL;
 }
 
 template< typename T>
 void threadpool<T>::run(){
-    while( !m_stop){
-        //处理任务队列信号量减一
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty()){
-            m_queuelocker.unlock();
-            continue;
+    m_queuelocker.lock();
+    while( true ){
+        //没有任务就阻塞，可伸缩时定时醒来检查是否应该退出
+        while( m_workqueue.empty() && m_bulkqueue.empty() && !m_stop ){
+            ++m_idle;
+            g_stats->pool_idle.fetch_add( 1, std::memory_order_relaxed );
+            bool timeout = false;
+            if( m_live > m_min_threads && m_idle_ms > 0 ){
+                struct timespec t;
+                clock_gettime( CLOCK_REALTIME, &t );
+                t.tv_sec += m_idle_ms / 1000;
+                t.tv_nsec += (long)( m_idle_ms % 1000 ) * 1000000;
+                if( t.tv_nsec >= 1000000000 ){
+                    t.tv_sec += 1;
+                    t.tv_nsec -= 1000000000;
+                }
+                timeout = !m_queuecond.timewait( m_queuelocker.get(), t );
+            }else{
+                m_queuecond.wait( m_queuelocker.get() );
+            }
+            --m_idle;
+            g_stats->pool_idle.fetch_sub( 1, std::memory_order_relaxed );
+            if( timeout ){
+                //没有新任务时平均排队时间也要衰减
+                m_wait_avg_us /= 2;
+                publish_wait();
+            }
+            //空闲了整个idle周期，负载也低，就退出
+            if( timeout && m_workqueue.empty() && m_bulkqueue.empty() && m_live > m_min_threads
+                    && m_wait_avg_us * 4 < (uint64_t)m_grow_wait_us && m_busy * 2 < m_live ){
+                printf("retire a thread, %d left\n", m_live - 1);
+                --m_live;
+                g_stats->pool_threads.fetch_sub( 1, std::memory_order_relaxed );
+                m_exitcond.signal();
+                m_queuelocker.unlock();
+                return;
+            }
+        }
+        if( m_stop ){
+            break;
         }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
+
+        task t = pop();
+        //排队时间的指数平均，权重1/8
+        uint64_t wait = now_us() - t.enqueue_us;
+        m_wait_avg_us = m_wait_avg_us - m_wait_avg_us / 8 + wait / 8;
+        publish_wait();
+        ++m_busy;
         m_queuelocker.unlock();
 
-        if(!request){
-            continue;
-        }
         //处理过程
-        request->process();
+        if( t.request ){
+            t.request->process();
+        }
+
+        m_queuelocker.lock();
+        --m_busy;
     }
+    --m_live;
+    g_stats->pool_threads.fetch_sub( 1, std::memory_order_relaxed );
+    m_exitcond.signal();
+    m_queuelocker.unlock();
 }
 
 #endif
-
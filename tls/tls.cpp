@@ -0,0 +1,354 @@
+#include "tls.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <atomic>
+#include <openssl/err.h>
+#include "../stats/stats.h"
+
+//一个TLS记录最多携带的明文
+static const int RECORD_SIZE = 16384;
+//共享缓存中一个会话序列化后的上限，没有客户端证书的TLS 1.2会话一般只有两三百字节
+static const int SESSION_DATA = 1024;
+//拿不到槽位的锁时最多自旋的次数
+static const int LOCK_SPINS = 1000;
+
+//共享的会话缓存：session id哈希到固定的槽位，冲突时直接覆盖
+//每个槽位一个自旋锁，拿不到锁时当作没有命中，持有锁的进程崩溃也不会卡住其他进程
+struct cache_slot{
+    std::atomic< uint32_t > lock;
+    uint32_t id_len;
+    unsigned char id[ SSL_MAX_SSL_SESSION_ID_LENGTH ];
+    uint32_t len;
+    long long expires;
+    unsigned char data[ SESSION_DATA ];
+};
+
+//fork之前mmap的槽位数组，所有worker共享；回调中只能通过全局变量找到它
+static cache_slot* g_slots = 0;
+static uint32_t g_slot_count = 0;
+
+static cache_slot* slot_for( const unsigned char* id, unsigned int len ){
+    uint32_t h = 2166136261u;
+    for( unsigned int i = 0; i < len; ++i ){
+        h = ( h ^ id[i] ) * 16777619u;
+    }
+    return &g_slots[ h % g_slot_count ];
+}
+
+static bool slot_lock( cache_slot* s ){
+    for( int i = 0; i < LOCK_SPINS; ++i ){
+        uint32_t expected = 0;
+        if( s->lock.compare_exchange_weak( expected, 1, std::memory_order_acquire ) ){
+            return true;
+        }
+        if( i % 64 == 63 ){
+            sched_yield();
+        }
+    }
+    return false;
+}
+
+static void slot_unlock( cache_slot* s ){
+    s->lock.store( 0, std::memory_order_release );
+}
+
+//完整握手产生了新的会话，序列化后放进共享缓存
+static int cache_new( SSL* ssl, SSL_SESSION* sess ){
+    //TLS 1.3使用无状态的ticket，缓存中的会话永远不会被查到
+    if( SSL_version( ssl ) >= TLS1_3_VERSION ){
+        return 0;
+    }
+    unsigned int id_len = 0;
+    const unsigned char* id = SSL_SESSION_get_id( sess, &id_len );
+    int len = i2d_SSL_SESSION( sess, NULL );
+    if( id_len == 0 || len <= 0 || len > SESSION_DATA ){
+        return 0;
+    }
+    unsigned char buf[ SESSION_DATA ];
+    unsigned char* p = buf;
+    i2d_SSL_SESSION( sess, &p );
+
+    cache_slot* s = slot_for( id, id_len );
+    if( !slot_lock( s ) ){
+        return 0;
+    }
+    s->id_len = id_len;
+    memcpy( s->id, id, id_len );
+    s->len = len;
+    s->expires = time( NULL ) + SSL_SESSION_get_timeout( sess );
+    memcpy( s->data, buf, len );
+    slot_unlock( s );
+    //返回0表示我们没有保留sess的引用
+    return 0;
+}
+
+//客户端带着session id来恢复，可能是另一个worker建立的会话
+static SSL_SESSION* cache_get( SSL*, const unsigned char* id, int id_len, int* copy ){
+    *copy = 0;
+    if( id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH ){
+        return NULL;
+    }
+    cache_slot* s = slot_for( id, id_len );
+    unsigned char buf[ SESSION_DATA ];
+    int len = 0;
+    if( !slot_lock( s ) ){
+        return NULL;
+    }
+    if( s->id_len == (uint32_t)id_len && memcmp( s->id, id, id_len ) == 0 && s->expires > time( NULL ) ){
+        len = s->len;
+        memcpy( buf, s->data, len );
+    }
+    slot_unlock( s );
+    if( len == 0 ){
+        return NULL;
+    }
+    const unsigned char* p = buf;
+    return d2i_SSL_SESSION( NULL, &p, len );
+}
+
+static void cache_remove( SSL_CTX*, SSL_SESSION* sess ){
+    unsigned int id_len = 0;
+    const unsigned char* id = SSL_SESSION_get_id( sess, &id_len );
+    if( id_len == 0 ){
+        return;
+    }
+    cache_slot* s = slot_for( id, id_len );
+    if( !slot_lock( s ) ){
+        return;
+    }
+    if( s->id_len == id_len && memcmp( s->id, id, id_len ) == 0 ){
+        s->id_len = 0;
+    }
+    slot_unlock( s );
+}
+
+//ALPN：优先h2，连接上的第一批字节就是HTTP/2连接序言，和prior knowledge的h2c走同一条路
+static int select_alpn( SSL*, const unsigned char** out, unsigned char* outlen,
+        const unsigned char* in, unsigned int inlen, void* ){
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char* selected = 0;
+    if( SSL_select_next_proto( &selected, outlen, protos, sizeof( protos ) - 1, in, inlen ) != OPENSSL_NPN_NEGOTIATED ){
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void print_ssl_error( const char* what ){
+    char buf[ 256 ];
+    unsigned long err = ERR_get_error();
+    ERR_error_string_n( err, buf, sizeof( buf ) );
+    printf( "%s: %s\n", what, err ? buf : "unknown error" );
+    ERR_clear_error();
+}
+
+tls_context::tls_context() : m_ctx( 0 ), m_ktls( false ){
+}
+
+tls_context::~tls_context(){
+    if( m_ctx ){
+        SSL_CTX_free( m_ctx );
+    }
+}
+
+bool tls_context::init( const server_config& cfg ){
+    m_ctx = SSL_CTX_new( TLS_server_method() );
+    if( !m_ctx ){
+        print_ssl_error( "tls" );
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+    m_ktls = cfg.tls_ktls;
+    if( m_ktls ){
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options( m_ctx, options );
+    //部分写入时返回已经写出的字节数；重试时缓冲区可以移动；空闲连接不占用读写缓冲区
+    SSL_CTX_set_mode( m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+
+    if( SSL_CTX_use_certificate_chain_file( m_ctx, cfg.tls_cert.c_str() ) != 1 ){
+        print_ssl_error( cfg.tls_cert.c_str() );
+        return false;
+    }
+    if( SSL_CTX_use_PrivateKey_file( m_ctx, cfg.tls_key.c_str(), SSL_FILETYPE_PEM ) != 1
+            || SSL_CTX_check_private_key( m_ctx ) != 1 ){
+        print_ssl_error( cfg.tls_key.c_str() );
+        return false;
+    }
+    SSL_CTX_set_alpn_select_cb( m_ctx, select_alpn, NULL );
+
+    //session ticket的密钥在SSL_CTX_new时随机生成，fork出来的worker都用这一组
+    static const unsigned char sid_ctx[] = "HTTPWebServer";
+    SSL_CTX_set_session_id_context( m_ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+    if( cfg.tls_cache > 0 ){
+        void* p = mmap( NULL, sizeof( cache_slot ) * cfg.tls_cache, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        if( p == MAP_FAILED ){
+            printf( "tls: cannot map session cache, errno is: %d\n", errno );
+            return false;
+        }
+        g_slots = ( cache_slot* )p;
+        g_slot_count = cfg.tls_cache;
+        //进程内部的缓存不能跨worker，只使用共享缓存
+        SSL_CTX_set_session_cache_mode( m_ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL );
+        SSL_CTX_sess_set_new_cb( m_ctx, cache_new );
+        SSL_CTX_sess_set_get_cb( m_ctx, cache_get );
+        SSL_CTX_sess_set_remove_cb( m_ctx, cache_remove );
+    }else{
+        SSL_CTX_set_session_cache_mode( m_ctx, SSL_SESS_CACHE_OFF );
+    }
+    return true;
+}
+
+SSL* tls_context::accept( int fd ){
+    SSL* ssl = SSL_new( m_ctx );
+    if( !ssl ){
+        ERR_clear_error();
+        return NULL;
+    }
+    if( SSL_set_fd( ssl, fd ) != 1 ){
+        ERR_clear_error();
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+void conn_io::reset(){
+    if( ssl ){
+        //只尝试一次，不等对方的close_notify
+        ERR_clear_error();
+        if( SSL_is_init_finished( ssl ) ){
+            SSL_shutdown( ssl );
+        }
+        SSL_free( ssl );
+        ERR_clear_error();
+        ssl = 0;
+    }
+    ktls_send = false;
+    fd = -1;
+}
+
+conn_io::HANDSHAKE conn_io::handshake(){
+    ERR_clear_error();
+    int ret = SSL_do_handshake( ssl );
+    if( ret == 1 ){
+        ktls_send = BIO_get_ktls_send( SSL_get_wbio( ssl ) );
+        stats_add( g_stats->tls_handshakes, 1 );
+        if( SSL_session_reused( ssl ) ){
+            stats_add( g_stats->tls_resumed, 1 );
+        }
+        if( ktls_send ){
+            stats_add( g_stats->ktls_send, 1 );
+        }
+        return HANDSHAKE_DONE;
+    }
+    switch( SSL_get_error( ssl, ret ) ){
+        case SSL_ERROR_WANT_READ: return HANDSHAKE_WANT_READ;
+        case SSL_ERROR_WANT_WRITE: return HANDSHAKE_WANT_WRITE;
+        default:{
+            ERR_clear_error();
+            return HANDSHAKE_FAILED;
+        }
+    }
+}
+
+//把SSL_get_error的结果换成recv/send的约定
+static ssize_t io_error( SSL* ssl, int ret ){
+    switch( SSL_get_error( ssl, ret ) ){
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:{
+            errno = EAGAIN;
+            return -1;
+        }
+        case SSL_ERROR_ZERO_RETURN:{
+            return 0;
+        }
+        case SSL_ERROR_SYSCALL:{
+            //对方没有发close_notify就关闭了连接
+            if( ERR_peek_error() == 0 && errno == 0 ){
+                return 0;
+            }
+        }
+        //fall through
+        default:{
+            ERR_clear_error();
+            if( errno == 0 || errno == EAGAIN || errno == EWOULDBLOCK ){
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+}
+
+ssize_t conn_io::recv( void* buf, size_t len ){
+    if( !ssl ){
+        return ::recv( fd, buf, len, 0 );
+    }
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read( ssl, buf, len > INT32_MAX ? INT32_MAX : len );
+    return ret > 0 ? ret : io_error( ssl, ret );
+}
+
+ssize_t conn_io::send( const void* buf, size_t len ){
+    if( !ssl || ktls_send ){
+        return ::send( fd, buf, len, MSG_NOSIGNAL );
+    }
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write( ssl, buf, len > INT32_MAX ? INT32_MAX : len );
+    return ret > 0 ? ret : io_error( ssl, ret );
+}
+
+ssize_t conn_io::writev( const struct iovec* iov, int count, bool more ){
+    if( !ssl || ktls_send ){
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = ( struct iovec* )iov;
+        msg.msg_iovlen = count;
+        return ::sendmsg( fd, &msg, MSG_NOSIGNAL | ( more ? MSG_MORE : 0 ) );
+    }
+    //第一段已经够一个记录时不用拷贝
+    int first = 0;
+    while( first < count && iov[ first ].iov_len == 0 ){
+        ++first;
+    }
+    if( first == count ){
+        return 0;
+    }
+    if( iov[ first ].iov_len >= (size_t)RECORD_SIZE || first == count - 1 ){
+        return send( iov[ first ].iov_base, iov[ first ].iov_len );
+    }
+    char buf[ RECORD_SIZE ];
+    size_t len = 0;
+    for( int i = first; i < count && len < sizeof( buf ); ++i ){
+        size_t n = iov[i].iov_len;
+        if( n > sizeof( buf ) - len ){
+            n = sizeof( buf ) - len;
+        }
+        memcpy( buf + len, iov[i].iov_base, n );
+        len += n;
+    }
+    return send( buf, len );
+}
+
+void conn_io::cork( bool on ){
+    int v = on ? 1 : 0;
+    setsockopt( fd, IPPROTO_TCP, TCP_CORK, &v, sizeof( v ) );
+}
+
+bool conn_io::pending() const {
+    return ssl && SSL_pending( ssl ) > 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+#include "../config/config.h"
+
+//第二个监听端口上的TLS：OpenSSL负责握手，握手后尽量交给内核TLS（kTLS）加解密
+//
+//SSL_CTX在fork之前创建，所有worker使用同一组session ticket密钥；
+//TLS 1.2按session id恢复时查的是fork之前mmap的共享缓存，连接落在哪个worker都能恢复
+//握手和读写都是非阻塞的，WANT_READ/WANT_WRITE换成epoll上等待的事件
+class tls_context{
+public:
+    tls_context();
+    ~tls_context();
+
+    //加载证书和私钥，创建共享的会话缓存
+    bool init( const server_config& cfg );
+    //为新接受的连接创建SSL对象，失败返回NULL
+    SSL* accept( int fd );
+    bool ktls() const { return m_ktls; }
+
+private:
+    SSL_CTX* m_ctx;
+    bool m_ktls;
+};
+
+//一个连接上的读写，明文连接直接读写socket，TLS连接经过OpenSSL
+//出错时和recv/writev一样返回-1并设置errno，等待读写时errno为EAGAIN，调用的地方不用区分
+struct conn_io{
+    enum HANDSHAKE { HANDSHAKE_DONE = 0, HANDSHAKE_WANT_READ, HANDSHAKE_WANT_WRITE, HANDSHAKE_FAILED };
+
+    int fd;
+    //明文连接为NULL
+    SSL* ssl;
+    //内核TLS接管了发送，加密在内核中完成，可以直接writev到socket
+    bool ktls_send;
+
+    conn_io() : fd( -1 ), ssl( 0 ), ktls_send( false ) {}
+    //关闭连接前释放SSL对象，尽量发出close_notify
+    void reset();
+
+    //继续非阻塞握手
+    HANDSHAKE handshake();
+    ssize_t recv( void* buf, size_t len );
+    ssize_t send( const void* buf, size_t len );
+    //没有kTLS时把开头最多一个TLS记录大小的数据拷到一起再加密，小的片段不会各占一个记录
+    //返回EAGAIN后下一次必须从同样的数据开始写（OpenSSL要重发已经加密的记录）
+    //more表示后面马上还有数据，明文和kTLS连接带上MSG_MORE，不足一个报文段的尾部先不发出
+    ssize_t writev( const struct iovec* iov, int count, bool more = false );
+    //TCP_CORK：打开期间只发送满的报文段，关闭时把剩下的一起发出
+    void cork( bool on );
+    //OpenSSL中已经解密、还没有读出来的数据，epoll不会再为它们通知
+    bool pending() const;
+};
+
+#endif
@@ -0,0 +1,223 @@
+//离线打包工具：把doc_root目录打包成服务器可以直接mmap的单个文件
+//用法：bundle_pack doc_root output
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "../bundle/bundle_format.h"
+#include "../bundle/mime.h"
+
+struct pack_file{
+    std::string path;//以/开头的url路径
+    std::string full;//磁盘上的路径
+    struct stat st;
+};
+
+static bool by_path( const pack_file& a, const pack_file& b ){
+    return a.path < b.path;
+}
+
+//递归收集普通文件，跳过隐藏文件
+static void collect( const std::string& root, const std::string& rel, std::vector< pack_file >& files ){
+    std::string dir = root + rel;
+    DIR* d = opendir( dir.c_str() );
+    if( !d ){
+        fprintf( stderr, "cannot open %s\n", dir.c_str() );
+        return;
+    }
+    struct dirent* ent;
+    while( ( ent = readdir( d ) ) != NULL ){
+        if( ent->d_name[0] == '.' ){
+            continue;
+        }
+        pack_file f;
+        f.path = rel + "/" + ent->d_name;
+        f.full = root + f.path;
+        if( stat( f.full.c_str(), &f.st ) < 0 ){
+            continue;
+        }
+        if( S_ISDIR( f.st.st_mode ) ){
+            collect( root, f.path, files );
+        }else if( S_ISREG( f.st.st_mode ) && ( f.st.st_mode & S_IROTH ) ){
+            //和服务器一样，只打包other可读的文件
+            files.push_back( f );
+        }
+    }
+    closedir( d );
+}
+
+static bool read_file( const std::string& path, std::string& out ){
+    FILE* fp = fopen( path.c_str(), "rb" );
+    if( !fp ){
+        return false;
+    }
+    char buf[ 65536 ];
+    size_t n;
+    out.clear();
+    while( ( n = fread( buf, 1, sizeof( buf ), fp ) ) > 0 ){
+        out.append( buf, n );
+    }
+    bool ok = !ferror( fp );
+    fclose( fp );
+    return ok;
+}
+
+//gzip格式压缩（windowBits 15+16）
+static bool gzip( const std::string& in, std::string& out ){
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    if( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK ){
+        return false;
+    }
+    out.resize( deflateBound( &zs, in.size() ) + 32 );
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate( &zs, Z_FINISH );
+    out.resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END;
+}
+
+//FNV-1a 64位，作为内容的校验值
+static uint64_t fnv1a( const std::string& data ){
+    uint64_t h = 1469598103934665603ULL;
+    for( size_t i = 0; i < data.size(); ++i ){
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t align_up( uint64_t v ){
+    return ( v + BUNDLE_ALIGN - 1 ) & ~(uint64_t)( BUNDLE_ALIGN - 1 );
+}
+
+static bool write_at( int fd, const void* buf, size_t len, uint64_t offset ){
+    const char* p = (const char*)buf;
+    while( len > 0 ){
+        ssize_t n = pwrite( fd, p, len, offset );
+        if( n <= 0 ){
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+int main( int argc, char* argv[] ){
+    if( argc != 3 ){
+        fprintf( stderr, "usage: %s doc_root output\n", argv[0] );
+        return 1;
+    }
+    std::string root = argv[1];
+    while( root.size() > 1 && root[ root.size() - 1 ] == '/' ){
+        root.erase( root.size() - 1 );
+    }
+    std::vector< pack_file > files;
+    collect( root, "", files );
+    std::sort( files.begin(), files.end(), by_path );
+
+    //字符串表：所有路径和mime类型
+    std::string strings;
+    std::vector< bundle_entry > index( files.size() );
+    for( size_t i = 0; i < files.size(); ++i ){
+        bundle_entry& e = index[i];
+        memset( &e, 0, sizeof( e ) );
+        e.path_offset = strings.size();
+        e.path_len = files[i].path.size();
+        strings += files[i].path;
+        strings += '\0';
+        const char* mime = mime_type( files[i].path.c_str() );
+        e.mime_offset = strings.size();
+        e.mime_len = strlen( mime );
+        strings += mime;
+        strings += '\0';
+    }
+
+    bundle_header h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, BUNDLE_MAGIC, sizeof( BUNDLE_MAGIC ) );
+    h.version = BUNDLE_VERSION;
+    h.count = files.size();
+    h.index_offset = sizeof( h );
+    h.strings_offset = h.index_offset + sizeof( bundle_entry ) * files.size();
+    h.strings_size = strings.size();
+
+    std::string tmp = std::string( argv[2] ) + ".tmp";
+    int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ){
+        fprintf( stderr, "cannot create %s\n", tmp.c_str() );
+        return 1;
+    }
+
+    //数据区按页对齐依次写入
+    uint64_t offset = align_up( h.strings_offset + h.strings_size );
+    uint64_t saved = 0;
+    std::string content;
+    std::string packed;
+    for( size_t i = 0; i < files.size(); ++i ){
+        bundle_entry& e = index[i];
+        if( !read_file( files[i].full, content ) ){
+            fprintf( stderr, "cannot read %s\n", files[i].full.c_str() );
+            close( fd );
+            unlink( tmp.c_str() );
+            return 1;
+        }
+        e.data_offset = offset;
+        e.length = content.size();
+        e.mtime = files[i].st.st_mtime;
+        snprintf( e.etag, sizeof( e.etag ), "\"%016llx\"", (unsigned long long)fnv1a( content ) );
+        if( !write_at( fd, content.data(), content.size(), offset ) ){
+            fprintf( stderr, "write failed\n" );
+            close( fd );
+            unlink( tmp.c_str() );
+            return 1;
+        }
+        offset = align_up( offset + content.size() );
+
+        //压缩后至少小八分之一才保留gzip版本
+        if( content.size() > 256 && mime_compressible( mime_type( files[i].path.c_str() ) )
+                && gzip( content, packed ) && packed.size() < content.size() - content.size() / 8 ){
+            e.gzip_offset = offset;
+            e.gzip_length = packed.size();
+            saved += content.size() - packed.size();
+            if( !write_at( fd, packed.data(), packed.size(), offset ) ){
+                fprintf( stderr, "write failed\n" );
+                close( fd );
+                unlink( tmp.c_str() );
+                return 1;
+            }
+            offset = align_up( offset + packed.size() );
+        }
+        printf( "%s %llu%s\n", files[i].path.c_str(), (unsigned long long)e.length, e.gzip_length ? " +gzip" : "" );
+    }
+    h.file_size = offset;
+
+    bool ok = write_at( fd, &h, sizeof( h ), 0 )
+        && ( index.empty() || write_at( fd, &index[0], sizeof( bundle_entry ) * index.size(), h.index_offset ) )
+        && write_at( fd, strings.data(), strings.size(), h.strings_offset )
+        && ftruncate( fd, offset ) == 0
+        && fsync( fd ) == 0;
+    close( fd );
+    //先写临时文件再rename，正在运行的服务器不会看到写了一半的文件
+    if( !ok || rename( tmp.c_str(), argv[2] ) != 0 ){
+        fprintf( stderr, "cannot write %s\n", argv[2] );
+        unlink( tmp.c_str() );
+        return 1;
+    }
+    printf( "packed %d files, %llu bytes, gzip saved %llu bytes\n", (int)files.size(),
+            (unsigned long long)offset, (unsigned long long)saved );
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "upload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <new>
+
+//每次从socket搬到管道的字节数，不超过管道默认的容量
+static const size_t PIPE_CHUNK = 65536;
+//不能splice时每次拷贝的缓冲区
+static const size_t COPY_SIZE = 16384;
+
+//单个请求和所有worker的上限，0表示不限制
+static long long g_max = 0;
+static long long g_total = 0;
+static bool g_sync = true;
+//fork之前mmap，所有worker共享的已预留字节数
+static std::atomic< long long >* g_reserved = 0;
+
+bool upload_session::init( const server_config& cfg ){
+    g_max = (long long)cfg.upload_max_mb << 20;
+    g_total = (long long)cfg.upload_total_mb << 20;
+    g_sync = cfg.upload_sync;
+    void* p = mmap( NULL, sizeof( std::atomic< long long > ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( p == MAP_FAILED ){
+        printf( "cannot map upload budget\n" );
+        return false;
+    }
+    g_reserved = new( p ) std::atomic< long long >( 0 );
+    return true;
+}
+
+upload_session::upload_session(): m_fd( -1 ), m_left( 0 ), m_reserved( 0 ), m_copy( false ){
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+upload_session::~upload_session(){
+    abort();
+}
+
+upload_session::START upload_session::start( const char* dir, const char* name, off_t length ){
+    if( g_max > 0 && length > g_max ){
+        return START_TOO_LARGE;
+    }
+    if( g_total > 0 && g_reserved ){
+        if( g_reserved->fetch_add( length ) + length > g_total ){
+            g_reserved->fetch_sub( length );
+            return START_NO_BUDGET;
+        }
+        m_reserved = length;
+    }
+
+    //临时文件和目标文件在同一个目录中，rename才是原子的
+    m_path = dir;
+    m_path += '/';
+    m_path += name;
+    std::string temp = std::string( dir ) + "/.upload.XXXXXX";
+    m_fd = mkostemp( &temp[0], O_CLOEXEC );
+    if( m_fd < 0 ){
+        return START_FAILED;
+    }
+    m_temp = temp;
+    //和doc_root中的文件一样，other可读
+    fchmod( m_fd, 0644 );
+    //预先分配空间，磁盘不够时立即失败，文件也不会被追加写碎
+    if( length > 0 && fallocate( m_fd, 0, 0, length ) < 0 && errno == ENOSPC ){
+        return START_NO_BUDGET;
+    }
+    if( pipe2( m_pipe, O_NONBLOCK | O_CLOEXEC ) < 0 ){
+        m_pipe[0] = m_pipe[1] = -1;
+        m_copy = true;
+    }
+    m_left = length;
+    return START_OK;
+}
+
+bool upload_session::write( const char* data, size_t len ){
+    if( !write_all( data, len ) ){
+        return false;
+    }
+    m_left -= len;
+    return true;
+}
+
+bool upload_session::write_all( const char* data, size_t len ){
+    while( len > 0 ){
+        ssize_t n = ::write( m_fd, data, len );
+        if( n < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+upload_session::STATUS upload_session::receive( conn_io& io ){
+    //TLS连接上socket中是密文，只能经过OpenSSL解密
+    if( io.ssl ){
+        m_copy = true;
+    }
+    char buf[ COPY_SIZE ];
+    while( m_left > 0 ){
+        size_t want;
+        ssize_t n;
+        if( !m_copy ){
+            want = m_left < (off_t)PIPE_CHUNK ? m_left : PIPE_CHUNK;
+            n = splice( io.fd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if( n > 0 ){
+                if( !drain( n ) ){
+                    return UPLOAD_FAILED;
+                }
+                m_left -= n;
+                continue;
+            }
+            if( n < 0 && errno == EINVAL ){
+                m_copy = true;
+                continue;
+            }
+        }else{
+            want = m_left < (off_t)COPY_SIZE ? m_left : COPY_SIZE;
+            n = io.recv( buf, want );
+            if( n > 0 ){
+                if( !write( buf, n ) ){
+                    return UPLOAD_FAILED;
+                }
+                continue;
+            }
+        }
+        if( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+            return UPLOAD_MORE;
+        }
+        //对方在消息体收齐之前关闭了连接
+        return UPLOAD_FAILED;
+    }
+    return UPLOAD_DONE;
+}
+
+bool upload_session::drain( size_t n ){
+    while( n > 0 ){
+        ssize_t m = -1;
+        if( !m_copy ){
+            m = splice( m_pipe[0], NULL, m_fd, NULL, n, SPLICE_F_MOVE );
+            if( m < 0 && errno == EINVAL ){
+                //文件系统不支持splice，管道中剩下的数据读出来再写
+                m_copy = true;
+                continue;
+            }
+        }else{
+            char buf[ COPY_SIZE ];
+            m = read( m_pipe[0], buf, n < COPY_SIZE ? n : COPY_SIZE );
+            if( m > 0 && !write_all( buf, m ) ){
+                return false;
+            }
+        }
+        if( m > 0 ){
+            n -= m;
+        }else if( m < 0 && errno == EINTR ){
+            continue;
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+bool upload_session::commit( bool* replaced ){
+    if( m_fd < 0 || m_left != 0 ){
+        return false;
+    }
+    if( g_sync && fdatasync( m_fd ) < 0 ){
+        return false;
+    }
+    close( m_fd );
+    m_fd = -1;
+    *replaced = access( m_path.c_str(), F_OK ) == 0;
+    if( rename( m_temp.c_str(), m_path.c_str() ) < 0 ){
+        return false;
+    }
+    m_temp.clear();
+    return true;
+}
+
+void upload_session::abort(){
+    if( m_fd >= 0 ){
+        close( m_fd );
+        m_fd = -1;
+    }
+    if( !m_temp.empty() ){
+        unlink( m_temp.c_str() );
+        m_temp.clear();
+    }
+    if( m_pipe[0] >= 0 ){
+        close( m_pipe[0] );
+        close( m_pipe[1] );
+        m_pipe[0] = m_pipe[1] = -1;
+    }
+    if( m_reserved > 0 ){
+        g_reserved->fetch_sub( m_reserved );
+        m_reserved = 0;
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <sys/types.h>
+#include <string>
+#include "../config/config.h"
+#include "../tls/tls.h"
+
+//upload路由上的PUT/POST：消息体边收边写到目标目录中的临时文件，收齐后rename成目标文件
+//明文连接用splice把数据从socket经过管道搬到文件，不经过用户态缓冲区；
+//TLS连接的数据要先解密，只能用一个固定大小的缓冲区recv再write
+//内存占用和上传大小、并发上传数无关，只有管道和每次拷贝的缓冲区
+//
+//每个请求的消息体不能超过upload_max_mb；所有worker正在上传的总字节数不超过upload_total_mb，
+//开始上传时按Content-Length预留，结束或放弃时归还
+class upload_session{
+public:
+    enum START { START_OK = 0, START_TOO_LARGE, START_NO_BUDGET, START_FAILED };
+    enum STATUS { UPLOAD_MORE = 0, UPLOAD_DONE, UPLOAD_FAILED };
+
+    //fork之前调用，创建所有worker共享的预留计数
+    static bool init( const server_config& cfg );
+
+    upload_session();
+    //没有提交的上传删除临时文件
+    ~upload_session();
+
+    //在dir中创建临时文件，收齐length字节后成为dir/name
+    START start( const char* dir, const char* name, off_t length );
+    //HTTP/1.1解析时已经读进来的消息体
+    bool write( const char* data, size_t len );
+    //读到EAGAIN或者收齐为止
+    STATUS receive( conn_io& io );
+    //写完后原子地替换目标文件，replaced表示覆盖了已有的文件
+    bool commit( bool* replaced );
+    off_t left() const { return m_left; }
+
+private:
+    bool write_all( const char* data, size_t len );
+    //管道中的n字节写到文件
+    bool drain( size_t n );
+    void abort();
+
+    int m_fd;
+    int m_pipe[2];
+    std::string m_temp;
+    std::string m_path;
+    //还没有收到的字节数和预留的字节数
+    off_t m_left;
+    off_t m_reserved;
+    //socket或文件系统不支持splice，改为recv/write
+    bool m_copy;
+};
+
+#endif
@@ -0,0 +1,1062 @@
+#include "proxy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../listen/listener.h"
+
+//FastCGI记录类型，见FastCGI规范
+enum {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7
+};
+static const int FCGI_RESPONDER = 1;
+static const int FCGI_KEEP_CONN = 1;
+static const int FCGI_HEADER_LEN = 8;
+//CGI响应头的最大长度
+static const int CGI_HEAD_MAX = 4096;
+
+//chunked消息体的扫描状态
+enum {
+    CH_SIZE = 0, CH_EXT, CH_SIZE_LF, CH_DATA, CH_DATA_CR, CH_DATA_LF,
+    CH_TRAILER, CH_TRAILER_LINE, CH_END_LF, CH_DONE
+};
+
+//同一个连接上同时只有一个请求，请求id固定为1
+static void fcgi_header( char* p, int type, int len ){
+    p[0] = 1;
+    p[1] = type;
+    p[2] = 0;
+    p[3] = 1;
+    p[4] = ( len >> 8 ) & 0xff;
+    p[5] = len & 0xff;
+    p[6] = 0;
+    p[7] = 0;
+}
+
+static void fcgi_length( std::string& out, size_t len ){
+    if( len < 128 ){
+        out += (char)len;
+    }else{
+        out += (char)( ( len >> 24 ) | 0x80 );
+        out += (char)( len >> 16 );
+        out += (char)( len >> 8 );
+        out += (char)len;
+    }
+}
+
+static void fcgi_param( std::string& out, const char* name, const char* value ){
+    size_t name_len = strlen( name );
+    size_t value_len = strlen( value );
+    fcgi_length( out, name_len );
+    fcgi_length( out, value_len );
+    out.append( name, name_len );
+    out.append( value, value_len );
+}
+
+//逐跳的请求头不转发给上游，Content-Length由代理重新生成
+//路由用的是解码、规范化之后的路径，转发前重新编码
+//keep之外的字符、空白、控制字符和非ASCII字节都写成%XX，上游看到的请求行和路由的路径一致
+static void append_encoded( std::string& out, const char* text, const char* keep ){
+    static const char hex[] = "0123456789ABCDEF";
+    for( const unsigned char* p = (const unsigned char*)text; *p; ++p ){
+        if( isalnum( *p ) || ( *p > 0x20 && *p < 0x7f && strchr( keep, *p ) ) ){
+            out += (char)*p;
+        }else{
+            out += '%';
+            out += hex[ *p >> 4 ];
+            out += hex[ *p & 15 ];
+        }
+    }
+}
+
+static bool hop_by_hop( const char* name ){
+    static const char* names[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+        "Trailer", "Content-Length" };
+    for( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i ){
+        if( strcasecmp( name, names[i] ) == 0 ){
+            return true;
+        }
+    }
+    return false;
+}
+
+proxy_session::proxy_session( upstream_group* g, conn_io* client ):
+    m_group( g ), m_pool( 0 ), m_io( client ), m_client( client->fd ), m_up( -1 ), m_server( -1 ),
+    m_reused( false ), m_connecting( false ), m_attempts( 0 ), m_head( false ), m_http10( false ), m_idempotent( false ),
+    m_cl_readable( true ), m_cl_writable( true ), m_up_readable( false ), m_up_writable( false ),
+    m_out_len( 0 ), m_out_sent( 0 ), m_replayable( true ), m_body_left( 0 ),
+    m_in_len( 0 ), m_got_response( false ), m_up_eof( false ),
+    m_cl_len( 0 ), m_cl_sent( 0 ), m_cl_preamble( 0 ), m_cl_produced( 0 ), m_cl_total( 0 ),
+    m_rstate( R_HEAD ), m_resp_left( 0 ), m_chunk_state( CH_SIZE ), m_chunk_left( 0 ),
+    m_up_keep( false ), m_client_keep( false ),
+    m_rec_open( false ), m_rec_type( 0 ), m_rec_left( 0 ), m_rec_pad( 0 ), m_fcgi_end( false ),
+    m_cgi_head_done( false ), m_cgi_chunked( false ), m_discard( false ),
+    m_deadline( 0 ), m_prev( 0 ), m_next( 0 ){
+    m_out = new char[ BUFFER_SIZE ];
+    m_in = new char[ BUFFER_SIZE ];
+    m_cl = new char[ BUFFER_SIZE ];
+}
+
+proxy_session::~proxy_session(){
+    if( m_up >= 0 ){
+        release_upstream( false );
+    }
+    if( m_pool ){
+        m_pool->untrack( this );
+    }
+    delete [] m_out;
+    delete [] m_in;
+    delete [] m_cl;
+}
+
+bool proxy_session::out_append( const char* data, int len ){
+    if( len > BUFFER_SIZE - m_out_len ){
+        return false;
+    }
+    memcpy( m_out + m_out_len, data, len );
+    m_out_len += len;
+    return true;
+}
+
+bool proxy_session::out_printf( const char* format, ... ){
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( m_out + m_out_len, BUFFER_SIZE - m_out_len, format, arg_list );
+    va_end( arg_list );
+    if( len < 0 || len >= BUFFER_SIZE - m_out_len ){
+        return false;
+    }
+    m_out_len += len;
+    return true;
+}
+
+//发给客户的缓冲区，已经发送的部分移走，返回剩余空间
+int proxy_session::cl_space(){
+    if( m_cl_sent > 0 ){
+        memmove( m_cl, m_cl + m_cl_sent, m_cl_len - m_cl_sent );
+        m_cl_len -= m_cl_sent;
+        m_cl_sent = 0;
+    }
+    return BUFFER_SIZE - m_cl_len;
+}
+
+bool proxy_session::cl_append( const char* data, int len ){
+    if( len > cl_space() ){
+        return false;
+    }
+    memcpy( m_cl + m_cl_len, data, len );
+    m_cl_len += len;
+    m_cl_produced += len;
+    return true;
+}
+
+bool proxy_session::cl_printf( const char* format, ... ){
+    char buf[ 512 ];
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( buf, sizeof( buf ), format, arg_list );
+    va_end( arg_list );
+    if( len < 0 || len >= (int)sizeof( buf ) ){
+        return false;
+    }
+    return cl_append( buf, len );
+}
+
+void proxy_session::consume_in( int len ){
+    memmove( m_in, m_in + len, m_in_len - len );
+    m_in_len -= len;
+}
+
+bool proxy_session::prepare( const proxy_request& req ){
+    bool fastcgi = m_group->proto == UPSTREAM_FASTCGI;
+    m_head = req.head;
+    m_http10 = req.http10;
+    m_idempotent = strcmp( req.method, "POST" ) != 0 && strcmp( req.method, "PATCH" ) != 0;
+    m_client_keep = req.keep_alive;
+    m_up_keep = fastcgi;
+    int body_len = req.body_len < req.content_length ? req.body_len : req.content_length;
+    m_body_left = req.content_length - body_len;
+
+    char peer[ INET6_ADDRSTRLEN ];
+    peer_text( req.peer, peer, sizeof( peer ) );
+
+    //请求目标：路径中的?和#也要编码，查询串保持原样，只编码不能出现在请求行中的字节
+    std::string uri;
+    append_encoded( uri, req.path, "-._~!$&'()*+,;=:@/" );
+    if( req.query ){
+        uri += '?';
+        append_encoded( uri, req.query, "-._~!$&'()*+,;=:@/?%[]" );
+    }
+
+    std::string params;
+    bool expect_continue = false;
+    bool has_host = false;
+    const char* forwarded = 0;
+    const char* content_type = "";
+    if( fastcgi ){
+        char begin[ FCGI_HEADER_LEN + 8 ] = { 0 };
+        fcgi_header( begin, FCGI_BEGIN_REQUEST, 8 );
+        begin[ FCGI_HEADER_LEN + 1 ] = FCGI_RESPONDER;
+        begin[ FCGI_HEADER_LEN + 2 ] = FCGI_KEEP_CONN;
+        out_append( begin, sizeof( begin ) );
+    }else if( !out_printf( "%s %s HTTP/1.%d\r\n", req.method, uri.c_str(), m_http10 ? 0 : 1 ) ){
+        return false;
+    }
+
+    //逐行转发请求头
+    const char* p = req.headers;
+    const char* end = req.headers + req.headers_len;
+    while( p < end && *p ){
+        const char* line = p;
+        size_t line_len = strlen( line );
+        p += line_len + 2;
+        const char* colon = strchr( line, ':' );
+        if( !colon || colon == line || colon - line >= 64 ){
+            continue;
+        }
+        char name[ 64 ];
+        memcpy( name, line, colon - line );
+        name[ colon - line ] = '\0';
+        const char* value = colon + 1;
+        value += strspn( value, " \t" );
+
+        if( hop_by_hop( name ) ){
+            continue;
+        }
+        //带chunked消息体的请求不支持
+        if( strcasecmp( name, "Transfer-Encoding" ) == 0 ){
+            return false;
+        }
+        //100 Continue由代理自己回复
+        if( strcasecmp( name, "Expect" ) == 0 ){
+            expect_continue = strcasecmp( value, "100-continue" ) == 0;
+            continue;
+        }
+        if( strcasecmp( name, "Host" ) == 0 ){
+            has_host = true;
+        }
+        //协议由代理按客户连接填写，不相信客户自己带的
+        if( strcasecmp( name, "X-Forwarded-Proto" ) == 0 ){
+            continue;
+        }
+        if( fastcgi ){
+            if( strcasecmp( name, "Content-Type" ) == 0 ){
+                content_type = value;
+                continue;
+            }
+            //其他请求头按CGI的规则转为HTTP_XXX
+            char key[ 5 + 64 ] = "HTTP_";
+            for( size_t i = 0; name[i]; ++i ){
+                key[ 5 + i ] = name[i] == '-' ? '_' : toupper( (unsigned char)name[i] );
+                key[ 6 + i ] = '\0';
+            }
+            fcgi_param( params, key, value );
+        }else if( strcasecmp( name, "X-Forwarded-For" ) == 0 ){
+            forwarded = value;
+        }else if( !out_printf( "%s: %s\r\n", name, value ) ){
+            return false;
+        }
+    }
+
+    if( fastcgi ){
+        char number[ 32 ];
+        std::string script = std::string( req.doc_root ) + req.path;
+        fcgi_param( params, "GATEWAY_INTERFACE", "CGI/1.1" );
+        fcgi_param( params, "SERVER_PROTOCOL", m_http10 ? "HTTP/1.0" : "HTTP/1.1" );
+        fcgi_param( params, "REQUEST_METHOD", req.method );
+        fcgi_param( params, "REQUEST_URI", uri.c_str() );
+        fcgi_param( params, "DOCUMENT_URI", req.path );
+        fcgi_param( params, "SCRIPT_NAME", req.path );
+        fcgi_param( params, "SCRIPT_FILENAME", script.c_str() );
+        fcgi_param( params, "DOCUMENT_ROOT", req.doc_root );
+        fcgi_param( params, "QUERY_STRING", req.query ? req.query : "" );
+        fcgi_param( params, "REMOTE_ADDR", peer );
+        if( req.tls ){
+            fcgi_param( params, "HTTPS", "on" );
+        }
+        snprintf( number, sizeof( number ), "%d", peer_port( req.peer ) );
+        fcgi_param( params, "REMOTE_PORT", number );
+        snprintf( number, sizeof( number ), "%ld", req.content_length );
+        fcgi_param( params, "CONTENT_LENGTH", req.content_length > 0 ? number : "" );
+        fcgi_param( params, "CONTENT_TYPE", content_type );
+        //参数一次放进一个PARAMS记录，再用一个空记录表示结束
+        char header[ FCGI_HEADER_LEN ];
+        if( params.size() > 65535 || (int)params.size() + 4 * FCGI_HEADER_LEN + body_len > BUFFER_SIZE - m_out_len ){
+            return false;
+        }
+        fcgi_header( header, FCGI_PARAMS, params.size() );
+        out_append( header, FCGI_HEADER_LEN );
+        out_append( params.data(), params.size() );
+        fcgi_header( header, FCGI_PARAMS, 0 );
+        out_append( header, FCGI_HEADER_LEN );
+        if( body_len > 0 ){
+            fcgi_header( header, FCGI_STDIN, body_len );
+            out_append( header, FCGI_HEADER_LEN );
+            out_append( req.body, body_len );
+        }
+        if( m_body_left == 0 ){
+            fcgi_header( header, FCGI_STDIN, 0 );
+            out_append( header, FCGI_HEADER_LEN );
+        }
+    }else{
+        if( !has_host && !out_printf( "Host: %s\r\n", m_group->name.c_str() ) ){
+            return false;
+        }
+        bool ok = forwarded ? out_printf( "X-Forwarded-For: %s, %s\r\n", forwarded, peer )
+                            : out_printf( "X-Forwarded-For: %s\r\n", peer );
+        if( !ok || !out_printf( "X-Forwarded-Proto: %s\r\n", req.tls ? "https" : "http" ) ){
+            return false;
+        }
+        if( ( req.content_length > 0 || !m_idempotent ) && !out_printf( "Content-Length: %ld\r\n", req.content_length ) ){
+            return false;
+        }
+        if( !out_printf( "Connection: keep-alive\r\n\r\n" ) || !out_append( req.body, body_len ) ){
+            return false;
+        }
+    }
+
+    if( expect_continue && m_body_left > 0 && !m_http10 ){
+        static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        cl_append( continue_100, sizeof( continue_100 ) - 1 );
+        m_cl_preamble = m_cl_len;
+    }
+    return true;
+}
+
+proxy_session::STATUS proxy_session::start( upstream_pool* pool ){
+    m_pool = pool;
+    m_pool->track( this );
+    m_deadline = upstream_now_ms() + m_group->timeout_ms;
+    STATUS st = connect_next();
+    if( st != PROXY_CONTINUE ){
+        return st;
+    }
+    return pump();
+}
+
+//依次尝试下一个地址，直到有一个可以建立连接
+proxy_session::STATUS proxy_session::connect_next(){
+    while( true ){
+        if( m_attempts > (int)m_group->servers.size() ){
+            return PROXY_BAD_GATEWAY;
+        }
+        bool saturated = false;
+        int index = m_group->acquire( m_server, &saturated );
+        if( index < 0 ){
+            return ( saturated && m_attempts == 0 ) ? PROXY_UNAVAILABLE : PROXY_BAD_GATEWAY;
+        }
+        ++m_attempts;
+        m_server = index;
+        int fd = m_pool->connect( m_group, index, &m_reused, &m_connecting );
+        if( fd < 0 ){
+            m_group->release( index );
+            m_group->mark_failed( index );
+            continue;
+        }
+        m_up = fd;
+        m_up_readable = false;
+        m_up_writable = !m_connecting;
+        m_up_eof = false;
+        m_pool->attach( fd, this );
+        return PROXY_CONTINUE;
+    }
+}
+
+void proxy_session::release_upstream( bool keep ){
+    m_pool->release( m_group, m_server, m_up, keep );
+    m_group->release( m_server );
+    m_up = -1;
+    m_connecting = false;
+}
+
+//还没有收到响应时上游连接失败：请求还完整保存着并且可以安全重发时换一个地址重试
+//复用的长连接可能在空闲时已经被对方关闭，这种失败总是重试，也不算该地址故障
+proxy_session::STATUS proxy_session::upstream_failed( bool connect_error ){
+    bool reused = m_reused;
+    release_upstream( false );
+    if( !reused ){
+        m_group->mark_failed( m_server );
+    }
+    if( m_got_response || !m_replayable || !( connect_error || reused || m_idempotent ) ){
+        return responded() ? PROXY_ABORT : PROXY_BAD_GATEWAY;
+    }
+    m_out_sent = 0;
+    return connect_next();
+}
+
+proxy_session::STATUS proxy_session::upstream_eof(){
+    if( m_rstate == R_UNTIL_CLOSE ){
+        m_up_eof = true;
+        m_up_keep = false;
+        return PROXY_CONTINUE;
+    }
+    if( !m_got_response ){
+        return upstream_failed( false );
+    }
+    return responded() ? PROXY_ABORT : PROXY_BAD_GATEWAY;
+}
+
+proxy_session::STATUS proxy_session::on_event( int fd, uint32_t events ){
+    if( fd == m_client ){
+        if( events & EPOLLIN ){
+            m_cl_readable = true;
+        }
+        if( events & EPOLLOUT ){
+            m_cl_writable = true;
+        }
+    }else if( fd == m_up ){
+        if( m_connecting ){
+            //非阻塞connect完成，检查是否成功
+            int err = 0;
+            socklen_t len = sizeof( err );
+            if( getsockopt( m_up, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 ){
+                err = errno;
+            }
+            if( err != 0 ){
+                STATUS st = upstream_failed( true );
+                return st != PROXY_CONTINUE ? st : pump();
+            }
+            if( !( events & EPOLLOUT ) ){
+                return PROXY_CONTINUE;
+            }
+            m_connecting = false;
+        }
+        if( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ){
+            m_up_readable = true;
+        }
+        if( events & EPOLLOUT ){
+            m_up_writable = true;
+        }
+    }
+    m_deadline = upstream_now_ms() + m_group->timeout_ms;
+    return pump();
+}
+
+proxy_session::STATUS proxy_session::on_timeout(){
+    if( m_up >= 0 ){
+        if( m_connecting ){
+            m_group->mark_failed( m_server );
+        }
+        release_upstream( false );
+    }
+    printf( "upstream %s: timeout\n", m_group->name.c_str() );
+    return responded() ? PROXY_ABORT : PROXY_TIMEOUT;
+}
+
+//在两个方向上搬运数据，直到没有任何一个方向可以继续
+proxy_session::STATUS proxy_session::pump(){
+    bool fastcgi = m_group->proto == UPSTREAM_FASTCGI;
+    while( true ){
+        bool progress = false;
+
+        //客户的消息体 -> 发给上游的缓冲区
+        if( m_body_left > 0 && m_cl_readable ){
+            //FastCGI要留出记录头和最后的空记录
+            int reserve = fastcgi ? 2 * FCGI_HEADER_LEN : 0;
+            if( BUFFER_SIZE - m_out_len - reserve < BUFFER_SIZE / 4 && m_out_sent > 0 ){
+                //丢掉已经发出的部分，之后上游失败就不能再重发了
+                memmove( m_out, m_out + m_out_sent, m_out_len - m_out_sent );
+                m_out_len -= m_out_sent;
+                m_out_sent = 0;
+                m_replayable = false;
+            }
+            long space = BUFFER_SIZE - m_out_len - reserve;
+            if( space > m_body_left ){
+                space = m_body_left;
+            }
+            if( space > 0 ){
+                char* dst = m_out + m_out_len + ( fastcgi ? FCGI_HEADER_LEN : 0 );
+                ssize_t n = m_io->recv( dst, space );
+                if( n > 0 ){
+                    if( fastcgi ){
+                        fcgi_header( m_out + m_out_len, FCGI_STDIN, n );
+                        m_out_len += FCGI_HEADER_LEN;
+                    }
+                    m_out_len += n;
+                    m_body_left -= n;
+                    if( m_body_left == 0 && fastcgi ){
+                        fcgi_header( m_out + m_out_len, FCGI_STDIN, 0 );
+                        m_out_len += FCGI_HEADER_LEN;
+                    }
+                    progress = true;
+                }else if( n == 0 ){
+                    return PROXY_ABORT;
+                }else if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                    m_cl_readable = false;
+                }else{
+                    return PROXY_ABORT;
+                }
+            }
+        }
+
+        //发给上游
+        if( m_up >= 0 && !m_connecting && m_up_writable && m_out_sent < m_out_len ){
+            ssize_t n = send( m_up, m_out + m_out_sent, m_out_len - m_out_sent, MSG_NOSIGNAL );
+            if( n > 0 ){
+                m_out_sent += n;
+                progress = true;
+            }else if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+                m_up_writable = false;
+            }else{
+                STATUS st = upstream_failed( false );
+                if( st != PROXY_CONTINUE ){
+                    return st;
+                }
+                continue;
+            }
+        }
+
+        //从上游读
+        if( m_up >= 0 && !m_connecting && m_up_readable && !m_up_eof && m_in_len < BUFFER_SIZE && m_rstate != R_DONE ){
+            ssize_t n = recv( m_up, m_in + m_in_len, BUFFER_SIZE - m_in_len, 0 );
+            if( n > 0 ){
+                m_in_len += n;
+                m_got_response = true;
+                progress = true;
+            }else if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+                m_up_readable = false;
+            }else{
+                STATUS st = upstream_eof();
+                if( st != PROXY_CONTINUE ){
+                    return st;
+                }
+                progress = true;
+            }
+        }
+
+        //转换响应
+        if( ( m_in_len > 0 || m_fcgi_end ) && m_rstate != R_DONE ){
+            int in_len = m_in_len;
+            long long produced = m_cl_produced;
+            RESPONSE_STATE state = m_rstate;
+            if( !( fastcgi ? decode_fastcgi() : decode_http() ) ){
+                printf( "upstream %s: bad response\n", m_group->name.c_str() );
+                if( m_up >= 0 ){
+                    release_upstream( false );
+                }
+                return responded() ? PROXY_ABORT : PROXY_BAD_GATEWAY;
+            }
+            if( m_in_len != in_len || m_cl_produced != produced || m_rstate != state ){
+                progress = true;
+            }
+        }
+        if( m_rstate == R_UNTIL_CLOSE && m_up_eof && m_in_len == 0 ){
+            m_rstate = R_DONE;
+        }
+
+        //发给客户
+        if( m_cl_sent < m_cl_len && m_cl_writable ){
+            ssize_t n = m_io->send( m_cl + m_cl_sent, m_cl_len - m_cl_sent );
+            if( n > 0 ){
+                m_cl_sent += n;
+                m_cl_total += n;
+                if( m_cl_sent == m_cl_len ){
+                    m_cl_sent = m_cl_len = 0;
+                }
+                progress = true;
+            }else if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+                m_cl_writable = false;
+            }else{
+                return PROXY_ABORT;
+            }
+        }
+
+        if( m_rstate == R_DONE && m_cl_len == 0 ){
+            //上游还有没读完的数据或者请求没有发完，连接不能复用
+            if( m_up >= 0 ){
+                bool keep = m_up_keep && m_in_len == 0 && m_out_sent == m_out_len && m_body_left == 0;
+                release_upstream( keep );
+            }
+            return PROXY_DONE;
+        }
+        if( !progress ){
+            return PROXY_CONTINUE;
+        }
+    }
+}
+
+//返回消耗的字节数，格式错误返回-1，m_chunk_state为CH_DONE时消息体结束
+long proxy_session::chunk_scan( const char* p, long n ){
+    long i = 0;
+    while( i < n && m_chunk_state != CH_DONE ){
+        char c = p[i];
+        switch( m_chunk_state ){
+            case CH_SIZE:{
+                int v = -1;
+                if( c >= '0' && c <= '9' ){
+                    v = c - '0';
+                }else if( c >= 'a' && c <= 'f' ){
+                    v = c - 'a' + 10;
+                }else if( c >= 'A' && c <= 'F' ){
+                    v = c - 'A' + 10;
+                }
+                if( v >= 0 ){
+                    if( m_chunk_left > ( 1LL << 40 ) ){
+                        return -1;
+                    }
+                    m_chunk_left = m_chunk_left * 16 + v;
+                }else if( c == ';' || c == ' ' || c == '\t' ){
+                    m_chunk_state = CH_EXT;
+                }else if( c == '\r' ){
+                    m_chunk_state = CH_SIZE_LF;
+                }else if( c == '\n' ){
+                    m_chunk_state = m_chunk_left > 0 ? CH_DATA : CH_TRAILER;
+                }else{
+                    return -1;
+                }
+                ++i;
+                break;
+            }
+            case CH_EXT:{
+                if( c == '\n' ){
+                    m_chunk_state = m_chunk_left > 0 ? CH_DATA : CH_TRAILER;
+                }
+                ++i;
+                break;
+            }
+            case CH_SIZE_LF:{
+                if( c != '\n' ){
+                    return -1;
+                }
+                m_chunk_state = m_chunk_left > 0 ? CH_DATA : CH_TRAILER;
+                ++i;
+                break;
+            }
+            case CH_DATA:{
+                long take = n - i;
+                if( take > m_chunk_left ){
+                    take = m_chunk_left;
+                }
+                i += take;
+                m_chunk_left -= take;
+                if( m_chunk_left == 0 ){
+                    m_chunk_state = CH_DATA_CR;
+                }
+                break;
+            }
+            case CH_DATA_CR:{
+                if( c == '\r' ){
+                    m_chunk_state = CH_DATA_LF;
+                }else if( c == '\n' ){
+                    m_chunk_state = CH_SIZE;
+                }else{
+                    return -1;
+                }
+                ++i;
+                break;
+            }
+            case CH_DATA_LF:{
+                if( c != '\n' ){
+                    return -1;
+                }
+                m_chunk_state = CH_SIZE;
+                ++i;
+                break;
+            }
+            case CH_TRAILER:{
+                if( c == '\r' ){
+                    m_chunk_state = CH_END_LF;
+                }else if( c == '\n' ){
+                    m_chunk_state = CH_DONE;
+                }else{
+                    m_chunk_state = CH_TRAILER_LINE;
+                }
+                ++i;
+                break;
+            }
+            case CH_TRAILER_LINE:{
+                if( c == '\n' ){
+                    m_chunk_state = CH_TRAILER;
+                }
+                ++i;
+                break;
+            }
+            case CH_END_LF:{
+                if( c != '\n' ){
+                    return -1;
+                }
+                m_chunk_state = CH_DONE;
+                ++i;
+                break;
+            }
+        }
+    }
+    return i;
+}
+
+//上游是HTTP：重写响应头中逐跳的部分，消息体按原来的格式转发，同时找到消息体的结尾
+bool proxy_session::decode_http(){
+    while( m_in_len > 0 ){
+        switch( m_rstate ){
+            case R_HEAD:{
+                char* end = (char*)memmem( m_in, m_in_len, "\r\n\r\n", 4 );
+                if( !end ){
+                    return m_in_len < BUFFER_SIZE;
+                }
+                int head_len = end - m_in + 4;
+                if( head_len + 64 > BUFFER_SIZE ){
+                    return false;
+                }
+                if( cl_space() < head_len + 64 ){
+                    return true;
+                }
+                //状态行 HTTP/1.x code reason
+                if( head_len < 16 || strncmp( m_in, "HTTP/1.", 7 ) != 0 || m_in[8] != ' ' ){
+                    return false;
+                }
+                bool http10 = m_in[7] == '0';
+                int code = atoi( m_in + 9 );
+                if( code < 100 || code > 999 || code == 101 ){
+                    return false;
+                }
+                //1xx临时响应直接丢掉
+                if( code < 200 ){
+                    consume_in( head_len );
+                    break;
+                }
+                char* line_end = (char*)memmem( m_in, head_len, "\r\n", 2 );
+                bool up_close = http10;
+                bool chunked = false;
+                long long length = -1;
+                cl_append( "HTTP/1.1 ", 9 );
+                cl_append( m_in + 9, line_end - m_in - 9 + 2 );
+
+                char* line = line_end + 2;
+                while( line < end + 2 ){
+                    char* eol = (char*)memmem( line, end + 2 - line, "\r\n", 2 );
+                    int len = eol - line;
+                    char* colon = (char*)memchr( line, ':', len );
+                    if( colon ){
+                        int name_len = colon - line;
+                        char* value = colon + 1;
+                        while( value < eol && ( *value == ' ' || *value == '\t' ) ){
+                            ++value;
+                        }
+                        int value_len = eol - value;
+                        if( name_len == 10 && strncasecmp( line, "Connection", 10 ) == 0 ){
+                            if( memmem( value, value_len, "close", 5 ) ){
+                                up_close = true;
+                            }else if( strncasecmp( value, "keep-alive", 10 ) == 0 ){
+                                up_close = false;
+                            }
+                            line = eol + 2;
+                            continue;
+                        }
+                        if( ( name_len == 10 && strncasecmp( line, "Keep-Alive", 10 ) == 0 )
+                                || ( name_len == 16 && strncasecmp( line, "Proxy-Connection", 16 ) == 0 ) ){
+                            line = eol + 2;
+                            continue;
+                        }
+                        if( name_len == 17 && strncasecmp( line, "Transfer-Encoding", 17 ) == 0 ){
+                            chunked = memmem( value, value_len, "chunked", 7 ) != NULL;
+                        }else if( name_len == 14 && strncasecmp( line, "Content-Length", 14 ) == 0 ){
+                            length = atoll( value );
+                        }
+                    }
+                    cl_append( line, len + 2 );
+                    line = eol + 2;
+                }
+
+                if( m_head || code == 204 || code == 304 ){
+                    m_rstate = R_DONE;
+                }else if( chunked ){
+                    m_rstate = R_CHUNKED;
+                    m_chunk_state = CH_SIZE;
+                    m_chunk_left = 0;
+                }else if( length >= 0 ){
+                    m_resp_left = length;
+                    m_rstate = length > 0 ? R_LENGTH : R_DONE;
+                }else{
+                    //没有长度的消息体以上游关闭连接结束，客户那边也只能用关闭连接表示结束
+                    m_rstate = R_UNTIL_CLOSE;
+                    m_client_keep = false;
+                    up_close = true;
+                }
+                m_up_keep = !up_close;
+                cl_printf( "Connection: %s\r\n\r\n", m_client_keep ? "keep-alive" : "close" );
+                consume_in( head_len );
+                break;
+            }
+            case R_LENGTH:{
+                long long n = m_in_len;
+                if( n > m_resp_left ){
+                    n = m_resp_left;
+                }
+                int space = cl_space();
+                if( n > space ){
+                    n = space;
+                }
+                if( n == 0 ){
+                    return true;
+                }
+                cl_append( m_in, n );
+                consume_in( n );
+                m_resp_left -= n;
+                if( m_resp_left == 0 ){
+                    m_rstate = R_DONE;
+                }
+                break;
+            }
+            case R_CHUNKED:{
+                int space = cl_space();
+                long n = m_in_len < space ? m_in_len : space;
+                if( n == 0 ){
+                    return true;
+                }
+                long used = chunk_scan( m_in, n );
+                if( used < 0 ){
+                    return false;
+                }
+                cl_append( m_in, used );
+                consume_in( used );
+                if( m_chunk_state == CH_DONE ){
+                    m_rstate = R_DONE;
+                }
+                break;
+            }
+            case R_UNTIL_CLOSE:{
+                int n = m_in_len;
+                int space = cl_space();
+                if( n > space ){
+                    n = space;
+                }
+                if( n == 0 ){
+                    return true;
+                }
+                cl_append( m_in, n );
+                consume_in( n );
+                break;
+            }
+            case R_DONE:{
+                //响应之后多出来的数据，连接不能再复用
+                m_up_keep = false;
+                m_in_len = 0;
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+//上游是FastCGI：拆开记录，STDOUT中是CGI格式的响应，转换成HTTP响应
+bool proxy_session::decode_fastcgi(){
+    while( true ){
+        //记录的内容和填充都取完了就关闭，最后一个END_REQUEST之后可能没有更多的输入
+        if( m_rec_open && m_rec_left == 0 && m_rec_pad == 0 ){
+            m_rec_open = false;
+        }
+        if( m_fcgi_end && !m_rec_open ){
+            if( !m_cgi_head_done ){
+                return false;
+            }
+            if( m_cgi_chunked ){
+                if( cl_space() < 5 ){
+                    return true;
+                }
+                cl_append( "0\r\n\r\n", 5 );
+            }
+            if( m_in_len > 0 ){
+                m_up_keep = false;
+                m_in_len = 0;
+            }
+            m_rstate = R_DONE;
+            return true;
+        }
+        if( m_in_len == 0 ){
+            return true;
+        }
+        if( !m_rec_open ){
+            if( m_in_len < FCGI_HEADER_LEN ){
+                return true;
+            }
+            unsigned char* h = (unsigned char*)m_in;
+            if( h[0] != 1 ){
+                return false;
+            }
+            m_rec_type = h[1];
+            m_rec_left = ( h[4] << 8 ) | h[5];
+            m_rec_pad = h[6];
+            m_rec_open = true;
+            consume_in( FCGI_HEADER_LEN );
+            continue;
+        }
+        if( m_rec_left > 0 ){
+            int avail = m_rec_left < m_in_len ? m_rec_left : m_in_len;
+            int used = avail;
+            if( m_rec_type == FCGI_STDOUT ){
+                used = deliver_cgi( m_in, avail );
+                if( used < 0 ){
+                    return false;
+                }
+                if( used == 0 ){
+                    return true;
+                }
+            }else if( m_rec_type == FCGI_END_REQUEST ){
+                //appStatus 4字节 protocolStatus 1字节 保留3字节
+                if( m_rec_left != 8 ){
+                    return false;
+                }
+                if( m_in_len < 8 ){
+                    return true;
+                }
+                if( m_in[4] != 0 ){
+                    m_up_keep = false;
+                }
+                m_fcgi_end = true;
+            }else if( m_rec_type == FCGI_STDERR ){
+                printf( "upstream %s: %.*s\n", m_group->name.c_str(), avail, m_in );
+            }
+            consume_in( used );
+            m_rec_left -= used;
+            continue;
+        }
+        if( m_rec_pad > 0 ){
+            int n = m_rec_pad < m_in_len ? m_rec_pad : m_in_len;
+            consume_in( n );
+            m_rec_pad -= n;
+            continue;
+        }
+    }
+}
+
+//CGI响应的消息体，没有Content-Length时按chunked发给客户；返回用掉的字节数
+int proxy_session::emit_body( const char* data, int len ){
+    if( m_discard ){
+        return len;
+    }
+    int space = cl_space();
+    if( m_cgi_chunked ){
+        if( space <= 16 ){
+            return 0;
+        }
+        int n = len < space - 16 ? len : space - 16;
+        cl_printf( "%x\r\n", n );
+        cl_append( data, n );
+        cl_append( "\r\n", 2 );
+        return n;
+    }
+    int n = len < space ? len : space;
+    cl_append( data, n );
+    return n;
+}
+
+int proxy_session::deliver_cgi( const char* data, int len ){
+    if( m_cgi_head_done ){
+        return emit_body( data, len );
+    }
+    //先收齐CGI响应头
+    size_t old = m_cgi_head.size();
+    int take = CGI_HEAD_MAX - (int)old;
+    if( take <= 0 ){
+        return -1;
+    }
+    if( take > len ){
+        take = len;
+    }
+    m_cgi_head.append( data, take );
+    size_t from = old > 3 ? old - 3 : 0;
+    size_t crlf = m_cgi_head.find( "\r\n\r\n", from );
+    size_t lf = m_cgi_head.find( "\n\n", from );
+    size_t head_end;
+    if( crlf != std::string::npos && ( lf == std::string::npos || crlf < lf ) ){
+        head_end = crlf + 4;
+    }else if( lf != std::string::npos ){
+        head_end = lf + 2;
+    }else{
+        return take;
+    }
+    //响应头和已经收到的消息体要一次放进发给客户的缓冲区
+    size_t extra = m_cgi_head.size() - head_end;
+    if( cl_space() < (int)( head_end + extra ) + 256 ){
+        m_cgi_head.resize( old );
+        return 0;
+    }
+    if( !finish_cgi_head( head_end ) ){
+        return -1;
+    }
+    if( extra > 0 ){
+        emit_body( m_cgi_head.data() + head_end, extra );
+    }
+    m_cgi_head.clear();
+    return take;
+}
+
+//把CGI响应头转换成HTTP响应头，Status头给出状态码
+bool proxy_session::finish_cgi_head( size_t head_end ){
+    int status = 200;
+    std::string reason = "OK";
+    bool has_status = false;
+    bool has_location = false;
+    long long length = -1;
+    std::string headers;
+    size_t pos = 0;
+    while( pos < head_end ){
+        size_t eol = m_cgi_head.find( '\n', pos );
+        if( eol == std::string::npos || eol >= head_end ){
+            eol = head_end;
+        }
+        std::string line = m_cgi_head.substr( pos, eol - pos );
+        pos = eol + 1;
+        if( !line.empty() && line[ line.size() - 1 ] == '\r' ){
+            line.erase( line.size() - 1 );
+        }
+        if( line.empty() ){
+            continue;
+        }
+        size_t colon = line.find( ':' );
+        if( colon == std::string::npos ){
+            return false;
+        }
+        std::string name = line.substr( 0, colon );
+        size_t value_start = line.find_first_not_of( " \t", colon + 1 );
+        std::string value = value_start == std::string::npos ? "" : line.substr( value_start );
+        if( strcasecmp( name.c_str(), "Status" ) == 0 ){
+            status = atoi( value.c_str() );
+            if( status < 100 || status > 999 ){
+                return false;
+            }
+            size_t space = value.find( ' ' );
+            reason = space == std::string::npos ? "" : value.substr( space + 1 );
+            has_status = true;
+            continue;
+        }
+        if( strcasecmp( name.c_str(), "Connection" ) == 0 || strcasecmp( name.c_str(), "Keep-Alive" ) == 0
+                || strcasecmp( name.c_str(), "Transfer-Encoding" ) == 0 ){
+            continue;
+        }
+        if( strcasecmp( name.c_str(), "Location" ) == 0 ){
+            has_location = true;
+        }else if( strcasecmp( name.c_str(), "Content-Length" ) == 0 ){
+            length = atoll( value.c_str() );
+        }
+        headers += name + ": " + value + "\r\n";
+    }
+    if( has_location && !has_status ){
+        status = 302;
+        reason = "Found";
+    }
+    m_discard = m_head || status == 204 || status == 304;
+    //HTTP/1.0的客户不认识chunked，没有长度时只能以关闭连接表示结束
+    m_cgi_chunked = !m_discard && length < 0 && !m_http10;
+    if( !m_discard && length < 0 && m_http10 ){
+        m_client_keep = false;
+    }
+    bool ok = cl_printf( "HTTP/1.1 %d %s\r\n", status, reason.c_str() )
+        && cl_append( headers.data(), headers.size() )
+        && ( !m_cgi_chunked || cl_printf( "Transfer-Encoding: chunked\r\n" ) )
+        && cl_printf( "Connection: %s\r\n\r\n", m_client_keep ? "keep-alive" : "close" );
+    m_cgi_head_done = true;
+    return ok;
+}
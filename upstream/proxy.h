@@ -0,0 +1,171 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include "upstream.h"
+#include "../tls/tls.h"
+
+//http_conn解析出来的、要转发给上游的请求
+struct proxy_request{
+    const char* method;
+    const char* path;
+    //没有查询串时为NULL
+    const char* query;
+    //请求头，每行以\0\0结尾（parse_line把\r\n替换成了\0\0）
+    const char* headers;
+    int headers_len;
+    long content_length;
+    //已经读到读缓冲区中的消息体
+    const char* body;
+    int body_len;
+    //客户端地址，IPv4、IPv6或者unix socket
+    const sockaddr* peer;
+    const char* doc_root;
+    //客户连接使用TLS，告诉上游原来的协议
+    bool tls;
+    bool head;
+    //客户使用HTTP/1.0，不能收到chunked的响应
+    bool http10;
+    //客户希望保持连接
+    bool keep_alive;
+};
+
+//一个正在转发的请求：客户的消息体边读边发给上游，上游的响应边读边发给客户
+//prepare在工作线程中调用，之后的所有操作都在连接所属的reactor线程中进行
+//两个方向各有一个固定大小的缓冲区，对面写不动时不再读，内存占用和请求大小无关
+class proxy_session{
+public:
+    enum STATUS {
+        PROXY_CONTINUE = 0, //等待下一次事件
+        PROXY_DONE,         //响应已经完整发给客户
+        PROXY_BAD_GATEWAY,  //上游不可用或者响应有误，还没有向客户发送任何内容
+        PROXY_UNAVAILABLE,  //所有上游都达到并发上限
+        PROXY_TIMEOUT,      //上游超时，还没有向客户发送任何内容
+        PROXY_ABORT         //已经发送了部分响应或者客户出错，只能关闭连接
+    };
+    static const int BUFFER_SIZE = 16384;
+
+    //client是客户连接的读写，TLS连接的数据经过它加解密
+    proxy_session( upstream_group* g, conn_io* client );
+    ~proxy_session();
+
+    //生成发给上游的请求头（FastCGI为参数），失败时返回false
+    bool prepare( const proxy_request& req );
+    bool started() const { return m_pool != 0; }
+    //reactor线程中第一次处理该连接时调用：选择上游并开始转发
+    STATUS start( upstream_pool* pool );
+    //客户连接或上游连接上的事件
+    STATUS on_event( int fd, uint32_t events );
+    STATUS on_timeout();
+
+    int client_fd() const { return m_client; }
+    //响应结束后客户连接能否继续使用
+    bool keep_alive() const { return m_client_keep && m_body_left == 0; }
+    //是否已经向客户发送过响应的内容，发送过就不能再返回错误页面
+    bool responded() const { return m_cl_produced > m_cl_preamble; }
+    //客户的消息体是否已经全部读完
+    bool request_read() const { return m_body_left == 0; }
+    long long bytes_sent() const { return m_cl_total; }
+
+private:
+    friend class upstream_pool;
+    enum RESPONSE_STATE { R_HEAD = 0, R_LENGTH, R_CHUNKED, R_UNTIL_CLOSE, R_DONE };
+
+    STATUS connect_next();
+    STATUS upstream_failed( bool connect_error );
+    STATUS upstream_eof();
+    STATUS pump();
+    void release_upstream( bool keep );
+    bool out_append( const char* data, int len );
+    bool out_printf( const char* format, ... );
+    int cl_space();
+    bool cl_append( const char* data, int len );
+    bool cl_printf( const char* format, ... );
+    void consume_in( int len );
+    //把m_in中的响应转换后放入m_cl，出错返回false
+    bool decode_http();
+    bool decode_fastcgi();
+    int deliver_cgi( const char* data, int len );
+    int emit_body( const char* data, int len );
+    bool finish_cgi_head( size_t head_end );
+    long chunk_scan( const char* p, long n );
+
+    upstream_group* m_group;
+    upstream_pool* m_pool;
+    conn_io* m_io;
+    int m_client;
+    int m_up;
+    int m_server;
+    bool m_reused;
+    bool m_connecting;
+    int m_attempts;
+    bool m_head;
+    //客户使用HTTP/1.0：请求也按HTTP/1.0发给上游，上游就不会用chunked
+    bool m_http10;
+    //重发不会产生副作用的请求，上游失败时可以换一个地址重试
+    bool m_idempotent;
+
+    //边沿触发，记录每个方向是否还可以继续读写
+    bool m_cl_readable;
+    bool m_cl_writable;
+    bool m_up_readable;
+    bool m_up_writable;
+
+    //发给上游的数据
+    char* m_out;
+    int m_out_len;
+    int m_out_sent;
+    //请求仍完整地保存在m_out中，上游失败时可以重新发给下一个上游
+    bool m_replayable;
+    //客户还没有读到的消息体长度
+    long m_body_left;
+
+    //从上游读到、还没有处理的数据
+    char* m_in;
+    int m_in_len;
+    //上游已经发来了响应
+    bool m_got_response;
+    //上游关闭了连接
+    bool m_up_eof;
+
+    //发给客户的数据
+    char* m_cl;
+    int m_cl_len;
+    int m_cl_sent;
+    //m_cl开头由代理自己生成的100 Continue
+    int m_cl_preamble;
+    //放入m_cl的总字节数和已经发送的总字节数
+    long long m_cl_produced;
+    long long m_cl_total;
+
+    RESPONSE_STATE m_rstate;
+    long long m_resp_left;
+    int m_chunk_state;
+    long long m_chunk_left;
+    bool m_up_keep;
+    bool m_client_keep;
+
+    //FastCGI记录的解析状态
+    bool m_rec_open;
+    int m_rec_type;
+    int m_rec_left;
+    int m_rec_pad;
+    //收到了END_REQUEST
+    bool m_fcgi_end;
+    //CGI响应头，收齐之前先放在这里
+    std::string m_cgi_head;
+    bool m_cgi_head_done;
+    //CGI响应没有Content-Length，用chunked发给客户
+    bool m_cgi_chunked;
+    //响应不应该有消息体（HEAD/204/304），上游发来的消息体丢弃
+    bool m_discard;
+
+    //超时时间，由upstream_pool检查
+    long long m_deadline;
+    proxy_session* m_prev;
+    proxy_session* m_next;
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include "upstream.h"
+#include "proxy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//启动时建立，之后只读
+static std::vector< upstream_group* > groups;
+static int server_count = 0;
+
+long long upstream_now_ms(){
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+upstream_group::upstream_group(): proto( UPSTREAM_HTTP ), max_inflight( 64 ), timeout_ms( 30000 ), m_next( 0 ){
+}
+
+int upstream_group::acquire( int after, bool* saturated ){
+    long long now = upstream_now_ms();
+    int n = servers.size();
+    int start = after >= 0 ? after + 1 : (int)( m_next.fetch_add( 1, std::memory_order_relaxed ) % n );
+    *saturated = false;
+    for( int i = 0; i < n; ++i ){
+        int index = ( start + i ) % n;
+        upstream_server* s = servers[ index ];
+        if( s->down_until.load( std::memory_order_relaxed ) > now ){
+            continue;
+        }
+        if( s->inflight.fetch_add( 1, std::memory_order_relaxed ) >= max_inflight ){
+            s->inflight.fetch_sub( 1, std::memory_order_relaxed );
+            *saturated = true;
+            continue;
+        }
+        return index;
+    }
+    return -1;
+}
+
+void upstream_group::release( int index ){
+    servers[ index ]->inflight.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+void upstream_group::mark_failed( int index ){
+    servers[ index ]->down_until.store( upstream_now_ms() + FAIL_BACKOFF_MS, std::memory_order_relaxed );
+    printf( "upstream %s: %s is down\n", name.c_str(), servers[ index ]->name.c_str() );
+}
+
+static bool parse_addr( const std::string& text, upstream_server* s ){
+    memset( &s->addr, 0, sizeof( s->addr ) );
+    if( text.compare( 0, 5, "unix:" ) == 0 ){
+        sockaddr_un* un = (sockaddr_un*)&s->addr;
+        std::string path = text.substr( 5 );
+        if( path.empty() || path.size() >= sizeof( un->sun_path ) ){
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy( un->sun_path, path.c_str(), path.size() + 1 );
+        s->addr_len = sizeof( sockaddr_un );
+        return true;
+    }
+    std::string host;
+    std::string port;
+    if( !text.empty() && text[0] == '[' ){
+        size_t close = text.find( "]:" );
+        if( close == std::string::npos ){
+            return false;
+        }
+        host = text.substr( 1, close - 1 );
+        port = text.substr( close + 2 );
+    }else{
+        size_t colon = text.rfind( ':' );
+        if( colon == std::string::npos ){
+            return false;
+        }
+        host = text.substr( 0, colon );
+        port = text.substr( colon + 1 );
+    }
+    int p = atoi( port.c_str() );
+    if( p <= 0 || p > 65535 ){
+        return false;
+    }
+    sockaddr_in* in4 = (sockaddr_in*)&s->addr;
+    sockaddr_in6* in6 = (sockaddr_in6*)&s->addr;
+    if( inet_pton( AF_INET, host.c_str(), &in4->sin_addr ) == 1 ){
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons( p );
+        s->addr_len = sizeof( sockaddr_in );
+        return true;
+    }
+    if( inet_pton( AF_INET6, host.c_str(), &in6->sin6_addr ) == 1 ){
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons( p );
+        s->addr_len = sizeof( sockaddr_in6 );
+        return true;
+    }
+    return false;
+}
+
+bool upstream_add_group( const char* spec ){
+    char name[ 64 ], proto[ 16 ], addrs[ 1024 ];
+    int max_inflight = 64, timeout_ms = 30000;
+    int n = sscanf( spec, "%63s %15s %1023s %d %d", name, proto, addrs, &max_inflight, &timeout_ms );
+    if( n < 3 || max_inflight <= 0 || timeout_ms <= 0 || upstream_find( name ) ){
+        return false;
+    }
+    upstream_group* g = new upstream_group;
+    g->name = name;
+    if( strcasecmp( proto, "http" ) == 0 ){
+        g->proto = UPSTREAM_HTTP;
+    }else if( strcasecmp( proto, "fcgi" ) == 0 || strcasecmp( proto, "fastcgi" ) == 0 ){
+        g->proto = UPSTREAM_FASTCGI;
+    }else{
+        delete g;
+        return false;
+    }
+    g->max_inflight = max_inflight;
+    g->timeout_ms = timeout_ms;
+
+    std::string list = addrs;
+    size_t pos = 0;
+    while( pos <= list.size() ){
+        size_t comma = list.find( ',', pos );
+        if( comma == std::string::npos ){
+            comma = list.size();
+        }
+        upstream_server* s = new upstream_server;
+        s->name = list.substr( pos, comma - pos );
+        s->inflight = 0;
+        s->down_until = 0;
+        if( !parse_addr( s->name, s ) ){
+            printf( "bad upstream address %s\n", s->name.c_str() );
+            delete s;
+            for( size_t i = 0; i < g->servers.size(); ++i ){
+                delete g->servers[i];
+            }
+            delete g;
+            return false;
+        }
+        s->id = server_count++;
+        g->servers.push_back( s );
+        pos = comma + 1;
+    }
+    groups.push_back( g );
+    return true;
+}
+
+upstream_group* upstream_find( const char* name ){
+    for( size_t i = 0; i < groups.size(); ++i ){
+        if( groups[i]->name == name ){
+            return groups[i];
+        }
+    }
+    return 0;
+}
+
+upstream_pool::upstream_pool( int epollfd ):
+    m_epollfd( epollfd ), m_idle( server_count ), m_sessions( 0 ), m_active( 0 ), m_next_sweep( 0 ){
+}
+
+upstream_pool::~upstream_pool(){
+    for( size_t i = 0; i < m_idle.size(); ++i ){
+        for( size_t j = 0; j < m_idle[i].size(); ++j ){
+            close( m_idle[i][j].fd );
+        }
+    }
+    for( size_t i = 0; i < m_closing.size(); ++i ){
+        close( m_closing[i] );
+    }
+}
+
+void upstream_pool::set_owned( int fd, bool owned ){
+    if( fd >= (int)m_owned.size() ){
+        m_owned.resize( fd + 1, 0 );
+        m_owner.resize( fd + 1, 0 );
+    }
+    m_owned[ fd ] = owned;
+}
+
+void upstream_pool::close_now( int fd ){
+    set_owned( fd, false );
+    close( fd );
+}
+
+int upstream_pool::connect( upstream_group* g, int index, bool* reused, bool* pending ){
+    upstream_server* s = g->servers[ index ];
+    std::deque< idle_conn >& idle = m_idle[ s->id ];
+    long long now = upstream_now_ms();
+    *pending = false;
+    //后放回的连接最不可能已经被对方关闭
+    while( !idle.empty() ){
+        idle_conn c = idle.back();
+        idle.pop_back();
+        //空闲期间对方关闭或者发来了数据的连接都不能再用
+        char byte;
+        ssize_t n = recv( c.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT );
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) && now - c.since < upstream_group::IDLE_MS ){
+            *reused = true;
+            return c.fd;
+        }
+        close_now( c.fd );
+    }
+
+    *reused = false;
+    int fd = socket( s->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ){
+        return -1;
+    }
+    if( s->addr.ss_family != AF_UNIX ){
+        int on = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    }
+    if( ::connect( fd, (sockaddr*)&s->addr, s->addr_len ) < 0 ){
+        if( errno != EINPROGRESS ){
+            close( fd );
+            return -1;
+        }
+        *pending = true;
+    }
+    set_owned( fd, true );
+    return fd;
+}
+
+void upstream_pool::attach( int fd, proxy_session* s ){
+    set_owned( fd, true );
+    m_owner[ fd ] = s;
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &event );
+}
+
+void upstream_pool::release( upstream_group* g, int index, int fd, bool keep ){
+    epoll_ctl( m_epollfd, EPOLL_CTL_DEL, fd, 0 );
+    m_owner[ fd ] = 0;
+    std::deque< idle_conn >& idle = m_idle[ g->servers[ index ]->id ];
+    if( keep && (int)idle.size() < g->max_inflight ){
+        idle_conn c = { fd, upstream_now_ms() };
+        idle.push_back( c );
+    }else{
+        m_closing.push_back( fd );
+    }
+}
+
+void upstream_pool::track( proxy_session* s ){
+    s->m_prev = 0;
+    s->m_next = m_sessions;
+    if( m_sessions ){
+        m_sessions->m_prev = s;
+    }
+    m_sessions = s;
+    ++m_active;
+}
+
+void upstream_pool::untrack( proxy_session* s ){
+    if( s->m_prev ){
+        s->m_prev->m_next = s->m_next;
+    }else{
+        m_sessions = s->m_next;
+    }
+    if( s->m_next ){
+        s->m_next->m_prev = s->m_prev;
+    }
+    s->m_prev = s->m_next = 0;
+    --m_active;
+}
+
+void upstream_pool::expire( long long now, std::vector< proxy_session* >& timed_out ){
+    for( size_t i = 0; i < m_closing.size(); ++i ){
+        close_now( m_closing[i] );
+    }
+    m_closing.clear();
+
+    //超时精度不需要很高，半秒检查一次
+    if( now < m_next_sweep ){
+        return;
+    }
+    m_next_sweep = now + 500;
+    for( proxy_session* s = m_sessions; s; s = s->m_next ){
+        if( s->m_deadline <= now ){
+            timed_out.push_back( s );
+        }
+    }
+    for( size_t i = 0; i < m_idle.size(); ++i ){
+        std::deque< idle_conn >& idle = m_idle[i];
+        while( !idle.empty() && now - idle.front().since >= upstream_group::IDLE_MS ){
+            close_now( idle.front().fd );
+            idle.pop_front();
+        }
+    }
+}
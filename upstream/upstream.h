@@ -0,0 +1,111 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+class proxy_session;
+
+//反向代理的上游协议
+enum UPSTREAM_PROTO { UPSTREAM_HTTP = 0, UPSTREAM_FASTCGI };
+
+//一个上游地址，计数由所有reactor共享
+struct upstream_server{
+    //全局编号，reactor按编号保存空闲连接
+    int id;
+    //配置中的地址，用于日志
+    std::string name;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    //正在处理的请求数
+    std::atomic< int > inflight;
+    //新建连接失败后，在这个时间（毫秒）之前不再选择它
+    std::atomic< long long > down_until;
+};
+
+//同一个服务的多个上游地址，轮流选择，失败的地址暂时跳过
+class upstream_group{
+public:
+    //连接失败后跳过该地址的时间
+    static const int FAIL_BACKOFF_MS = 5000;
+    //空闲长连接保留的时间
+    static const int IDLE_MS = 30000;
+
+    std::string name;
+    UPSTREAM_PROTO proto;
+    //每个地址同时处理的请求数上限
+    int max_inflight;
+    //连接和等待响应的超时时间（毫秒），超时返回504
+    int timeout_ms;
+    std::vector< upstream_server* > servers;
+
+    upstream_group();
+    //从after之后的下一个地址开始，选择一个可用且未满的地址并占用一个名额
+    //after为-1时轮流选择；没有可用地址时返回-1，saturated表示是否因为全部满了
+    int acquire( int after, bool* saturated );
+    void release( int index );
+    void mark_failed( int index );
+
+private:
+    std::atomic< unsigned > m_next;
+};
+
+//解析一条上游配置：NAME http|fcgi ADDR[,ADDR...] [MAX_INFLIGHT] [TIMEOUT_MS]
+//ADDR为 unix:/path、ip:port 或 [ipv6]:port
+bool upstream_add_group( const char* spec );
+//启动时建立，之后只读
+upstream_group* upstream_find( const char* name );
+long long upstream_now_ms();
+
+//每个reactor一个，保存到上游的空闲长连接，只在reactor线程中使用，不需要加锁
+//正在使用的上游连接和客户连接加入同一个epoll，事件由reactor转给对应的proxy_session
+class upstream_pool{
+public:
+    explicit upstream_pool( int epollfd );
+    ~upstream_pool();
+
+    //取一个到该地址的连接，优先复用空闲的长连接
+    //reused表示是复用的连接，pending表示非阻塞connect还没有完成；失败返回-1
+    int connect( upstream_group* g, int index, bool* reused, bool* pending );
+    //连接交给session，加入epoll
+    void attach( int fd, proxy_session* s );
+    //请求结束，keep为true时放回空闲列表，否则在本轮事件处理完后关闭
+    void release( upstream_group* g, int index, int fd, bool keep );
+
+    //fd是本pool的上游连接（包括空闲的），事件不属于客户连接
+    bool owns( int fd ) const { return fd < (int)m_owned.size() && m_owned[ fd ]; }
+    //正在使用fd的session，空闲连接返回NULL
+    proxy_session* session( int fd ) const { return fd < (int)m_owner.size() ? m_owner[ fd ] : 0; }
+
+    //正在进行的代理请求，用于超时检查
+    void track( proxy_session* s );
+    void untrack( proxy_session* s );
+    int active() const { return m_active; }
+    //每轮事件处理之后调用：关闭待关闭的连接，找出超时的请求，清理过期的空闲连接
+    void expire( long long now, std::vector< proxy_session* >& timed_out );
+
+private:
+    struct idle_conn{
+        int fd;
+        long long since;
+    };
+    void set_owned( int fd, bool owned );
+    void close_now( int fd );
+
+    int m_epollfd;
+    std::vector< std::deque< idle_conn > > m_idle;
+    std::vector< proxy_session* > m_owner;
+    std::vector< char > m_owned;
+    //本轮事件中释放的连接，留到事件处理完再close，避免同一批中的旧事件落到复用了fd的新连接上
+    std::vector< int > m_closing;
+    proxy_session* m_sessions;
+    int m_active;
+    long long m_next_sweep;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "ws_codec.h"
+
+#include <string.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+//握手时和Sec-WebSocket-Key拼接的固定GUID
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+size_t ws_frame_header( uint8_t* out, uint8_t opcode, uint64_t len ){
+    out[0] = 0x80 | opcode;
+    if( len < 126 ){
+        out[1] = len;
+        return 2;
+    }
+    if( len < 65536 ){
+        out[1] = 126;
+        out[2] = len >> 8;
+        out[3] = len;
+        return 4;
+    }
+    out[1] = 127;
+    for( int i = 0; i < 8; ++i ){
+        out[ 2 + i ] = len >> ( 56 - 8 * i );
+    }
+    return 10;
+}
+
+void ws_unmask( char* data, size_t len, const uint8_t mask[4], size_t offset ){
+    //从data开始的掩码，之后每组都是4的倍数，不用再转
+    uint8_t m[4];
+    for( int i = 0; i < 4; ++i ){
+        m[i] = mask[ ( offset + i ) & 3 ];
+    }
+    uint32_t m32;
+    memcpy( &m32, m, 4 );
+    size_t i = 0;
+#if defined( __SSE2__ )
+    __m128i m128 = _mm_set1_epi32( (int)m32 );
+    for( ; i + 16 <= len; i += 16 ){
+        __m128i v = _mm_loadu_si128( ( const __m128i* )( data + i ) );
+        _mm_storeu_si128( ( __m128i* )( data + i ), _mm_xor_si128( v, m128 ) );
+    }
+#endif
+    uint64_t m64 = m32 | ( (uint64_t)m32 << 32 );
+    for( ; i + 8 <= len; i += 8 ){
+        uint64_t v;
+        memcpy( &v, data + i, 8 );
+        v ^= m64;
+        memcpy( data + i, &v, 8 );
+    }
+    for( ; i < len; ++i ){
+        data[i] ^= m[ i & 3 ];
+    }
+}
+
+bool ws_accept_key( const char* key, char* out ){
+    //16字节随机数的base64，固定24个字符
+    size_t len = strlen( key );
+    if( len != 24 || key[22] != '=' || key[23] != '=' ){
+        return false;
+    }
+    char buf[ 24 + sizeof( WS_GUID ) ];
+    memcpy( buf, key, 24 );
+    memcpy( buf + 24, WS_GUID, sizeof( WS_GUID ) - 1 );
+    unsigned char digest[ SHA_DIGEST_LENGTH ];
+    SHA1( ( const unsigned char* )buf, 24 + sizeof( WS_GUID ) - 1, digest );
+    EVP_EncodeBlock( ( unsigned char* )out, digest, SHA_DIGEST_LENGTH );
+    return true;
+}
+
+bool ws_utf8_valid( const char* data, size_t len ){
+    const uint8_t* p = ( const uint8_t* )data;
+    size_t i = 0;
+    while( i < len ){
+        //ASCII一次检查8字节
+        if( i + 8 <= len ){
+            uint64_t v;
+            memcpy( &v, p + i, 8 );
+            if( ( v & 0x8080808080808080ull ) == 0 ){
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = p[i];
+        if( c < 0x80 ){
+            ++i;
+            continue;
+        }
+        int n;
+        uint32_t cp;
+        if( ( c & 0xe0 ) == 0xc0 ){
+            n = 1;
+            cp = c & 0x1f;
+        }else if( ( c & 0xf0 ) == 0xe0 ){
+            n = 2;
+            cp = c & 0x0f;
+        }else if( ( c & 0xf8 ) == 0xf0 ){
+            n = 3;
+            cp = c & 0x07;
+        }else{
+            return false;
+        }
+        if( i + n >= len ){
+            return false;
+        }
+        for( int k = 1; k <= n; ++k ){
+            if( ( p[ i + k ] & 0xc0 ) != 0x80 ){
+                return false;
+            }
+            cp = ( cp << 6 ) | ( p[ i + k ] & 0x3f );
+        }
+        //过长编码、代理区、超出Unicode范围
+        static const uint32_t min_cp[4] = { 0, 0x80, 0x800, 0x10000 };
+        if( cp < min_cp[n] || ( cp >= 0xd800 && cp <= 0xdfff ) || cp > 0x10ffff ){
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
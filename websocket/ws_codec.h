@@ -0,0 +1,24 @@
+#ifndef WS_CODEC_H
+#define WS_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//WebSocket（RFC 6455）帧格式中和连接状态无关的部分
+
+enum WS_OPCODE { WS_CONTINUATION = 0, WS_TEXT = 1, WS_BINARY = 2, WS_CLOSE = 8, WS_PING = 9, WS_PONG = 10 };
+
+//服务器发出的帧头最长10字节（不加掩码）
+static const int WS_MAX_HEADER = 10;
+
+//写一个FIN置位、不加掩码的帧头，返回长度
+size_t ws_frame_header( uint8_t* out, uint8_t opcode, uint64_t len );
+//客户端的帧都加了掩码，offset是data在整个负载中的位置
+//按16字节（SSE2）和8字节一组异或，只有结尾不足8字节时逐字节处理
+void ws_unmask( char* data, size_t len, const uint8_t mask[4], size_t offset );
+//Sec-WebSocket-Key对应的Sec-WebSocket-Accept，out至少29字节，key不合法时返回false
+bool ws_accept_key( const char* key, char* out );
+//文本消息必须是合法的UTF-8
+bool ws_utf8_valid( const char* data, size_t len );
+
+#endif
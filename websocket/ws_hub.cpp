@@ -0,0 +1,70 @@
+#include "ws_hub.h"
+
+const char ws_hub::STATUS_CHANNEL[] = "/ws/status";
+
+void ws_hub::subscribe( ws_session* s ){
+    m_lock.wrlock();
+    std::vector< ws_session* >& list = m_channels[ s->channel() ];
+    s->m_index = list.size();
+    list.push_back( s );
+    m_lock.unlock();
+}
+
+void ws_hub::unsubscribe( ws_session* s ){
+    m_lock.wrlock();
+    std::map< std::string, std::vector< ws_session* > >::iterator it = m_channels.find( s->channel() );
+    if( it != m_channels.end() ){
+        std::vector< ws_session* >& list = it->second;
+        size_t i = s->m_index;
+        if( i < list.size() && list[i] == s ){
+            //和最后一个交换后删除
+            list[i] = list.back();
+            list[i]->m_index = i;
+            list.pop_back();
+        }
+        if( list.empty() ){
+            m_channels.erase( it );
+        }
+    }
+    m_lock.unlock();
+}
+
+int ws_hub::publish( const std::string& channel, uint8_t opcode, const char* data, size_t len ){
+    m_lock.rdlock();
+    std::map< std::string, std::vector< ws_session* > >::iterator it = m_channels.find( channel );
+    if( it == m_channels.end() ){
+        m_lock.unlock();
+        return 0;
+    }
+    const std::vector< ws_session* >& list = it->second;
+    ws_message* m = ws_message::create( opcode, data, len );
+    if( !m ){
+        m_lock.unlock();
+        return 0;
+    }
+    for( size_t i = 0; i < list.size(); ++i ){
+        list[i]->send( m );
+    }
+    int count = list.size();
+    m_lock.unlock();
+    m->release();
+    return count;
+}
+
+int ws_hub::subscribers( const std::string& channel ){
+    m_lock.rdlock();
+    std::map< std::string, std::vector< ws_session* > >::iterator it = m_channels.find( channel );
+    int count = it == m_channels.end() ? 0 : it->second.size();
+    m_lock.unlock();
+    return count;
+}
+
+void ws_hub::shutdown(){
+    m_lock.rdlock();
+    for( std::map< std::string, std::vector< ws_session* > >::iterator it = m_channels.begin(); it != m_channels.end(); ++it ){
+        for( size_t i = 0; i < it->second.size(); ++i ){
+            it->second[i]->close( 1001 );
+        }
+    }
+    m_lock.unlock();
+}
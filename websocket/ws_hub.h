@@ -0,0 +1,34 @@
+#ifndef WS_HUB_H
+#define WS_HUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "ws_session.h"
+#include "../locker/locker.h"
+
+//进程内的发布/订阅：频道名是WebSocket连接的路径
+//发布时消息只编码一次，每个订阅者的输出队列引用同一块内存，用writev直接写到各自的socket
+//订阅者数组由读写锁保护：发布者之间可以并行，订阅和退订时等发布者遍历完，
+//所以退订返回后不会再有线程访问这个连接
+class ws_hub{
+public:
+    //服务器状态每秒发布到这个频道，代替仪表盘轮询
+    static const char STATUS_CHANNEL[];
+
+    void subscribe( ws_session* s );
+    void unsubscribe( ws_session* s );
+    //返回收到消息的订阅者数
+    int publish( const std::string& channel, uint8_t opcode, const char* data, size_t len );
+    int subscribers( const std::string& channel );
+    //平滑退出：给所有连接发close(1001)
+    void shutdown();
+
+private:
+    std::map< std::string, std::vector< ws_session* > > m_channels;
+    rwlocker m_lock;
+};
+
+#endif
@@ -0,0 +1,365 @@
+#include "ws_session.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../stats/stats.h"
+
+ws_message* ws_message::allocate( size_t len ){
+    void* p = malloc( sizeof( ws_message ) + len );
+    if( !p ){
+        return NULL;
+    }
+    ws_message* m = new( p ) ws_message;
+    m->refs.store( 1, std::memory_order_relaxed );
+    m->len = len;
+    return m;
+}
+
+ws_message* ws_message::create( uint8_t opcode, const char* payload, size_t len ){
+    uint8_t header[ WS_MAX_HEADER ];
+    size_t header_len = ws_frame_header( header, opcode, len );
+    ws_message* m = allocate( header_len + len );
+    if( m ){
+        memcpy( m->data(), header, header_len );
+        memcpy( m->data() + header_len, payload, len );
+    }
+    return m;
+}
+
+void ws_message::release(){
+    if( refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ){
+        this->~ws_message();
+        free( this );
+    }
+}
+
+ws_session::ws_session( conn_io* io, const char* channel, bool publish ):
+    m_index( 0 ), m_io( io ), m_channel( channel ), m_publish( publish ), m_started( false ),
+    m_in_len( 0 ), m_in_frame( false ), m_frame_opcode( 0 ), m_frame_fin( false ), m_frame_left( 0 ),
+    m_mask_offset( 0 ), m_in_message( false ), m_message_opcode( 0 ),
+    m_out_offset( 0 ), m_out_bytes( 0 ), m_blocked( false ),
+    m_close_sent( false ), m_close_received( false ), m_failed( false ){
+    memset( m_mask, 0, sizeof( m_mask ) );
+}
+
+ws_session::~ws_session(){
+    for( size_t i = 0; i < m_out.size(); ++i ){
+        m_out[i]->release();
+    }
+}
+
+void ws_session::feed( const char* data, int len ){
+    if( len > INPUT_SIZE - m_in_len ){
+        len = INPUT_SIZE - m_in_len;
+    }
+    if( len > 0 ){
+        memcpy( m_in + m_in_len, data, len );
+        m_in_len += len;
+    }
+}
+
+void ws_session::queue_raw( const char* data, size_t len ){
+    ws_message* m = ws_message::allocate( len );
+    if( !m ){
+        return;
+    }
+    memcpy( m->data(), data, len );
+    m_lock.lock();
+    queue( m );
+    m_lock.unlock();
+}
+
+void ws_session::queue( ws_message* m ){
+    m_out.push_back( m );
+    m_out_bytes += m->len;
+}
+
+bool ws_session::read( std::vector< message >& out ){
+    m_lock.lock();
+    bool ok = true;
+    while( true ){
+        //先处理缓冲区中已有的数据，收齐一批就交给调用者发布，限制占用的内存
+        if( !parse( out ) || out.size() >= 16 ){
+            break;
+        }
+        ssize_t n = m_io->recv( m_in + m_in_len, INPUT_SIZE - m_in_len );
+        if( n > 0 ){
+            m_in_len += n;
+            continue;
+        }
+        if( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+            break;
+        }
+        ok = false;
+        break;
+    }
+    //pong和close的回复
+    if( ok ){
+        ok = flush_locked();
+    }
+    m_lock.unlock();
+    return ok;
+}
+
+//解析缓冲区中的帧，负载边收边去掉掩码，不需要等整个帧都到齐
+//收到close或者出错后返回false，不再读取
+bool ws_session::parse( std::vector< message >& out ){
+    if( m_close_received || m_failed ){
+        return false;
+    }
+    int pos = 0;
+    bool go_on = true;
+    while( go_on ){
+        if( !m_in_frame ){
+            const uint8_t* p = ( const uint8_t* )m_in + pos;
+            int avail = m_in_len - pos;
+            if( avail < 2 ){
+                break;
+            }
+            uint8_t opcode = p[0] & 0x0f;
+            bool fin = ( p[0] & 0x80 ) != 0;
+            bool control = ( opcode & 0x08 ) != 0;
+            uint64_t len = p[1] & 0x7f;
+            int header_len = 2;
+            if( len == 126 ){
+                header_len = 4;
+            }else if( len == 127 ){
+                header_len = 10;
+            }
+            if( avail < header_len + 4 ){
+                break;
+            }
+            if( len == 126 ){
+                len = ( p[2] << 8 ) | p[3];
+            }else if( len == 127 ){
+                len = 0;
+                for( int i = 0; i < 8; ++i ){
+                    len = ( len << 8 ) | p[ 2 + i ];
+                }
+            }
+            //没有协商扩展，RSV必须为0；客户端的帧必须加掩码；控制帧不能分片
+            bool bad = ( p[0] & 0x70 ) != 0 || !( p[1] & 0x80 )
+                    || ( opcode > WS_BINARY && !control ) || opcode > WS_PONG
+                    || ( control && ( !fin || len > 125 ) )
+                    || ( opcode == WS_CONTINUATION && !m_in_message )
+                    || ( !control && opcode != WS_CONTINUATION && m_in_message );
+            if( bad ){
+                m_failed = true;
+                close_locked( 1002 );
+                return false;
+            }
+            if( !control && len > MAX_MESSAGE - ( opcode == WS_CONTINUATION ? m_message.size() : 0 ) ){
+                m_failed = true;
+                close_locked( 1009 );
+                return false;
+            }
+            memcpy( m_mask, p + header_len, 4 );
+            pos += header_len + 4;
+            m_in_frame = true;
+            m_frame_opcode = opcode;
+            m_frame_fin = fin;
+            m_frame_left = len;
+            m_mask_offset = 0;
+            if( control ){
+                m_control.clear();
+            }else if( opcode != WS_CONTINUATION ){
+                m_in_message = true;
+                m_message_opcode = opcode;
+                m_message.clear();
+            }
+        }
+
+        bool control = ( m_frame_opcode & 0x08 ) != 0;
+        std::string& dst = control ? m_control : m_message;
+        size_t n = m_in_len - pos;
+        if( n > m_frame_left ){
+            n = m_frame_left;
+        }
+        if( n > 0 ){
+            size_t old = dst.size();
+            dst.append( m_in + pos, n );
+            ws_unmask( &dst[ old ], n, m_mask, m_mask_offset );
+            m_mask_offset += n;
+            pos += n;
+            m_frame_left -= n;
+        }
+        if( m_frame_left > 0 ){
+            break;
+        }
+
+        //一个帧收齐了
+        m_in_frame = false;
+        if( control ){
+            go_on = on_control();
+        }else if( m_frame_fin ){
+            m_in_message = false;
+            if( m_message_opcode == WS_TEXT && !ws_utf8_valid( m_message.data(), m_message.size() ) ){
+                m_failed = true;
+                close_locked( 1007 );
+                go_on = false;
+            }else{
+                out.push_back( message() );
+                out.back().opcode = m_message_opcode;
+                out.back().data.swap( m_message );
+                if( out.size() >= 16 ){
+                    break;
+                }
+            }
+        }
+    }
+    if( pos > 0 ){
+        memmove( m_in, m_in + pos, m_in_len - pos );
+        m_in_len -= pos;
+    }
+    return go_on;
+}
+
+//一个完整的控制帧，收到close后返回false
+bool ws_session::on_control(){
+    switch( m_frame_opcode ){
+        case WS_PING:{
+            //对方只发ping不读，pong和普通消息一样受MAX_QUEUED限制，超过后断开
+            if( m_out_bytes + m_control.size() + 2 > MAX_QUEUED ){
+                m_failed = true;
+                shutdown( m_io->fd, SHUT_RDWR );
+                return false;
+            }
+            if( !m_close_sent ){
+                ws_message* m = ws_message::create( WS_PONG, m_control.data(), m_control.size() );
+                if( m ){
+                    queue( m );
+                }
+            }
+            return true;
+        }
+        case WS_CLOSE:{
+            m_close_received = true;
+            //原样回复对方的状态码，没有状态码时回复空的close
+            uint16_t code = 0;
+            if( m_control.size() == 1 ){
+                code = 1002;
+            }else if( m_control.size() >= 2 ){
+                code = ( (uint8_t)m_control[0] << 8 ) | (uint8_t)m_control[1];
+                bool valid = ( code >= 1000 && code <= 1003 ) || ( code >= 1007 && code <= 1011 )
+                        || ( code >= 3000 && code <= 4999 );
+                if( !valid || !ws_utf8_valid( m_control.data() + 2, m_control.size() - 2 ) ){
+                    code = 1002;
+                }
+            }
+            close_locked( code );
+            return false;
+        }
+        default:{
+            //pong不需要处理
+            return true;
+        }
+    }
+}
+
+void ws_session::send( ws_message* m ){
+    m_lock.lock();
+    if( m_close_sent || m_failed ){
+        m_lock.unlock();
+        return;
+    }
+    if( m_out_bytes + m->len > MAX_QUEUED ){
+        //对方太慢，断开后由所属的reactor收到挂断事件再关闭连接
+        m_failed = true;
+        shutdown( m_io->fd, SHUT_RDWR );
+        m_lock.unlock();
+        return;
+    }
+    m->retain();
+    queue( m );
+    //socket写不动时只放进队列，等所属reactor的EPOLLOUT
+    if( !m_blocked && !flush_locked() ){
+        m_failed = true;
+        shutdown( m_io->fd, SHUT_RDWR );
+    }
+    m_lock.unlock();
+}
+
+bool ws_session::flush(){
+    m_lock.lock();
+    bool ok = flush_locked();
+    m_lock.unlock();
+    return ok;
+}
+
+bool ws_session::flush_locked(){
+    while( !m_out.empty() ){
+        struct iovec iv[ 64 ];
+        int count = 0;
+        size_t offset = m_out_offset;
+        for( std::deque< ws_message* >::iterator it = m_out.begin(); it != m_out.end() && count < 64; ++it ){
+            iv[ count ].iov_base = ( *it )->data() + offset;
+            iv[ count ].iov_len = ( *it )->len - offset;
+            ++count;
+            offset = 0;
+        }
+        ssize_t n = m_io->writev( iv, count );
+        if( n < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                m_blocked = true;
+                return true;
+            }
+            return false;
+        }
+        stats_add( g_stats->bytes_sent, n );
+        m_out_bytes -= n;
+        size_t left = n;
+        while( left > 0 ){
+            ws_message* m = m_out.front();
+            size_t rest = m->len - m_out_offset;
+            if( left < rest ){
+                m_out_offset += left;
+                break;
+            }
+            left -= rest;
+            m_out_offset = 0;
+            m_out.pop_front();
+            m->release();
+        }
+    }
+    m_blocked = false;
+    return true;
+}
+
+void ws_session::close( uint16_t code ){
+    m_lock.lock();
+    close_locked( code );
+    if( !m_blocked && !flush_locked() ){
+        m_failed = true;
+        shutdown( m_io->fd, SHUT_RDWR );
+    }
+    m_lock.unlock();
+}
+
+void ws_session::close_locked( uint16_t code ){
+    if( m_close_sent ){
+        return;
+    }
+    char payload[2] = { (char)( code >> 8 ), (char)( code & 0xff ) };
+    ws_message* m = ws_message::create( WS_CLOSE, payload, code ? 2 : 0 );
+    if( m ){
+        queue( m );
+    }
+    m_close_sent = true;
+}
+
+bool ws_session::finished(){
+    m_lock.lock();
+    bool done = m_close_sent && m_out.empty() && ( m_close_received || m_failed );
+    m_lock.unlock();
+    return done;
+}
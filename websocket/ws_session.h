@@ -0,0 +1,115 @@
+#ifndef WS_SESSION_H
+#define WS_SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include "ws_codec.h"
+#include "../locker/locker.h"
+#include "../tls/tls.h"
+
+//编码好的一个服务器帧（帧头加负载），发布时只编码一次，
+//所有订阅者的输出队列引用同一块内存，最后一个引用释放时free
+struct ws_message{
+    std::atomic< int > refs;
+    size_t len;
+
+    //引用计数为1、内容未填写的消息，len是帧的总长度
+    static ws_message* allocate( size_t len );
+    //编码一个完整的帧
+    static ws_message* create( uint8_t opcode, const char* payload, size_t len );
+    char* data() { return ( char* )( this + 1 ); }
+    void retain(){ refs.fetch_add( 1, std::memory_order_relaxed ); }
+    void release();
+};
+
+//升级之后的一个WebSocket连接：帧解析、控制帧、输出队列
+//连接的读和flush在所属reactor线程中进行，send可以由任何线程的发布者调用，
+//两者都在m_lock下操作socket（TLS连接的SSL对象不能同时读写）
+class ws_session{
+public:
+    //收齐的一条数据消息
+    struct message{
+        uint8_t opcode;
+        std::string data;
+    };
+    //一条消息（可能由多个分片组成）的上限
+    static const size_t MAX_MESSAGE = 65536;
+    static const int INPUT_SIZE = 16384;
+    //输出队列超过这个长度说明对方读得太慢，直接断开，不让它拖住发布者
+    static const size_t MAX_QUEUED = 1 << 20;
+
+    //publish为true时对方发来的数据消息发布到channel
+    ws_session( conn_io* io, const char* channel, bool publish );
+    ~ws_session();
+
+    const std::string& channel() const { return m_channel; }
+    bool publisher() const { return m_publish; }
+    //在reactor中开始处理之前，升级的响应已经放进输出队列
+    bool started() const { return m_started; }
+    void start(){ m_started = true; }
+
+    //HTTP/1.1解析时多读进来的字节
+    void feed( const char* data, int len );
+    //放入一段原样发送的数据，例如101响应
+    void queue_raw( const char* data, size_t len );
+    //读到EAGAIN并解析所有完整的帧，收齐的数据消息追加到out
+    //ping、close等控制帧在这里直接回复，连接断开时返回false
+    bool read( std::vector< message >& out );
+    //发送一条共享的消息，对方太慢或者连接已经关闭时丢弃
+    void send( ws_message* m );
+    //尽量把输出队列写到socket，出错返回false
+    bool flush();
+    //关闭握手：发出close帧，code为0时不带状态码
+    void close( uint16_t code );
+    //close已经发出并且对方也关闭了（或者是我们因为错误关闭），可以关闭TCP连接
+    bool finished();
+
+    //ws_hub中订阅者数组的下标
+    size_t m_index;
+
+private:
+    bool parse( std::vector< message >& out );
+    bool on_control();
+    void queue( ws_message* m );
+    bool flush_locked();
+    void close_locked( uint16_t code );
+
+    conn_io* m_io;
+    std::string m_channel;
+    bool m_publish;
+    bool m_started;
+    locker m_lock;
+
+    //输入
+    char m_in[ INPUT_SIZE ];
+    int m_in_len;
+    //正在收的帧：剩余负载长度、掩码和掩码位置
+    bool m_in_frame;
+    uint8_t m_frame_opcode;
+    bool m_frame_fin;
+    uint64_t m_frame_left;
+    uint8_t m_mask[4];
+    size_t m_mask_offset;
+    //正在收的数据消息，分片依次追加；控制帧的负载单独放
+    bool m_in_message;
+    uint8_t m_message_opcode;
+    std::string m_message;
+    std::string m_control;
+
+    //输出队列
+    std::deque< ws_message* > m_out;
+    size_t m_out_offset;
+    size_t m_out_bytes;
+    bool m_blocked;
+
+    bool m_close_sent;
+    bool m_close_received;
+    //协议错误或者连接已经不能用，close发出后不等对方回复
+    bool m_failed;
+};
+
+#endif